@@ -6,7 +6,19 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <stdexcept>
+#include <thread>
 #include "bst.h"
+#include "frozenbst.h"
+
+// union_with, intersect_with and difference_with hand the two halves of
+// their recursion to separate threads (build with -pthread), down to a
+// depth that gives every core something to do. Subtrees lower than this
+// are always handled on the current thread, where starting a thread would
+// cost more than the work it takes over.
+#ifndef AVL_PARALLEL_MIN_HEIGHT
+#define AVL_PARALLEL_MIN_HEIGHT 14
+#endif
 
 struct KeyError { };
 
@@ -21,19 +33,21 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    template<typename... Args>
+    explicit AVLNode(AVLNode<Key, Value>* parent, Args&&... args);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
-    // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
-    // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    // Getters for parent, left, and right. These hide the Node versions since they
+    // return pointers to AVLNodes - not plain Nodes. They are resolved statically,
+    // see the Node class in bst.h for more information.
+    AVLNode<Key, Value>* getParent() const;
+    AVLNode<Key, Value>* getLeft() const;
+    AVLNode<Key, Value>* getRight() const;
 
 protected:
     int8_t balance_;    // effectively a signed char
@@ -57,7 +71,19 @@ AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Va
 }
 
 /**
-* A destructor which does nothing.
+* A constructor building the item in place, see the matching Node constructor.
+*/
+template<class Key, class Value>
+template<typename... Args>
+AVLNode<Key, Value>::AVLNode(AVLNode<Key, Value> *parent, Args&&... args) :
+    Node<Key, Value>(parent, std::forward<Args>(args)...), balance_(0)
+{
+
+}
+
+/**
+* A destructor which does nothing. It must stay that way, since nodes are
+* destroyed through the Node destructor.
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::~AVLNode()
@@ -93,7 +119,7 @@ void AVLNode<Key, Value>::updateBalance(int8_t diff)
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
+* A function hiding Node::getParent since a static_cast is necessary to make sure
 * that our node is a AVLNode.
 */
 template<class Key, class Value>
@@ -103,7 +129,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
 template<class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
@@ -112,7 +138,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
 template<class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
@@ -121,6 +147,15 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 }
 
 
+/**
+* Sets the balance of a freshly built AVLNode from the heights of its subtrees.
+*/
+template<class Key, class Value>
+void initSubtreeBalance(AVLNode<Key, Value>* node, int leftHeight, int rightHeight)
+{
+    node->setBalance(rightHeight - leftHeight);
+}
+
 /*
   -----------------------------------------------
   End implementations for the AVLNode class.
@@ -128,25 +163,122 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
+/**
+* A self-balancing AVL tree. Every member that creates nodes is either
+* virtual or goes through the node-building hooks of BinarySearchTree,
+* and is overridden here so that the nodes are built as AVLNodes and
+* rebalanced, also when called through a BinarySearchTree reference.
+* emplace, try_emplace and assign_sorted are redeclared as well, so that
+* direct calls build their nodes in place without the hooks.
+*/
 template <class Key, class Value>
 class AVLTree : public BinarySearchTree<Key, Value>
 {
 public:
+    typedef typename BinarySearchTree<Key, Value>::iterator iterator;
+
+    AVLTree();
     virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
+    virtual void insert (std::pair<const Key, Value> &&new_item);
+    virtual iterator insert(iterator hint, const std::pair<const Key, Value>& new_item);
+    virtual iterator insert(iterator hint, std::pair<const Key, Value>&& new_item);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
     virtual void remove(const Key& key);  // TODO
+    template<typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last);
+    FrozenTree<Key, Value> freeze() const;
+    void split(const Key& key, AVLTree<Key, Value>& left, AVLTree<Key, Value>& right);
+    void join(AVLTree<Key, Value>& left, const std::pair<const Key, Value>& pivot,
+              AVLTree<Key, Value>& right);
+    void join(AVLTree<Key, Value>& left, AVLTree<Key, Value>& right);
+    void union_with(AVLTree<Key, Value>& other);
+    void intersect_with(AVLTree<Key, Value>& other);
+    void difference_with(AVLTree<Key, Value>& other);
 protected:
-    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    typedef typename BinarySearchTree<Key, Value>::ItemSource ItemSource;
+    virtual std::pair<iterator, bool> emplaceNode(ItemSource& item);
+    virtual std::pair<iterator, bool> tryEmplaceNode(const Key& key, ItemSource& item);
+    virtual void assignSortedItems(ItemSource& items, std::size_t count);
+    virtual void insertBatch(std::vector<std::pair<Key, Value> >& batch);
+    virtual void removeBatch(std::vector<Key>& keys);
+
+    void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
 
     // Add helper functions here
-    virtual void insertFix(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node);
-    virtual void removeFix(AVLNode<Key, Value>* node, int diff); 
-		virtual void rotateRight(AVLNode<Key, Value>* origParent);
-		virtual void rotateLeft(AVLNode<Key, Value>* origParent);
+    // (non-virtual so that the rebalancing path can be inlined)
+    void insertFix(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node);
+    void removeFix(AVLNode<Key, Value>* node, int diff); 
+		void rotateRight(AVLNode<Key, Value>* origParent);
+		void rotateLeft(AVLNode<Key, Value>* origParent);
+		std::pair<iterator, bool> rebalanceInserted(std::pair<Node<Key, Value>*, bool> result);
 		AVLNode<Key, Value>* internalFind(const Key& k) const;
 		void noChildRemove(AVLNode<Key, Value> *node);
 		void oneChildRemove(AVLNode<Key, Value> *node, int sideIndicate);
+
+		// split/join helpers, working on detached subtrees and their heights
+		static int subtreeHeight(AVLNode<Key, Value>* node);
+		static std::size_t countSmallerSide(AVLNode<Key, Value>* left, AVLNode<Key, Value>* right,
+		                                    std::size_t count);
+		AVLNode<Key, Value>* detachRoot(std::size_t& count);
+		void attachRoot(AVLNode<Key, Value>* root, std::size_t count);
+		AVLNode<Key, Value>* joinNodes(AVLNode<Key, Value>* left, int leftHeight,
+		                               AVLNode<Key, Value>* pivot,
+		                               AVLNode<Key, Value>* right, int rightHeight, int& height);
+		void splitNodes(AVLNode<Key, Value>* node, int height, const Key& key,
+		                AVLNode<Key, Value>*& left, int& leftHeight,
+		                AVLNode<Key, Value>*& right, int& rightHeight,
+		                AVLNode<Key, Value>** match = NULL);
+		AVLNode<Key, Value>* joinPair(AVLNode<Key, Value>* left, int leftHeight,
+		                              AVLNode<Key, Value>* right, int rightHeight, int& height);
+		void splitLast(AVLNode<Key, Value>* node, int height,
+		               AVLNode<Key, Value>*& rest, int& restHeight, AVLNode<Key, Value>*& last);
+
+		// set operation helpers
+		enum SetOperation { setUnion, setIntersection, setDifference };
+
+		// subtrees left over by a set operation, chained through their
+		// roots' parent pointers until they can be freed
+		struct Discarded
+		{
+			AVLNode<Key, Value>* head;
+			AVLNode<Key, Value>* tail;
+		};
+
+		void setOperation(SetOperation op, AVLTree<Key, Value>& other);
+		AVLNode<Key, Value>* setOperationNodes(SetOperation op,
+		                                       AVLNode<Key, Value>* a, int aHeight,
+		                                       AVLNode<Key, Value>* b, int bHeight,
+		                                       int& height, Discarded& discarded, int forkDepth);
+		AVLNode<Key, Value>* removeSortedNodes(AVLNode<Key, Value>* node, int nodeHeight,
+		                                       const Key* first, const Key* last,
+		                                       int& height, Discarded& discarded, int forkDepth);
+		static void expose(AVLNode<Key, Value>* node, int height,
+		                   AVLNode<Key, Value>*& left, int& leftHeight,
+		                   AVLNode<Key, Value>*& right, int& rightHeight);
+		template<typename LeftTask, typename RightTask>
+		void forkJoin(bool fork, LeftTask left, RightTask right, Discarded& discarded);
+		static int forkDepth();
+		static void discard(Discarded& discarded, AVLNode<Key, Value>* subtree);
+		static void spliceDiscarded(Discarded& into, const Discarded& from);
+		std::size_t destroyDiscarded(const Discarded& discarded);
+		std::size_t destroySubtree(AVLNode<Key, Value>* node);
 };
 
+/**
+* Default constructor, which sizes the node pool for AVLNodes.
+*/
+template<class Key, class Value>
+AVLTree<Key, Value>::AVLTree() :
+    BinarySearchTree<Key, Value>(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>))
+{
+
+}
+
 /*
  * Recall: If key is already in the tree, you should 
  * overwrite the current value with the updated value.
@@ -154,68 +286,875 @@ protected:
 template<class Key, class Value>
 void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
 {
-		//if the root is null, insert the new node as the root
-    if(this->root_ == NULL){
-        AVLNode<Key, Value> *node = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
-        this->root_ = node;
-        return;
-    }
-		AVLNode<Key, Value> *temp = static_cast<AVLNode<Key, Value>*>(this->root_);
-		AVLNode<Key, Value>* potentialParent = temp;
-		//otherwise, while we haven't reached the end of the tree
-		while(temp!=NULL){
-			//if the new item is greater than the current node
-			if(new_item.first > temp->getKey()){
-				//advance temp to its right child, advance parent to temp
-				potentialParent = temp;
-				temp = temp->getRight();
-				//if temp was a leaf node (aka is null when it is advanced)
-				//insert the new node as the right child of the leaf node
-				//and update the balances appropriately
-				if(temp == NULL){
-					AVLNode<Key, Value> *rightChild = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
-					potentialParent->setRight(rightChild);
-					rightChild->setParent(potentialParent);
-					if(potentialParent->getBalance() == -1)
-						potentialParent->setBalance(0);
-					else if(potentialParent->getBalance() == 1)
-						potentialParent->setBalance(0);
-					else if(potentialParent->getBalance() == 0){
-						potentialParent->setBalance(1);
-						insertFix(potentialParent, rightChild);
-					}
-					return;
-				}
-			}
-			//otherise if the new item is less than the current node
-			else if(new_item.first < temp->getKey()){
-				//advance temp to its left child, advance parent to temp
-				potentialParent = temp;
-				temp = temp->getLeft();
-				//if temp was a leaf node (aka is null when it is advanced)
-				//insert the new node as the left child of the leaf node	
-				//and update the balances appropriately			
-				if(temp == NULL){
-					AVLNode<Key, Value> *leftChild = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
-					potentialParent->setLeft(leftChild);
-					leftChild->setParent(potentialParent);
-					if(potentialParent->getBalance() == -1)
-						potentialParent->setBalance(0);
-					else if(potentialParent->getBalance() == 1)
-						potentialParent->setBalance(0);
-					else if(potentialParent->getBalance() == 0){
-						potentialParent->setBalance(-1);
-						insertFix(potentialParent, leftChild);
-					}
-					return;
-				}
+    rebalanceInserted(this->template insertItem<AVLNode<Key, Value> >(new_item));
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::insert (std::pair<const Key, Value> &&new_item)
+{
+    rebalanceInserted(this->template insertItem<AVLNode<Key, Value> >(std::move(new_item)));
+}
+
+/**
+* Inserts starting from hint, see BinarySearchTree::insert(iterator, ...).
+* With a good hint only the rebalancing walk remains.
+*/
+template<class Key, class Value>
+typename AVLTree<Key, Value>::iterator
+AVLTree<Key, Value>::insert(iterator hint, const std::pair<const Key, Value>& new_item)
+{
+    return rebalanceInserted(this->template insertItem<AVLNode<Key, Value> >(
+        new_item, this->iteratorNode(hint))).first;
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value>
+typename AVLTree<Key, Value>::iterator
+AVLTree<Key, Value>::insert(iterator hint, std::pair<const Key, Value>&& new_item)
+{
+    return rebalanceInserted(this->template insertItem<AVLNode<Key, Value> >(
+        std::move(new_item), this->iteratorNode(hint))).first;
+}
+
+/**
+* Constructs an item in place, see BinarySearchTree::emplace.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::emplace(Args&&... args)
+{
+    return rebalanceInserted(
+        this->template emplaceItem<AVLNode<Key, Value> >(std::forward<Args>(args)...));
+}
+
+/**
+* Inserts key with a value built from args if key is missing, see
+* BinarySearchTree::try_emplace.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::try_emplace(const Key& key, Args&&... args)
+{
+    return rebalanceInserted(
+        this->template tryEmplaceItem<AVLNode<Key, Value> >(key, std::forward<Args>(args)...));
+}
+
+/**
+* Same as above, but the key is moved into the new node.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::try_emplace(Key&& key, Args&&... args)
+{
+    return rebalanceInserted(
+        this->template tryEmplaceItem<AVLNode<Key, Value> >(std::move(key), std::forward<Args>(args)...));
+}
+
+/**
+* Restores the AVL property after the insertion core linked in a new leaf.
+* Nothing changes if the key was already present.
+*/
+template<class Key, class Value>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::rebalanceInserted(std::pair<Node<Key, Value>*, bool> result)
+{
+		AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(result.first);
+		AVLNode<Key, Value>* parent = node->getParent();
+		if(result.second && parent != NULL){
+			//if the parent was leaning, the new leaf evens it out
+			if(parent->getBalance() != 0){
+				parent->setBalance(0);
 			}
-			//else if already in tree, replace current value with new value
-			else if(new_item.first == temp->getKey()){
-				temp->setValue(new_item.second);
-				return;
+			//otherwise the parent now leans towards the new leaf and the
+			//height change has to be propagated up
+			else{
+				parent->setBalance(node == parent->getRight() ? 1 : -1);
+				insertFix(parent, node);
 			}
 		}
+		return std::make_pair(this->makeIterator(node), result.second);
+}
+
+/**
+* Replaces the contents of the tree with the items in [first, last), which
+* must be sorted by strictly increasing key, in O(n). Every AVLNode gets its
+* balance set directly from the built subtree heights.
+*/
+template<class Key, class Value>
+template<typename ForwardIt>
+void AVLTree<Key, Value>::assign_sorted(ForwardIt first, ForwardIt last)
+{
+    this->template assignSortedNodes<AVLNode<Key, Value> >(first, std::distance(first, last));
+}
+
+/**
+* The node-building hooks of BinarySearchTree, through which its emplace,
+* try_emplace, assign_sorted and load reach AVLTree.
+*/
+template<class Key, class Value>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::emplaceNode(ItemSource& item)
+{
+    return rebalanceInserted(this->template emplaceItem<AVLNode<Key, Value> >(item.make()));
+}
+
+template<class Key, class Value>
+std::pair<typename AVLTree<Key, Value>::iterator, bool>
+AVLTree<Key, Value>::tryEmplaceNode(const Key& key, ItemSource& item)
+{
+    return rebalanceInserted(this->template insertMissing<AVLNode<Key, Value> >(key, item));
+}
+
+template<class Key, class Value>
+void AVLTree<Key, Value>::assignSortedItems(ItemSource& items, std::size_t count)
+{
+    typename BinarySearchTree<Key, Value>::SourceCursor cursor = { &items };
+    this->template assignSortedNodes<AVLNode<Key, Value> >(cursor, count);
+}
+
+/**
+* Returns a read-only copy of the tree laid out for fast searching (see
+* frozenbst.h). The tree itself is left untouched, so later changes to it
+* are not seen by the copy.
+*/
+template<class Key, class Value>
+FrozenTree<Key, Value> AVLTree<Key, Value>::freeze() const
+{
+    return FrozenTree<Key, Value>(this->begin(), this->end(), this->size());
+}
+
+/**
+* Moves every item with a key less than key into left and the rest into
+* right, in O(log n). Whatever left and right held before is deleted, and
+* this tree ends up empty unless it is one of them.
+*
+* No node is copied: left and right keep the slabs their nodes are in
+* alive between them, but each gets a pool of its own, so they can be
+* changed independently, on different threads, from then on. Without
+* BST_ORDER_STATISTICS the two sides are counted in O(min(|left|, |right|)).
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::split(const Key& key, AVLTree<Key, Value>& left,
+                                AVLTree<Key, Value>& right)
+{
+    std::size_t count;
+    AVLNode<Key, Value>* root = detachRoot(count);
+    //park the nodes' slabs while the targets are cleared, since one of
+    //them may be this tree
+    NodePool nodes(this->pool_.slotBytes(), alignof(AVLNode<Key, Value>));
+    nodes.absorb(this->pool_);
+    left.clear();
+    right.clear();
+    nodes.share(left.pool_);
+    right.pool_.absorb(nodes);
+
+    AVLNode<Key, Value>* leftRoot;
+    AVLNode<Key, Value>* rightRoot;
+    int leftHeight, rightHeight;
+    splitNodes(root, subtreeHeight(root), key, leftRoot, leftHeight, rightRoot, rightHeight);
+
+#ifdef BST_ORDER_STATISTICS
+    std::size_t leftCount = this->subtreeSize(leftRoot);
+#else
+    std::size_t leftCount = countSmallerSide(leftRoot, rightRoot, count);
+#endif
+    std::size_t rightCount = count - leftCount;
+    left.attachRoot(leftRoot, leftCount);
+    right.attachRoot(rightRoot, rightCount);
+}
+
+/**
+* Makes this tree hold everything in left, pivot and everything in right,
+* in O(log n). All keys in left must be less than pivot's, and all keys
+* in right greater. left and right end up empty unless one of them is
+* this tree; anything else this tree held is deleted.
+*
+* The nodes of left and right are reused as they are; this tree's pool
+* takes over their slabs and free slots.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::join(AVLTree<Key, Value>& left,
+                               const std::pair<const Key, Value>& pivot,
+                               AVLTree<Key, Value>& right)
+{
+    if((left.rightmost_ != NULL && !(left.rightmost_->getKey() < pivot.first)) ||
+       (right.root_ != NULL && !(pivot.first < right.getSmallestNode()->getKey()))){
+        throw std::invalid_argument("join: keys are out of order");
+    }
+    if(this != &left && this != &right){
+        this->clear();
+    }
+    std::size_t leftCount, rightCount;
+    AVLNode<Key, Value>* leftRoot = left.detachRoot(leftCount);
+    AVLNode<Key, Value>* rightRoot = right.detachRoot(rightCount);
+    this->pool_.absorb(left.pool_);
+    this->pool_.absorb(right.pool_);
+
+    AVLNode<Key, Value>* middle = this->template createNode<AVLNode<Key, Value> >(NULL, pivot);
+    int height;
+    AVLNode<Key, Value>* root = joinNodes(leftRoot, subtreeHeight(leftRoot), middle,
+                                          rightRoot, subtreeHeight(rightRoot), height);
+    attachRoot(root, leftCount + rightCount + 1);
+}
+
+/**
+* Same as above without a pivot: the smallest item of right takes its
+* place.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::join(AVLTree<Key, Value>& left, AVLTree<Key, Value>& right)
+{
+    if(right.root_ == NULL){
+        std::size_t count;
+        AVLNode<Key, Value>* root = left.detachRoot(count);
+        if(this != &left){
+            this->clear();
+        }
+        this->pool_.absorb(left.pool_);
+        attachRoot(root, count);
+        return;
+    }
+    std::pair<const Key, Value> pivot = right.getSmallestNode()->getItem();
+    right.remove(pivot.first);
+    join(left, pivot, right);
+}
+
+/**
+* Height of a subtree in O(log n), following the taller side down.
+*/
+template<class Key, class Value>
+int AVLTree<Key, Value>::subtreeHeight(AVLNode<Key, Value>* node)
+{
+    int height = 0;
+    while(node != NULL){
+        height++;
+        node = (node->getBalance() < 0) ? node->getLeft() : node->getRight();
+    }
+    return height;
+}
+
+/**
+* Number of items in left, given that the detached subtrees left and
+* right hold count items between them. Both are walked in order in step
+* until one runs out, so this takes O(min(|left|, |right|)).
+*/
+template<class Key, class Value>
+std::size_t AVLTree<Key, Value>::countSmallerSide(AVLNode<Key, Value>* left,
+                                                  AVLNode<Key, Value>* right, std::size_t count)
+{
+    Node<Key, Value>* a = left;
+    Node<Key, Value>* b = right;
+    //cut the roots loose so the walks end at the end of their subtree
+    if(a != NULL){
+        a->setParent(NULL);
+        while(a->getLeft() != NULL){
+            a = a->getLeft();
+        }
+    }
+    if(b != NULL){
+        b->setParent(NULL);
+        while(b->getLeft() != NULL){
+            b = b->getLeft();
+        }
+    }
+    std::size_t steps = 0;
+    while(a != NULL && b != NULL){
+        a = BinarySearchTree<Key, Value>::successor(a);
+        b = BinarySearchTree<Key, Value>::successor(b);
+        steps++;
+    }
+    return (a == NULL) ? steps : count - steps;
+}
+
+/**
+* Empties the tree without freeing its nodes, returning the old root and
+* item count.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::detachRoot(std::size_t& count)
+{
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    count = this->nodeCount_;
+    this->root_ = NULL;
+    this->rightmost_ = NULL;
+    this->nodeCount_ = 0;
+    return root;
+}
+
+/**
+* Makes a detached subtree, whose nodes come from this tree's pool, the
+* contents of this (empty) tree.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::attachRoot(AVLNode<Key, Value>* root, std::size_t count)
+{
+    if(root != NULL){
+        root->setParent(NULL);
+    }
+    this->root_ = root;
+    this->rightmost_ = this->getLargestNode();
+    this->nodeCount_ = count;
+}
+
+/**
+* Joins two detached subtrees of the given heights with pivot between
+* them, returning the new root and setting height to its height.
+*
+* If the heights differ by more than one, pivot goes down the inner side
+* of the taller tree to the first subtree c no more than one level taller
+* than the shorter tree, and takes c's place with c and the shorter tree
+* as its children. That makes the taller tree one level taller below
+* pivot's parent, exactly as an insertion there would, so insertFix
+* repairs it.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::joinNodes(AVLNode<Key, Value>* left, int leftHeight,
+                                                     AVLNode<Key, Value>* pivot,
+                                                     AVLNode<Key, Value>* right, int rightHeight,
+                                                     int& height)
+{
+    pivot->setParent(NULL);
+    if(leftHeight <= rightHeight + 1 && rightHeight <= leftHeight + 1){
+        pivot->setLeft(left);
+        pivot->setRight(right);
+        if(left != NULL){
+            left->setParent(pivot);
+        }
+        if(right != NULL){
+            right->setParent(pivot);
+        }
+        pivot->setBalance(rightHeight - leftHeight);
+#ifdef BST_ORDER_STATISTICS
+        this->updateSize(pivot);
+#endif
+        height = std::max(leftHeight, rightHeight) + 1;
+        return pivot;
+    }
+
+    bool leftTaller = leftHeight > rightHeight;
+    AVLNode<Key, Value>* taller = leftTaller ? left : right;
+    AVLNode<Key, Value>* shorter = leftTaller ? right : left;
+    int tallHeight = leftTaller ? leftHeight : rightHeight;
+    int shortHeight = leftTaller ? rightHeight : leftHeight;
+
+    //walk down the side of the taller tree that faces the shorter one
+    AVLNode<Key, Value>* parent = NULL;
+    AVLNode<Key, Value>* cut = taller;
+    int cutHeight = tallHeight;
+    while(cutHeight > shortHeight + 1){
+        parent = cut;
+        if(leftTaller){
+            cutHeight -= (cut->getBalance() >= 0) ? 1 : 2;
+            cut = cut->getRight();
+        }
+        else{
+            cutHeight -= (cut->getBalance() <= 0) ? 1 : 2;
+            cut = cut->getLeft();
+        }
+    }
+    if(leftTaller){
+        pivot->setLeft(cut);
+        pivot->setRight(shorter);
+        pivot->setBalance(shortHeight - cutHeight);
+        parent->setRight(pivot);
+    }
+    else{
+        pivot->setLeft(shorter);
+        pivot->setRight(cut);
+        pivot->setBalance(cutHeight - shortHeight);
+        parent->setLeft(pivot);
+    }
+    pivot->setParent(parent);
+    if(cut != NULL){
+        cut->setParent(pivot);
+    }
+    if(shorter != NULL){
+        shorter->setParent(pivot);
+    }
+#ifdef BST_ORDER_STATISTICS
+    //everything above pivot gained the shorter tree and pivot itself
+    for(Node<Key, Value>* temp = pivot; temp != NULL; temp = temp->getParent()){
+        this->updateSize(temp);
+    }
+#endif
+    //insertFix keeps root_ up to date, so borrow it for the taller tree
+    //(root_ must be free: this tree's own contents are detached first);
+    //the tree only got taller if the change reached its (unrotated) root
+    //and tipped it off balance
+    this->root_ = taller;
+    int8_t rootBalance = taller->getBalance();
+    insertFix(pivot, cut);
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    this->root_ = NULL;
+    bool grew = (root == taller && rootBalance == 0 && taller->getBalance() != 0);
+    height = tallHeight + (grew ? 1 : 0);
+    return root;
+}
+
+/**
+* Splits the detached subtree at node, of the given height, into the keys
+* less than key and the rest, by taking node apart and joining its pieces
+* back together on the way up. Each join costs about the difference in
+* height of its two sides, and those telescope to O(log n) overall.
+*
+* If match is given, it receives the (detached) node holding key, or NULL,
+* and that node goes to neither side.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::splitNodes(AVLNode<Key, Value>* node, int height, const Key& key,
+                                     AVLNode<Key, Value>*& left, int& leftHeight,
+                                     AVLNode<Key, Value>*& right, int& rightHeight,
+                                     AVLNode<Key, Value>** match)
+{
+    if(node == NULL){
+        if(match != NULL){
+            *match = NULL;
+        }
+        left = NULL;
+        right = NULL;
+        leftHeight = 0;
+        rightHeight = 0;
+        return;
+    }
+    AVLNode<Key, Value>* nodeLeft;
+    AVLNode<Key, Value>* nodeRight;
+    int nodeLeftHeight, nodeRightHeight;
+    expose(node, height, nodeLeft, nodeLeftHeight, nodeRight, nodeRightHeight);
+    AVLNode<Key, Value>* middle;
+    int middleHeight;
+    if(key < node->getKey()){
+        splitNodes(nodeLeft, nodeLeftHeight, key, left, leftHeight, middle, middleHeight, match);
+        right = joinNodes(middle, middleHeight, node, nodeRight, nodeRightHeight, rightHeight);
+    }
+    else if(node->getKey() < key){
+        splitNodes(nodeRight, nodeRightHeight, key, middle, middleHeight, right, rightHeight, match);
+        left = joinNodes(nodeLeft, nodeLeftHeight, node, middle, middleHeight, leftHeight);
+    }
+    //node holds key itself, so it starts the right side unless the caller
+    //wants it separately
+    else{
+        left = nodeLeft;
+        leftHeight = nodeLeftHeight;
+        if(match != NULL){
+            *match = node;
+            right = nodeRight;
+            rightHeight = nodeRightHeight;
+        }
+        else{
+            right = joinNodes(NULL, 0, node, nodeRight, nodeRightHeight, rightHeight);
+        }
+    }
+}
+
+/**
+* Joins two detached subtrees, all of left's keys being less than
+* right's, with the largest node of left as the pivot.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::joinPair(AVLNode<Key, Value>* left, int leftHeight,
+                                                    AVLNode<Key, Value>* right, int rightHeight,
+                                                    int& height)
+{
+    if(left == NULL){
+        height = rightHeight;
+        return right;
+    }
+    AVLNode<Key, Value>* rest;
+    AVLNode<Key, Value>* last;
+    int restHeight;
+    splitLast(left, leftHeight, rest, restHeight, last);
+    return joinNodes(rest, restHeight, last, right, rightHeight, height);
+}
+
+/**
+* Takes the largest node off a detached subtree, returning it detached in
+* last and the rebalanced remainder in rest.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::splitLast(AVLNode<Key, Value>* node, int height,
+                                    AVLNode<Key, Value>*& rest, int& restHeight,
+                                    AVLNode<Key, Value>*& last)
+{
+    AVLNode<Key, Value>* nodeLeft;
+    AVLNode<Key, Value>* nodeRight;
+    int nodeLeftHeight, nodeRightHeight;
+    expose(node, height, nodeLeft, nodeLeftHeight, nodeRight, nodeRightHeight);
+    if(nodeRight == NULL){
+        last = node;
+        rest = nodeLeft;
+        restHeight = nodeLeftHeight;
+        return;
+    }
+    AVLNode<Key, Value>* middle;
+    int middleHeight;
+    splitLast(nodeRight, nodeRightHeight, middle, middleHeight, last);
+    rest = joinNodes(nodeLeft, nodeLeftHeight, node, middle, middleHeight, restHeight);
+}
+
+/**
+* Adds every item of other to this tree, in O(m log(n/m + 1)) for trees
+* of m <= n items. Where both trees hold a key, other's value wins.
+* other ends up empty.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::union_with(AVLTree<Key, Value>& other)
+{
+    setOperation(setUnion, other);
+}
+
+/**
+* Keeps only the items whose keys other holds too, with this tree's
+* values. other ends up empty.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::intersect_with(AVLTree<Key, Value>& other)
+{
+    setOperation(setIntersection, other);
+}
+
+/**
+* Removes every key that other holds. other ends up empty.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::difference_with(AVLTree<Key, Value>& other)
+{
+    setOperation(setDifference, other);
+}
+
+/**
+* Hook behind insert_batch. The sorted batch is built into a tree of its
+* own in O(k) and merged in with union_with, so the work is split across
+* threads for large trees.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::insertBatch(std::vector<std::pair<Key, Value> >& batch)
+{
+    this->sortBatch(batch, typename BinarySearchTree<Key, Value>::ItemLess());
+    AVLTree<Key, Value> items;
+    items.assign_sorted(std::make_move_iterator(batch.begin()),
+                        std::make_move_iterator(batch.end()));
+    union_with(items);
+}
+
+/**
+* Hook behind remove_batch. Works like difference_with against the sorted
+* keys, without building a tree out of them.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::removeBatch(std::vector<Key>& keys)
+{
+    this->sortBatch(keys, typename BinarySearchTree<Key, Value>::KeyLess());
+    if(keys.empty()){
+        return;
+    }
+    std::size_t count;
+    AVLNode<Key, Value>* root = detachRoot(count);
+    Discarded discarded = { NULL, NULL };
+    int height;
+    root = removeSortedNodes(root, subtreeHeight(root), &keys[0], &keys[0] + keys.size(),
+                             height, discarded, forkDepth());
+    std::size_t dropped = destroyDiscarded(discarded);
+    attachRoot(root, count - dropped);
+}
+
+/**
+* Shared body of the set operations: both trees are taken apart and
+* rebuilt into one by setOperationNodes, reusing their nodes. Nodes that
+* don't make it into the result are only freed at the end, once all
+* threads are done, since the pool is not thread-safe.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::setOperation(SetOperation op, AVLTree<Key, Value>& other)
+{
+    if(&other == this){
+        if(op == setDifference){
+            this->clear();
+        }
+        return;
+    }
+    std::size_t count, otherCount;
+    AVLNode<Key, Value>* a = detachRoot(count);
+    AVLNode<Key, Value>* b = other.detachRoot(otherCount);
+    this->pool_.absorb(other.pool_);
+
+    Discarded discarded = { NULL, NULL };
+    int height;
+    AVLNode<Key, Value>* root = setOperationNodes(op, a, subtreeHeight(a), b, subtreeHeight(b),
+                                                  height, discarded, forkDepth());
+    std::size_t dropped = destroyDiscarded(discarded);
+    attachRoot(root, count + otherCount - dropped);
+}
+
+/**
+* Combines the detached subtrees a and b: a's root is used to split b, the
+* two halves are combined recursively (on two threads while forkDepth
+* allows), and the results are joined again around a's root or its match
+* in b, or without a pivot if neither belongs in the result.
+*
+* A union or difference keeps whole subtrees of a that b has nothing to
+* say about, without visiting them.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::setOperationNodes(SetOperation op,
+                                                             AVLNode<Key, Value>* a, int aHeight,
+                                                             AVLNode<Key, Value>* b, int bHeight,
+                                                             int& height, Discarded& discarded,
+                                                             int forkDepth)
+{
+    if(a == NULL || b == NULL){
+        //a union keeps whatever is left, a difference only what is left of a
+        if(op == setUnion || (op == setDifference && a != NULL)){
+            height = (a == NULL) ? bHeight : aHeight;
+            return (a == NULL) ? b : a;
+        }
+        discard(discarded, (a == NULL) ? b : a);
+        height = 0;
+        return NULL;
+    }
+    AVLNode<Key, Value>* aLeft;
+    AVLNode<Key, Value>* aRight;
+    int aLeftHeight, aRightHeight;
+    expose(a, aHeight, aLeft, aLeftHeight, aRight, aRightHeight);
+    AVLNode<Key, Value>* bLeft;
+    AVLNode<Key, Value>* bRight;
+    AVLNode<Key, Value>* match;
+    int bLeftHeight, bRightHeight;
+    splitNodes(b, bHeight, a->getKey(), bLeft, bLeftHeight, bRight, bRightHeight, &match);
+
+    AVLNode<Key, Value>* left;
+    AVLNode<Key, Value>* right;
+    int leftHeight, rightHeight;
+    forkJoin(forkDepth > 0 && std::max(aHeight, bHeight) >= AVL_PARALLEL_MIN_HEIGHT,
+        [&](AVLTree<Key, Value>& tree, Discarded& into) {
+            left = tree.setOperationNodes(op, aLeft, aLeftHeight, bLeft, bLeftHeight,
+                                          leftHeight, into, forkDepth - 1);
+        },
+        [&](AVLTree<Key, Value>& tree, Discarded& into) {
+            right = tree.setOperationNodes(op, aRight, aRightHeight, bRight, bRightHeight,
+                                           rightHeight, into, forkDepth - 1);
+        },
+        discarded);
+
+    AVLNode<Key, Value>* pivot = NULL;
+    if(op == setUnion){
+        //other's value wins
+        if(match != NULL){
+            discard(discarded, a);
+            pivot = match;
+        }
+        else{
+            pivot = a;
+        }
+    }
+    else if(op == setIntersection){
+        if(match != NULL){
+            discard(discarded, match);
+            pivot = a;
+        }
+        else{
+            discard(discarded, a);
+        }
+    }
+    else{
+        if(match != NULL){
+            discard(discarded, match);
+            discard(discarded, a);
+        }
+        else{
+            pivot = a;
+        }
+    }
+    if(pivot == NULL){
+        return joinPair(left, leftHeight, right, rightHeight, height);
+    }
+    return joinNodes(left, leftHeight, pivot, right, rightHeight, height);
+}
+
+/**
+* Removes the keys in the sorted range [first, last) from the detached
+* subtree at node: the keys are split around node's key, and the two
+* sides are handled recursively (in parallel while forkDepth allows)
+* before being joined back, with node as the pivot unless it was removed.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::removeSortedNodes(AVLNode<Key, Value>* node,
+                                                             int nodeHeight,
+                                                             const Key* first, const Key* last,
+                                                             int& height, Discarded& discarded,
+                                                             int forkDepth)
+{
+    if(node == NULL || first == last){
+        height = nodeHeight;
+        return node;
+    }
+    AVLNode<Key, Value>* nodeLeft;
+    AVLNode<Key, Value>* nodeRight;
+    int nodeLeftHeight, nodeRightHeight;
+    expose(node, nodeHeight, nodeLeft, nodeLeftHeight, nodeRight, nodeRightHeight);
+    const Key* middle = std::lower_bound(first, last, node->getKey());
+    bool removed = (middle != last && !(node->getKey() < *middle));
+
+    AVLNode<Key, Value>* left;
+    AVLNode<Key, Value>* right;
+    int leftHeight, rightHeight;
+    forkJoin(forkDepth > 0 && nodeHeight >= AVL_PARALLEL_MIN_HEIGHT,
+        [&](AVLTree<Key, Value>& tree, Discarded& into) {
+            left = tree.removeSortedNodes(nodeLeft, nodeLeftHeight, first, middle,
+                                          leftHeight, into, forkDepth - 1);
+        },
+        [&](AVLTree<Key, Value>& tree, Discarded& into) {
+            right = tree.removeSortedNodes(nodeRight, nodeRightHeight,
+                                           middle + (removed ? 1 : 0), last,
+                                           rightHeight, into, forkDepth - 1);
+        },
+        discarded);
+    if(removed){
+        discard(discarded, node);
+        return joinPair(left, leftHeight, right, rightHeight, height);
+    }
+    return joinNodes(left, leftHeight, node, right, rightHeight, height);
+}
+
+/**
+* Takes node out of its detached subtree of the given height, handing
+* back its (detached) children and their heights.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::expose(AVLNode<Key, Value>* node, int height,
+                                 AVLNode<Key, Value>*& left, int& leftHeight,
+                                 AVLNode<Key, Value>*& right, int& rightHeight)
+{
+    left = node->getLeft();
+    right = node->getRight();
+    leftHeight = height - (node->getBalance() > 0 ? 2 : 1);
+    rightHeight = height - (node->getBalance() < 0 ? 2 : 1);
+    if(left != NULL){
+        left->setParent(NULL);
+    }
+    if(right != NULL){
+        right->setParent(NULL);
+    }
+    node->setLeft(NULL);
+    node->setRight(NULL);
+}
+
+/**
+* Runs left and right, each given the AVLTree to join through and the
+* list to discard nodes to. If fork is set, left runs on a new thread
+* with a scratch tree of its own (joinNodes borrows the tree's root_) and
+* a list of its own that is spliced onto discarded afterwards. Without a
+* thread, both run here.
+*/
+template<class Key, class Value>
+template<typename LeftTask, typename RightTask>
+void AVLTree<Key, Value>::forkJoin(bool fork, LeftTask left, RightTask right,
+                                   Discarded& discarded)
+{
+    std::unique_ptr<AVLTree<Key, Value> > workspace;
+    std::thread worker;
+    Discarded leftDiscarded = { NULL, NULL };
+    if(fork){
+        try{
+            workspace.reset(new AVLTree<Key, Value>());
+            worker = std::thread([&]() {
+                left(*workspace, leftDiscarded);
+            });
+        }
+        catch(...){
+        }
+    }
+    if(worker.joinable()){
+        right(*this, discarded);
+        worker.join();
+        spliceDiscarded(discarded, leftDiscarded);
+    }
+    else{
+        left(*this, discarded);
+        right(*this, discarded);
+    }
+}
+
+/**
+* How many levels deep the recursions fork, each level doubling the
+* number of threads at work.
+*/
+template<class Key, class Value>
+int AVLTree<Key, Value>::forkDepth()
+{
+    int depth = 0;
+    for(unsigned threads = 1; threads < BST_PARALLEL_THREADS; threads *= 2){
+        depth++;
+    }
+    return depth;
+}
+
+/**
+* Puts a detached subtree on the list of those to be freed.
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::discard(Discarded& discarded, AVLNode<Key, Value>* subtree)
+{
+    if(subtree == NULL){
+        return;
+    }
+    subtree->setParent(discarded.head);
+    discarded.head = subtree;
+    if(discarded.tail == NULL){
+        discarded.tail = subtree;
+    }
+}
+
+/**
+* Moves everything on from onto into, in O(1).
+*/
+template<class Key, class Value>
+void AVLTree<Key, Value>::spliceDiscarded(Discarded& into, const Discarded& from)
+{
+    if(from.head == NULL){
+        return;
+    }
+    from.tail->setParent(into.head);
+    if(into.tail == NULL){
+        into.tail = from.tail;
+    }
+    into.head = from.head;
+}
+
+/**
+* Frees every subtree on the list, returning how many nodes there were.
+*/
+template<class Key, class Value>
+std::size_t AVLTree<Key, Value>::destroyDiscarded(const Discarded& discarded)
+{
+    std::size_t count = 0;
+    for(AVLNode<Key, Value>* temp = discarded.head; temp != NULL; ){
+        AVLNode<Key, Value>* next = temp->getParent();
+        count += destroySubtree(temp);
+        temp = next;
+    }
+    return count;
+}
+
+/**
+* Frees every node of a subtree, returning how many there were.
+*/
+template<class Key, class Value>
+std::size_t AVLTree<Key, Value>::destroySubtree(AVLNode<Key, Value>* node)
+{
+    if(node == NULL){
+        return 0;
+    }
+    std::size_t count = destroySubtree(node->getLeft()) + destroySubtree(node->getRight());
+    this->destroyNode(node);
+    return count + 1;
 }
 
 /*
@@ -230,6 +1169,8 @@ void AVLTree<Key, Value>:: remove(const Key& key)
   if(target == NULL){
     return;
   }
+	this->unlinkRightmost(target);
+	this->nodeCount_--;
 	AVLNode<Key, Value> *parent = target->getParent();
 	AVLNode<Key, Value> *pred = NULL;
 	int diff = 0;
@@ -250,7 +1191,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
 	//if the target is the root, delete and set the root to null
 	if(target->getLeft() == NULL && target->getRight() == NULL){
 		if(target == this->root_){
-			delete target;
+			this->destroyNode(target);
 			this->root_ = NULL;
 		}
 		//otherwise call helper
@@ -321,6 +1262,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* origParent){
+		BST_STAT(this->stats_.rotateRight++);
 		//take a left child, make it the parent, 
 		//make the original parent the new right child
 		//store right subtree of new parent and make it the left subtree of 
@@ -364,11 +1306,17 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* origParent){
 		//node we were rotating
 		if(temp != NULL)
 			temp->setParent(origParent);
+#ifdef BST_ORDER_STATISTICS
+		//origParent is now below leftChild, so it has to be recounted first
+		this->updateSize(origParent);
+		this->updateSize(leftChild);
+#endif
 
 }
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* origParent){
+		BST_STAT(this->stats_.rotateLeft++);
 		//TODO
 		//take right child, make it the new parent, make original parent
 		//the new left child, store the left subtree of new parent
@@ -413,10 +1361,16 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* origParent){
 		//node we were rotating
 		if(temp != NULL)
 			temp->setParent(origParent);
+#ifdef BST_ORDER_STATISTICS
+		//origParent is now below rightChild, so it has to be recounted first
+		this->updateSize(origParent);
+		this->updateSize(rightChild);
+#endif
 }
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::insertFix(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node){
+		BST_STAT(TreeStats::FixLevel level(this->stats_.insertFix));
 		//if parent or grandparent is null, return
 		if(parent == NULL || parent->getParent() == NULL){
 			return;
@@ -522,6 +1476,7 @@ void AVLTree<Key, Value>::insertFix(AVLNode<Key, Value>* parent, AVLNode<Key, Va
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value>* node, int diff){
+		BST_STAT(TreeStats::FixLevel level(this->stats_.removeFix));
     //if input in null return
 		if(node == NULL){
 			return;
@@ -665,27 +1620,31 @@ void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value>* node, int diff){
 
 template<class Key, class Value>
 AVLNode<Key, Value>* AVLTree<Key, Value>::internalFind(const Key& k) const{
+		BST_STAT(TreeStats::Lookup lookup(this->stats_));
 		//if empty, return
 		if(this->root_ == NULL){
 			return NULL;
 		}
 		//if the node to find is the root, return the root
-		if(this->root_->getKey() == k){
+		BST_STAT(lookup.visit());
+		if(BST_COMPARE(this->root_->getKey() == k)){
 			return static_cast<AVLNode<Key, Value>*>(this->root_);
 		}
 		AVLNode<Key, Value> *temp = static_cast<AVLNode<Key, Value>*>(this->root_);
 		//while we haven't reached the end of the tree
 		while(temp != NULL){
+			//the root was counted above
+			BST_STAT(if(temp != this->root_) lookup.visit());
 			//if the key we want is greater than the current node, go right
-			if(k > temp->getKey()){
+			if(BST_COMPARE(k > temp->getKey())){
 				temp = temp->getRight();
 			}
 			// else if the key we want is less than the current node, go left
-			else if(k < temp->getKey()){
+			else if(BST_COMPARE(k < temp->getKey())){
 				temp = temp->getLeft();
 			}
 			//else if the key is equal to the current node, return the current node
-			else if(k == temp->getKey()){
+			else if(BST_COMPARE(k == temp->getKey())){
 				return static_cast<AVLNode<Key, Value>*>(temp);
 			}
 		}
@@ -695,6 +1654,9 @@ AVLNode<Key, Value>* AVLTree<Key, Value>::internalFind(const Key& k) const{
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::noChildRemove(AVLNode<Key, Value> *node){
+#ifdef BST_ORDER_STATISTICS
+		this->shrinkPath(node);
+#endif
 		AVLNode<Key, Value> *goalParent = node->getParent();
 		AVLNode<Key, Value> *goalrChild = goalParent->getRight();
 		AVLNode<Key, Value> *goallChild = goalParent->getLeft();
@@ -707,19 +1669,22 @@ void AVLTree<Key, Value>::noChildRemove(AVLNode<Key, Value> *node){
 			goalParent->setLeft(NULL);
 		}
 		//delete and null node
-		delete node;
+		this->destroyNode(node);
 		node = NULL;
 		return;
 }
 
 template<class Key, class Value>
 void AVLTree<Key, Value>::oneChildRemove(AVLNode<Key, Value> *node, int sideIndicate){
+#ifdef BST_ORDER_STATISTICS
+		this->shrinkPath(node);
+#endif
 //if the node to remove is the root and it has a left child but no right
 		if(node->getKey() == this->root_->getKey() && sideIndicate == 0){
 			//set the left child to be the new root and delete and null the old root
 			this->root_ = this->root_->getLeft();
 			this->root_->setParent(NULL);
-			delete node;
+			this->destroyNode(node);
 			node = NULL;
 			return;
 		}
@@ -728,12 +1693,12 @@ void AVLTree<Key, Value>::oneChildRemove(AVLNode<Key, Value> *node, int sideIndi
 			//set the right child to be the new root and delete and null the old root
 			this->root_ = this->root_->getRight();
 			this->root_->setParent(NULL);
-			delete node;
+			this->destroyNode(node);
 			node = NULL;
 			return;
 		}
 		
-		AVLNode<Key, Value> *goalChild;
+		AVLNode<Key, Value> *goalChild = NULL;
 		//if child is left, set goalChild left
 		if(sideIndicate == 0){
 			goalChild = node->getLeft();
@@ -745,7 +1710,7 @@ void AVLTree<Key, Value>::oneChildRemove(AVLNode<Key, Value> *node, int sideIndi
 
 		//get goals parent, delete goal, promote goal node child to where goal used to be
 		AVLNode<Key, Value> *goalParent = node->getParent();
-		delete node;
+		this->destroyNode(node);
 		node = NULL;
 		goalChild->setParent(goalParent);
 		if(goalParent->getKey() < goalChild->getKey()){
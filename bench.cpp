@@ -0,0 +1,633 @@
+// Throughput benchmark for BinarySearchTree, AVLTree and std::map.
+//
+// Every (tree, workload, size) combination runs in its own child process,
+// so that its peak RSS (VmHWM) covers that run alone and a crash or an
+// out-of-memory kill only loses one row. A run has four timed phases:
+//   build    insert size keys, in the workload's order
+//   find     --ops lookups on the built tree
+//   ops      a mix of finds, inserts and removes (--ops in all)
+//   iterate  one in-order walk over the whole tree
+// Keys are generated in batches outside the timed region, so the numbers
+// are for the tree alone.
+//
+// Alongside throughput, one operation in every --sample (default 8) is
+// timed on its own with CycleClock and recorded into a LatencyHistogram
+// (see latency.h) for its kind: build inserts, lookups, the finds,
+// inserts and removes of the mix, and single iterator steps. Each gets a
+// row with
+// p50/p99/p99.9/max, so rebalancing spikes show up even where the
+// average hides them. Sampling keeps the timer's own cost (an lfence'd
+// rdtsc pair, subtracted from each sample) out of the throughput figures.
+//
+// Each phase also reads the hardware counters of perf_counters.h
+// (instructions, cycles, L1d/LLC/dTLB misses, branch misses), reported
+// per operation so layout changes can be judged by misses/op. Events the
+// system doesn't allow are left empty; use --sample 0 for counts free of
+// the sampling timer's instructions.
+//
+// Lookups and the mix draw keys from twice the built range, so about
+// half of them miss, except under zipf.
+//
+// Workloads:
+//   uniform      random build order, 50% find / 25% insert / 25% remove
+//   sorted       ascending build order, then the uniform mix
+//   reverse      descending build order, then the uniform mix
+//   zipf         random build order, 90/5/5 mix over Zipf(0.99) keys
+//   readheavy    random build order, 90/5/5 mix over uniform keys
+//   deleteheavy  random build order, 10/10/80 mix over uniform keys
+//
+// BinarySearchTree doesn't rebalance, so sorted and reverse builds give it
+// a list; those runs are skipped above BENCH_UNBALANCED_MAX keys.
+//
+// Usage: bench [--format csv|json] [--max-size N] [--ops N]
+//              [--trees bst,avl,map] [--workloads uniform,zipf,...] [--sample N]
+// Sizes sweep 1e3, 1e4, ... up to --max-size (default 1e6, at most 1e8).
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bst.h"
+#include "avlbst.h"
+#include "bench_common.h"
+#include "latency.h"
+#include "perf_counters.h"
+
+#define BENCH_BATCH 4096
+#define BENCH_UNBALANCED_MAX 20000
+#define BENCH_SIZE_LIMIT 100000000L
+#define BENCH_SAMPLE_EVERY 8
+
+typedef long BenchKey;
+
+enum OpType { findOp, insertOp, removeOp };
+
+struct Op
+{
+    OpType type;
+    BenchKey key;
+};
+
+enum Phase { buildPhase, findPhase, opsPhase, iteratePhase, phaseCount };
+
+//latency series; the three mix ones are in OpType order
+enum Series { buildInsertSeries, findSeries, mixFindSeries, mixInsertSeries, mixRemoveSeries,
+              iterateSeries, seriesCount };
+
+struct Settings
+{
+    uint64_t ops;           // operations in the mixed phase
+    unsigned sampleEvery;   // time one operation in this many, 0 for none
+    CycleClock clock;
+};
+
+/**
+* What a child process sends back to the parent.
+*/
+struct RunResult
+{
+    uint64_t ops[phaseCount];
+    double seconds[phaseCount];
+    uint64_t mixOps[3];                     // per OpType
+    LatencyHistogram latency[seriesCount];  // in clock ticks
+    PerfCounts perf[phaseCount];
+    long peakRssKb;
+    uint64_t checksum;   // keeps the compiler from dropping lookups
+};
+
+/**
+* Runs operations, timing one in every sampleEvery of them on its own.
+*/
+class Sampler
+{
+public:
+    Sampler(const Settings& settings) :
+        clock_(settings.clock),
+        every_(settings.sampleEvery),
+        countdown_(settings.sampleEvery)
+    {
+    }
+
+    template<typename Operation>
+    void run(LatencyHistogram& histogram, Operation operation)
+    {
+        if(every_ == 0 || --countdown_ != 0){
+            operation();
+            return;
+        }
+        countdown_ = every_;
+        uint64_t start = CycleClock::now();
+        operation();
+        histogram.record(clock_.elapsed(start, CycleClock::now()));
+    }
+
+private:
+    const CycleClock& clock_;
+    unsigned every_;
+    unsigned countdown_;
+};
+
+/**
+* xorshift64*, cheap enough not to show up next to a tree operation.
+*/
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : state_(seed | 1) { }
+
+    uint64_t next()
+    {
+        state_ ^= state_ >> 12;
+        state_ ^= state_ << 25;
+        state_ ^= state_ >> 27;
+        return state_ * 0x2545F4914F6CDD1DULL;
+    }
+    uint64_t below(uint64_t bound)
+    {
+        return next() % bound;
+    }
+    double unit()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t state_;
+};
+
+/**
+* Zipf-distributed ranks in [0, n), most popular first (Gray et al.,
+* "Quickly generating billion-record synthetic databases"). Setting up
+* costs O(n) once; each draw is O(1).
+*/
+class Zipf
+{
+public:
+    Zipf(uint64_t n, double theta) : n_(n)
+    {
+        zetaN_ = 0;
+        for(uint64_t i = 1; i <= n; i++){
+            zetaN_ += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetaN_);
+        half_ = 1.0 + std::pow(0.5, theta);
+    }
+
+    uint64_t next(Random& random) const
+    {
+        double u = random.unit();
+        double uz = u * zetaN_;
+        if(uz < 1.0){
+            return 0;
+        }
+        if(uz < half_){
+            return 1;
+        }
+        uint64_t rank = static_cast<uint64_t>(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return rank < n_ ? rank : n_ - 1;
+    }
+
+private:
+    uint64_t n_;
+    double zetaN_;
+    double alpha_;
+    double eta_;
+    double half_;
+};
+
+struct Workload
+{
+    const char* name;
+    int order;        // 0 random, 1 ascending, -1 descending
+    int findPct;
+    int insertPct;    // the rest are removes
+    bool zipf;
+};
+
+static const Workload workloads[] = {
+    { "uniform",     0, 50, 25, false },
+    { "sorted",      1, 50, 25, false },
+    { "reverse",    -1, 50, 25, false },
+    { "zipf",        0, 90,  5, true  },
+    { "readheavy",   0, 90,  5, false },
+    { "deleteheavy", 0, 10, 10, false },
+};
+
+/**
+* Bijective 64-bit mix (the splitmix64 finalizer): spreads consecutive
+* ranks over the key space without repeating any.
+*/
+static BenchKey scramble(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return static_cast<BenchKey>(x);
+}
+
+/**
+* Key for rank i: the rank itself for ordered workloads (so that lookups
+* hit what was built), scrambled otherwise.
+*/
+static BenchKey keyFor(const Workload& workload, uint64_t rank)
+{
+    return workload.order == 0 ? scramble(rank) : static_cast<BenchKey>(rank);
+}
+
+static double now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long peakRssKb()
+{
+    FILE* status = std::fopen("/proc/self/status", "r");
+    if(status == NULL){
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while(std::fgets(line, sizeof(line), status) != NULL){
+        if(std::strncmp(line, "VmHWM:", 6) == 0){
+            kb = std::strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    std::fclose(status);
+    return kb;
+}
+
+/**
+* Key rank for a lookup or mixed operation.
+*/
+static uint64_t probeRank(uint64_t size, const Zipf* zipf, Random& random)
+{
+    return zipf != NULL ? zipf->next(random) : random.below(2 * size);
+}
+
+/**
+* Runs the four phases of one workload against a fresh tree.
+*/
+template<typename Backend>
+static void runWorkload(const Workload& workload, uint64_t size, const Settings& settings,
+                        const Zipf* zipf, RunResult& result)
+{
+    uint64_t ops = settings.ops;
+    Sampler sampler(settings);
+    PerfCounters counters;
+    Backend backend;
+    Random random(0x9E3779B97F4A7C15ULL ^ size);
+    std::vector<BenchKey> keys(BENCH_BATCH);
+    std::vector<Op> batch(BENCH_BATCH);
+
+    //build
+    for(uint64_t done = 0; done < size; ){
+        std::size_t count = static_cast<std::size_t>(std::min<uint64_t>(BENCH_BATCH, size - done));
+        for(std::size_t i = 0; i < count; i++){
+            uint64_t rank = (workload.order < 0) ? size - 1 - (done + i) : done + i;
+            keys[i] = keyFor(workload, rank);
+        }
+        counters.start();
+        double start = now();
+        for(std::size_t i = 0; i < count; i++){
+            sampler.run(result.latency[buildInsertSeries], [&]() {
+                backend.insert(keys[i], keys[i]);
+            });
+        }
+        result.seconds[buildPhase] += now() - start;
+        counters.stop(result.perf[buildPhase]);
+        done += count;
+    }
+    result.ops[buildPhase] = size;
+
+    uint64_t hits = 0;
+    for(uint64_t done = 0; done < ops; ){
+        std::size_t count = static_cast<std::size_t>(std::min<uint64_t>(BENCH_BATCH, ops - done));
+        for(std::size_t i = 0; i < count; i++){
+            keys[i] = keyFor(workload, probeRank(size, zipf, random));
+        }
+        counters.start();
+        double start = now();
+        for(std::size_t i = 0; i < count; i++){
+            sampler.run(result.latency[findSeries], [&]() {
+                hits += backend.find(keys[i]);
+            });
+        }
+        result.seconds[findPhase] += now() - start;
+        counters.stop(result.perf[findPhase]);
+        done += count;
+    }
+    result.ops[findPhase] = ops;
+
+    for(uint64_t done = 0; done < ops; ){
+        std::size_t count = static_cast<std::size_t>(std::min<uint64_t>(BENCH_BATCH, ops - done));
+        for(std::size_t i = 0; i < count; i++){
+            int dice = static_cast<int>(random.below(100));
+            batch[i].type = dice < workload.findPct ? findOp :
+                            dice < workload.findPct + workload.insertPct ? insertOp : removeOp;
+            batch[i].key = keyFor(workload, probeRank(size, zipf, random));
+            result.mixOps[batch[i].type]++;
+        }
+        counters.start();
+        double start = now();
+        for(std::size_t i = 0; i < count; i++){
+            const Op& op = batch[i];
+            sampler.run(result.latency[mixFindSeries + op.type], [&]() {
+                switch(op.type){
+                case findOp:
+                    hits += backend.find(op.key);
+                    break;
+                case insertOp:
+                    backend.insert(op.key, op.key);
+                    break;
+                case removeOp:
+                    backend.remove(op.key);
+                    break;
+                }
+            });
+        }
+        result.seconds[opsPhase] += now() - start;
+        counters.stop(result.perf[opsPhase]);
+        done += count;
+    }
+    result.ops[opsPhase] = ops;
+
+    uint64_t sum = hits;
+    counters.start();
+    double start = now();
+    typename Backend::iterator it = backend.tree.begin();
+    typename Backend::iterator end = backend.tree.end();
+    while(it != end){
+        sampler.run(result.latency[iterateSeries], [&]() {
+            sum += static_cast<uint64_t>(it->second);
+            ++it;
+        });
+    }
+    result.seconds[iteratePhase] = now() - start;
+    counters.stop(result.perf[iteratePhase]);
+    result.ops[iteratePhase] = backend.tree.size();
+    result.checksum = sum;
+
+    result.peakRssKb = peakRssKb();
+}
+
+/**
+* Forks, runs one combination in the child and collects its result.
+* Returns false if the child failed (e.g. ran out of memory).
+*/
+static bool runIsolated(const std::string& tree, const Workload& workload, uint64_t size,
+                        const Settings& settings, const Zipf* zipf, RunResult& result)
+{
+    int fds[2];
+    if(pipe(fds) != 0){
+        return false;
+    }
+    std::cout.flush();
+    pid_t child = fork();
+    if(child < 0){
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if(child == 0){
+        close(fds[0]);
+        RunResult* mine = new RunResult();
+        if(tree == "bst"){
+            runWorkload<TreeBackend<BinarySearchTree<BenchKey, BenchKey>, BenchKey, BenchKey> >(workload, size, settings, zipf, *mine);
+        }
+        else if(tree == "avl"){
+            runWorkload<TreeBackend<AVLTree<BenchKey, BenchKey>, BenchKey, BenchKey> >(workload, size, settings, zipf, *mine);
+        }
+        else{
+            runWorkload<MapBackend<BenchKey, BenchKey> >(workload, size, settings, zipf, *mine);
+        }
+        const char* data = reinterpret_cast<const char*>(mine);
+        std::size_t left = sizeof(*mine);
+        while(left > 0){
+            ssize_t written = write(fds[1], data, left);
+            if(written <= 0){
+                _exit(1);
+            }
+            data += written;
+            left -= static_cast<std::size_t>(written);
+        }
+        //skip tearing the tree down, it isn't measured
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t got = 0;
+    while(got < static_cast<ssize_t>(sizeof(result))){
+        ssize_t n = read(fds[0], reinterpret_cast<char*>(&result) + got, sizeof(result) - got);
+        if(n <= 0){
+            break;
+        }
+        got += n;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(child, &status, 0);
+    return got == static_cast<ssize_t>(sizeof(result)) && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+/**
+* One output line. seconds < 0 means no throughput (a slice of the mix),
+* latency or perf NULL means no percentiles or counters.
+*/
+struct Row
+{
+    const char* phase;
+    const char* op;
+    uint64_t ops;
+    double seconds;
+    const LatencyHistogram* latency;
+    const PerfCounts* perf;
+};
+
+/**
+* Prints a row as CSV (with a header line before the first) or as one
+* element of a JSON array. Missing values are empty in CSV, null in JSON.
+*/
+static void printRow(bool json, bool& first, const std::string& tree, const Workload& workload,
+                     uint64_t size, const Row& row, const CycleClock& clock, long peakRss)
+{
+    std::string none = json ? "null" : "";
+    ResultFields fields;
+    fields.push_back(std::make_pair("tree", quoted(tree)));
+    fields.push_back(std::make_pair("workload", quoted(workload.name)));
+    fields.push_back(std::make_pair("size", std::to_string(size)));
+    fields.push_back(std::make_pair("phase", quoted(row.phase)));
+    fields.push_back(std::make_pair("op", quoted(row.op)));
+    fields.push_back(std::make_pair("ops", std::to_string(row.ops)));
+    addThroughput(fields, row.ops, row.seconds, none);
+    addLatency(fields, row.latency, clock, none);
+    static std::vector<std::string> perfNames;
+    for(int i = 0; i < perfEventCount; i++){
+        if(perfNames.size() < perfEventCount){
+            perfNames.push_back(std::string(PerfCounters::name(static_cast<PerfEvent>(i))) + "_per_op");
+        }
+        bool counted = (row.perf != NULL && row.perf->valid[i] && row.ops > 0);
+        fields.push_back(std::make_pair(perfNames[i].c_str(),
+                                        counted ? number(row.perf->values[i] / row.ops) : none));
+    }
+    fields.push_back(std::make_pair("peak_rss_kb", std::to_string(peakRss)));
+    printFields(json, first, fields);
+}
+
+static bool listed(const std::vector<std::string>& list, const std::string& name)
+{
+    for(std::size_t i = 0; i < list.size(); i++){
+        if(list[i] == name){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "usage: " << program << " [--format csv|json] [--max-size N] [--ops N]"
+              << " [--trees bst,avl,map] [--workloads uniform,sorted,reverse,zipf,readheavy,deleteheavy]"
+              << " [--sample N]" << std::endl;
+    std::exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string format = "csv";
+    uint64_t maxSize = 1000000;
+    Settings settings;
+    settings.ops = 1000000;
+    settings.sampleEvery = BENCH_SAMPLE_EVERY;
+    std::vector<std::string> trees = splitList("bst,avl,map");
+    std::vector<std::string> names;
+    for(std::size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++){
+        names.push_back(workloads[i].name);
+    }
+
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(i + 1 >= argc){
+            usage(argv[0]);
+        }
+        std::string value = argv[++i];
+        if(arg == "--format" && (value == "csv" || value == "json")){
+            format = value;
+        }
+        else if(arg == "--max-size"){
+            maxSize = static_cast<uint64_t>(std::strtod(value.c_str(), NULL));
+        }
+        else if(arg == "--ops"){
+            settings.ops = static_cast<uint64_t>(std::strtod(value.c_str(), NULL));
+        }
+        else if(arg == "--sample"){
+            settings.sampleEvery = static_cast<unsigned>(std::strtoul(value.c_str(), NULL, 10));
+        }
+        else if(arg == "--trees"){
+            trees = splitList(value);
+        }
+        else if(arg == "--workloads"){
+            names = splitList(value);
+        }
+        else{
+            usage(argv[0]);
+        }
+    }
+    if(maxSize > BENCH_SIZE_LIMIT){
+        maxSize = BENCH_SIZE_LIMIT;
+    }
+
+    settings.clock = CycleClock::calibrate();
+    {
+        PerfCounters probe;
+        std::string missing;
+        for(int i = 0; i < perfEventCount; i++){
+            if(!probe.available(static_cast<PerfEvent>(i))){
+                missing += std::string(missing.empty() ? "" : ", ") +
+                           PerfCounters::name(static_cast<PerfEvent>(i));
+            }
+        }
+        if(!missing.empty()){
+            std::cerr << "hardware counters unavailable (" << missing
+                      << "); check perf_event_paranoid" << std::endl;
+        }
+    }
+
+    bool json = (format == "json");
+    if(json){
+        std::cout << "[";
+    }
+    bool first = true;
+    for(uint64_t size = 1000; size <= maxSize; size *= 10){
+        Zipf* zipf = NULL;
+        for(std::size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++){
+            const Workload& workload = workloads[w];
+            if(!listed(names, workload.name)){
+                continue;
+            }
+            if(workload.zipf && zipf == NULL){
+                zipf = new Zipf(size, 0.99);
+            }
+            for(std::size_t t = 0; t < trees.size(); t++){
+                Settings run = settings;
+                if(trees[t] == "bst" && workload.order != 0){
+                    if(size > BENCH_UNBALANCED_MAX){
+                        std::cerr << "skipping bst/" << workload.name << " at " << size
+                                  << " keys (unbalanced)" << std::endl;
+                        continue;
+                    }
+                    //every lookup walks a list here
+                    run.ops = std::min(run.ops, size);
+                }
+                std::cerr << trees[t] << "/" << workload.name << " " << size << std::endl;
+                RunResult* result = new RunResult();
+                if(!runIsolated(trees[t], workload, size, run, workload.zipf ? zipf : NULL, *result)){
+                    std::cerr << "  failed" << std::endl;
+                    delete result;
+                    continue;
+                }
+                LatencyHistogram mix;
+                for(int op = findOp; op <= removeOp; op++){
+                    mix.merge(result->latency[mixFindSeries + op]);
+                }
+                Row rows[] = {
+                    { "build", "insert", result->ops[buildPhase], result->seconds[buildPhase],
+                      &result->latency[buildInsertSeries], &result->perf[buildPhase] },
+                    { "find", "find", result->ops[findPhase], result->seconds[findPhase],
+                      &result->latency[findSeries], &result->perf[findPhase] },
+                    { "ops", "all", result->ops[opsPhase], result->seconds[opsPhase], &mix,
+                      &result->perf[opsPhase] },
+                    { "ops", "find", result->mixOps[findOp], -1, &result->latency[mixFindSeries], NULL },
+                    { "ops", "insert", result->mixOps[insertOp], -1, &result->latency[mixInsertSeries], NULL },
+                    { "ops", "remove", result->mixOps[removeOp], -1, &result->latency[mixRemoveSeries], NULL },
+                    { "iterate", "next", result->ops[iteratePhase], result->seconds[iteratePhase],
+                      &result->latency[iterateSeries], &result->perf[iteratePhase] },
+                };
+                for(std::size_t r = 0; r < sizeof(rows) / sizeof(rows[0]); r++){
+                    printRow(json, first, trees[t], workload, size, rows[r], settings.clock,
+                             result->peakRssKb);
+                }
+                delete result;
+            }
+        }
+        delete zipf;
+    }
+    if(json){
+        std::cout << "\n]" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "latency.h"
+
+// Pieces shared by bench and trace-replay: adapters giving the search
+// trees and std::map one interface, and the CSV/JSON result rows both
+// tools print.
+
+/**
+* Thin adapters giving the containers one interface.
+*/
+template<typename Tree, typename Key, typename Value>
+struct TreeBackend
+{
+    typedef typename Tree::iterator iterator;
+
+    Tree tree;
+
+    void insert(const Key& key, const Value& value)
+    {
+        tree.insert(std::make_pair(key, value));
+    }
+    bool find(const Key& key)
+    {
+        return tree.find(key) != tree.end();
+    }
+    void remove(const Key& key)
+    {
+        tree.remove(key);
+    }
+};
+
+template<typename Key, typename Value>
+struct MapBackend
+{
+    typedef typename std::map<Key, Value>::iterator iterator;
+
+    std::map<Key, Value> tree;
+
+    void insert(const Key& key, const Value& value)
+    {
+        tree[key] = value;
+    }
+    bool find(const Key& key)
+    {
+        return tree.find(key) != tree.end();
+    }
+    void remove(const Key& key)
+    {
+        tree.erase(key);
+    }
+};
+
+/**
+* The named values of one output row, in column order. Strings are kept
+* quoted; an empty value means missing.
+*/
+typedef std::vector<std::pair<const char*, std::string> > ResultFields;
+
+inline std::string number(double value)
+{
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
+
+inline std::string quoted(const std::string& text)
+{
+    return "\"" + text + "\"";
+}
+
+/**
+* Adds seconds, ops_per_sec and ns_per_op; seconds < 0 means the row has
+* no throughput of its own.
+*/
+inline void addThroughput(ResultFields& fields, uint64_t ops, double seconds,
+                          const std::string& none)
+{
+    bool timed = (seconds >= 0);
+    fields.push_back(std::make_pair("seconds", timed ? number(seconds) : none));
+    fields.push_back(std::make_pair("ops_per_sec",
+        timed && seconds > 0 ? number(ops / seconds) : none));
+    fields.push_back(std::make_pair("ns_per_op",
+        timed && ops > 0 ? number(seconds * 1e9 / ops) : none));
+}
+
+/**
+* Adds the sample count and p50/p99/p99.9/max in nanoseconds; latency
+* NULL or without samples leaves them missing.
+*/
+inline void addLatency(ResultFields& fields, const LatencyHistogram* latency,
+                       const CycleClock& clock, const std::string& none)
+{
+    if(latency != NULL && latency->count() == 0){
+        latency = NULL;
+    }
+    fields.push_back(std::make_pair("samples", latency ? std::to_string(latency->count()) : none));
+    fields.push_back(std::make_pair("p50_ns",
+        latency ? number(clock.toNs(latency->percentile(50))) : none));
+    fields.push_back(std::make_pair("p99_ns",
+        latency ? number(clock.toNs(latency->percentile(99))) : none));
+    fields.push_back(std::make_pair("p999_ns",
+        latency ? number(clock.toNs(latency->percentile(99.9))) : none));
+    fields.push_back(std::make_pair("max_ns", latency ? number(clock.toNs(latency->max())) : none));
+}
+
+/**
+* Prints a row as CSV (with a header line before the first) or as one
+* element of a JSON array. Missing values are empty in CSV, so pass
+* "null" as none for JSON.
+*/
+inline void printFields(bool json, bool& first, const ResultFields& fields)
+{
+    if(json){
+        std::cout << (first ? "\n  {" : ",\n  {");
+        for(std::size_t i = 0; i < fields.size(); i++){
+            std::cout << (i ? ", " : "") << quoted(fields[i].first) << ": " << fields[i].second;
+        }
+        std::cout << "}";
+    }
+    else{
+        if(first){
+            for(std::size_t i = 0; i < fields.size(); i++){
+                std::cout << (i ? "," : "") << fields[i].first;
+            }
+            std::cout << std::endl;
+        }
+        for(std::size_t i = 0; i < fields.size(); i++){
+            const std::string& value = fields[i].second;
+            //names never contain commas, so CSV needs no quoting
+            if(!value.empty() && value[0] == '"'){
+                std::cout << (i ? "," : "") << value.substr(1, value.size() - 2);
+            }
+            else{
+                std::cout << (i ? "," : "") << value;
+            }
+        }
+        std::cout << std::endl;
+    }
+    first = false;
+}
+
+inline std::vector<std::string> splitList(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::string::size_type start = 0;
+    while(start <= list.size()){
+        std::string::size_type comma = list.find(',', start);
+        if(comma == std::string::npos){
+            comma = list.size();
+        }
+        if(comma > start){
+            items.push_back(list.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return items;
+}
+
+#endif
@@ -1,10 +1,144 @@
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "bst.h"
 #include "avlbst.h"
+#include "btree.h"
+#include "concurrentavl.h"
+#include "durableavl.h"
+#include "frozenbst.h"
+#include "mappedavl.h"
+#include "persistentavl.h"
 
 using namespace std;
 
+static int failures = 0;
+
+static void report(const string& what, bool ok)
+{
+    cout << what << (ok ? ": ok" : ": MISMATCH") << endl;
+    if(!ok) {
+        failures++;
+    }
+}
+
+/**
+* Prints whether tree holds exactly the items of expected, in order.
+*/
+template<typename Tree>
+static void check(const string& what, const Tree& tree, const map<int,int>& expected)
+{
+    bool same = (tree.size() == expected.size());
+    map<int,int>::const_iterator want = expected.begin();
+    for(auto it = tree.begin(); same && it != tree.end(); ++it, ++want) {
+        same = (want != expected.end() && it->first == want->first && it->second == want->second);
+    }
+    report(what, same);
+}
+
+/**
+* Whether it (or end) is the tree's counterpart of want in expected.
+*/
+template<typename It>
+static bool sameItem(It it, It end, map<int,int>::const_iterator want, const map<int,int>& expected)
+{
+    if(want == expected.end()) {
+        return it == end;
+    }
+    return it != end && it->first == want->first && it->second == want->second;
+}
+
+/**
+* Prints whether the const and reverse iterators of tree walk the items
+* of expected in both directions, and step correctly across the ends.
+*/
+template<typename Tree>
+static void checkIterators(const string& what, const Tree& tree, const map<int,int>& expected)
+{
+    typedef typename Tree::const_iterator const_iterator;
+    typedef typename Tree::const_reverse_iterator const_reverse_iterator;
+    bool same = true;
+    map<int,int>::const_iterator want = expected.begin();
+    for(const_iterator it = tree.cbegin(); same && it != tree.cend(); it++, ++want) {
+        same = sameItem(it, tree.cend(), want, expected);
+    }
+    same = same && want == expected.end();
+    map<int,int>::const_reverse_iterator back = expected.rbegin();
+    for(const_reverse_iterator it = tree.crbegin(); same && it != tree.crend(); ++it, ++back) {
+        same = (back != expected.rend() && it->first == back->first && it->second == back->second);
+    }
+    same = same && back == expected.rend();
+    back = expected.rbegin();
+    for(typename Tree::reverse_iterator it = tree.rbegin(); same && it != tree.rend(); it++, ++back) {
+        same = (back != expected.rend() && it->first == back->first);
+    }
+    same = same && back == expected.rend();
+    if(same && !expected.empty()) {
+        //--end() is the largest item, and the ends are one step apart
+        const_iterator last = tree.cend();
+        last--;
+        const_iterator first = tree.cbegin();
+        same = sameItem(last, tree.cend(), --expected.end(), expected) &&
+               sameItem(--tree.end(), tree.end(), --expected.end(), expected) &&
+               ++last == tree.cend() &&
+               sameItem(first++, tree.cend(), expected.begin(), expected);
+        same = same && --first == tree.cbegin();
+    }
+    report(what, same);
+}
+
+#ifdef BST_ORDER_STATISTICS
+/**
+* Prints whether select, rank and count_range agree with expected, which
+* also checks the subtree sizes they are computed from.
+*/
+template<typename Tree>
+static void checkOrder(const string& what, const Tree& tree, const map<int,int>& expected)
+{
+    vector<int> keys;
+    for(map<int,int>::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+        keys.push_back(it->first);
+    }
+    bool same = (tree.select(keys.size()) == tree.end());
+    for(size_t k = 0; same && k < keys.size(); k++) {
+        same = (tree.select(k) != tree.end() && tree.select(k)->first == keys[k]);
+    }
+    int low = keys.empty() ? 0 : keys.front() - 2;
+    int high = keys.empty() ? 0 : keys.back() + 2;
+    for(int key = low; same && key <= high; key++) {
+        size_t below = std::distance(expected.begin(), expected.lower_bound(key));
+        same = (tree.rank(key) == below);
+        for(int width = 0; same && width < 20; width += 7) {
+            size_t inside = std::distance(expected.lower_bound(key), expected.lower_bound(key + width));
+            same = (tree.count_range(key, key + width) == inside);
+        }
+    }
+    report(what + " order statistics", same);
+}
+#endif
+
+static void fill(AVLTree<int,int>& tree, map<int,int>& expected, int first, int last, int step)
+{
+    for(int key = first; key < last; key += step) {
+        tree.insert(std::make_pair(key, key * 10));
+        expected[key] = key * 10;
+    }
+}
+
+static void removeFiles(const string& path)
+{
+    std::remove(path.c_str());
+    std::remove((path + ".snap").c_str());
+    std::remove((path + ".wal").c_str());
+}
 
 int main(int argc, char *argv[])
 {
@@ -46,5 +180,455 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
-    return 0;
+    // B-tree Tests
+    BTree<char,int> bp;
+    bp.insert(std::make_pair('a',1));
+    bp.insert(std::make_pair('b',2));
+
+    cout << "\nBTree contents:" << endl;
+    for(BTree<char,int>::iterator it = bp.begin(); it != bp.end(); ++it) {
+        cout << it->first << " " << it->second << endl;
+    }
+    if(bp.find('b') != bp.end()) {
+        cout << "Found b" << endl;
+    }
+    else {
+        cout << "Did not find b" << endl;
+    }
+    cout << "Erasing b" << endl;
+    bp.remove('b');
+
+    // Concurrent AVL Tree: lock-free readers look up even keys, which stay
+    // put, while writers keep inserting and removing odd ones
+    cout << "\nConcurrentAVLTree:" << endl;
+    ConcurrentAVLTree<int,int> ct;
+    map<int,int> stable;
+    for(int key = 0; key < 2000; key += 2) {
+        ct.insert(std::make_pair(key, key * 10));
+        stable[key] = key * 10;
+    }
+    std::atomic<bool> writing(true);
+    std::atomic<int> misses(0);
+    vector<std::thread> threads;
+    for(int w = 0; w < 2; w++) {
+        threads.push_back(std::thread([&ct, w]() {
+            for(int round = 0; round < 20; round++) {
+                for(int key = 1 + 2 * w; key < 2000; key += 4) {
+                    ct.insert(std::make_pair(key, -key));
+                }
+                for(int key = 1 + 2 * w; key < 2000; key += 4) {
+                    ct.remove(key);
+                }
+            }
+        }));
+    }
+    for(int r = 0; r < 2; r++) {
+        threads.push_back(std::thread([&ct, &writing, &misses]() {
+            while(writing) {
+                for(int key = 0; key < 2000; key += 2) {
+                    int value = 0;
+                    if(!ct.find(key, value) || value != key * 10) {
+                        misses++;
+                    }
+                }
+            }
+        }));
+    }
+    threads[0].join();
+    threads[1].join();
+    writing = false;
+    threads[2].join();
+    threads[3].join();
+    report("stable keys found under writers", misses == 0);
+    ct.read([&](const AVLTree<int,int>& tree) {
+        check("contents after writers", tree, stable);
+    });
+    ct.clear();
+    int cleared = 0;
+    report("clear", ct.empty() && ct.size() == 0 && !ct.find(0, cleared) && !ct.contains(2));
+    ct.insert(std::make_pair(7, 70));
+    report("insert after clear", ct.size() == 1 && ct.at(7) == 70);
+
+    //strings are no OptimisticKey, so their lookups take the read lock
+    ConcurrentAVLTree<string,int> named;
+    std::thread namer([&named]() {
+        for(int key = 0; key < 500; key++) {
+            named.insert(std::make_pair(std::to_string(key), key));
+        }
+    });
+    bool sawAll = false;
+    while(!sawAll) {
+        int value = -1;
+        sawAll = named.find("499", value) && value == 499;
+    }
+    namer.join();
+    bool allThere = (named.size() == 500);
+    for(int key = 0; allThere && key < 500; key++) {
+        int value = -1;
+        allThere = named.find(std::to_string(key), value) && value == key &&
+                   named.at(std::to_string(key)) == key;
+    }
+    report("locked lookups for string keys", allThere && !named.contains("500"));
+
+    // Persistent AVL Tree: every snapshot keeps the contents it was taken
+    // with, whatever the tree goes through afterwards
+    cout << "\nPersistentAVLTree:" << endl;
+    PersistentAVLTree<int,int> pt;
+    map<int,int> current;
+    vector<PersistentAVLTree<int,int>::Snapshot> versions;
+    vector<map<int,int> > versionItems;
+    versions.push_back(pt.snapshot());
+    versionItems.push_back(current);
+    for(int step = 0; step < 6; step++) {
+        for(int key = step; key < 600; key += 6) {
+            pt.insert(std::make_pair(key, key + step));
+            current[key] = key + step;
+        }
+        for(int key = 0; key < 600; key += 5 + step) {
+            pt.remove(key);
+            current.erase(key);
+        }
+        versions.push_back(pt.snapshot());
+        versionItems.push_back(current);
+    }
+    pt.clear();
+    pt.insert(std::make_pair(1, 1));
+    bool lookups = true;
+    for(size_t i = 0; i < versions.size(); i++) {
+        check("snapshot " + std::to_string(i), versions[i], versionItems[i]);
+        for(int key = -1; key <= 600; key++) {
+            map<int,int>::const_iterator want = versionItems[i].find(key);
+            bool has = (want != versionItems[i].end());
+            lookups = lookups && versions[i].contains(key) == has &&
+                      (versions[i].find(key) != versions[i].end()) == has &&
+                      (!has || versions[i][key] == want->second);
+        }
+    }
+    report("snapshot lookups", lookups);
+    report("tree after clear", pt.size() == 1 && pt.snapshot().contains(1));
+
+    // AVL Tree split/join, compared against std::map
+    cout << "\nAVLTree split/join:" << endl;
+    AVLTree<int,int> whole, low, high;
+    map<int,int> all, below, rest;
+    fill(whole, all, 0, 1000, 1);
+    for(map<int,int>::iterator it = all.begin(); it != all.end(); ++it) {
+        (it->first < 300 ? below : rest).insert(*it);
+    }
+    whole.split(300, low, high);
+    check("split below 300", low, below);
+    check("split from 300", high, rest);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("split below 300", low, below);
+    checkOrder("split from 300", high, rest);
+#endif
+    low.insert(std::make_pair(-1, -10));
+    below[-1] = -10;
+    high.remove(999);
+    rest.erase(999);
+    check("change one side", low, below);
+    whole.join(low, high);
+    all = below;
+    all.insert(rest.begin(), rest.end());
+    check("join back", whole, all);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("join back", whole, all);
+#endif
+
+    // AVL Tree set operations
+    cout << "\nAVLTree set operations:" << endl;
+    AVLTree<int,int> evens, threes;
+    map<int,int> evenItems, threeItems, expected;
+    fill(evens, evenItems, 0, 600, 2);
+    fill(threes, threeItems, 0, 600, 3);
+    for(map<int,int>::iterator it = threeItems.begin(); it != threeItems.end(); ++it) {
+        it->second = -it->first;
+        threes.insert(std::make_pair(it->first, it->second));
+    }
+    expected = evenItems;
+    for(map<int,int>::iterator it = threeItems.begin(); it != threeItems.end(); ++it) {
+        expected[it->first] = it->second;
+    }
+    evens.union_with(threes);
+    check("union_with", evens, expected);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("union_with", evens, expected);
+#endif
+
+    AVLTree<int,int> a, b;
+    map<int,int> aItems, bItems;
+    fill(a, aItems, 0, 600, 2);
+    fill(b, bItems, 0, 600, 3);
+    expected.clear();
+    for(map<int,int>::iterator it = aItems.begin(); it != aItems.end(); ++it) {
+        if(bItems.count(it->first)) {
+            expected.insert(*it);
+        }
+    }
+    a.intersect_with(b);
+    check("intersect_with", a, expected);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("intersect_with", a, expected);
+#endif
+
+    AVLTree<int,int> c, d;
+    map<int,int> cItems, dItems;
+    fill(c, cItems, 0, 600, 2);
+    fill(d, dItems, 0, 600, 3);
+    for(map<int,int>::iterator it = dItems.begin(); it != dItems.end(); ++it) {
+        cItems.erase(it->first);
+    }
+    c.difference_with(d);
+    check("difference_with", c, cItems);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("difference_with", c, cItems);
+#endif
+
+    // AVL Tree batches
+    cout << "\nAVLTree batches:" << endl;
+    AVLTree<int,int> batched;
+    map<int,int> batchItems;
+    fill(batched, batchItems, 0, 500, 5);
+    vector<pair<int,int> > inserts;
+    vector<int> removals;
+    for(int key = 1000; key > 0; key -= 7) {
+        inserts.push_back(std::make_pair(key, key + 1));
+        batchItems[key] = key + 1;
+    }
+    batched.insert_batch(inserts.begin(), inserts.end());
+    check("insert_batch", batched, batchItems);
+    for(int key = 0; key < 1200; key += 3) {
+        removals.push_back(key);
+        batchItems.erase(key);
+    }
+    batched.remove_batch(removals.begin(), removals.end());
+    check("remove_batch", batched, batchItems);
+
+    //the plain tree has its own batch hooks, for an empty and a full tree
+    BinarySearchTree<int,int> plainBatched;
+    map<int,int> plainItems;
+    plainBatched.insert_batch(inserts.begin(), inserts.end());
+    for(size_t i = 0; i < inserts.size(); i++) {
+        plainItems[inserts[i].first] = inserts[i].second;
+    }
+    check("insert_batch into empty tree", plainBatched, plainItems);
+    vector<pair<int,int> > more;
+    for(int key = 0; key < 1500; key += 4) {
+        more.push_back(std::make_pair(key, -key));
+        plainItems[key] = -key;
+    }
+    plainBatched.insert_batch(more.begin(), more.end());
+    check("insert_batch into full tree", plainBatched, plainItems);
+    for(size_t i = 0; i < removals.size(); i++) {
+        plainItems.erase(removals[i]);
+    }
+    plainBatched.remove_batch(removals.begin(), removals.end());
+    check("remove_batch from plain tree", plainBatched, plainItems);
+#ifdef BST_ORDER_STATISTICS
+    checkOrder("remove_batch from plain tree", plainBatched, plainItems);
+#endif
+
+    // Batched lookups, more keys than there are lanes, hits and misses
+    cout << "\nfind_batch:" << endl;
+    AVLTree<int,int> searched;
+    map<int,int> searchedItems;
+    fill(searched, searchedItems, 0, 1000, 3);
+    vector<int> queries;
+    for(int i = 0; i < 3 * BST_BATCH_LANES + 5; i++) {
+        queries.push_back((i * 37) % 1100 - 50);
+    }
+    vector<AVLTree<int,int>::iterator> results;
+    size_t hits = searched.find_batch(queries.begin(), queries.end(), std::back_inserter(results));
+    bool found = (results.size() == queries.size());
+    size_t expectedHits = 0;
+    for(size_t i = 0; found && i < queries.size(); i++) {
+        expectedHits += searchedItems.count(queries[i]);
+        found = (results[i] == searched.find(queries[i]));
+    }
+    report("hits and misses", found && hits == expectedHits && hits > 0 && hits < queries.size());
+    AVLTree<int,int> nothing;
+    vector<AVLTree<int,int>::iterator> none;
+    hits = nothing.find_batch(queries.begin(), queries.end(), std::back_inserter(none));
+    bool allEnd = (hits == 0 && none.size() == queries.size());
+    for(size_t i = 0; allEnd && i < none.size(); i++) {
+        allEnd = (none[i] == nothing.end());
+    }
+    report("empty tree", allEnd);
+
+    // Bounds and range scans around the boundary keys: below the smallest,
+    // the smallest, between two keys, the largest and above the largest
+    cout << "\nBounds and scans:" << endl;
+    const int probes[] = { -1, 0, 1, 998, 999, 1000 };
+    bool bounds = true;
+    bool scans = true;
+    for(size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+        int key = probes[i];
+        map<int,int>::const_iterator lower = searchedItems.lower_bound(key);
+        map<int,int>::const_iterator upper = searchedItems.upper_bound(key);
+        map<int,int>::const_iterator below = upper;
+        below = (below == searchedItems.begin() ? searchedItems.end() : --below);
+        std::pair<AVLTree<int,int>::iterator, AVLTree<int,int>::iterator> range =
+            searched.equal_range(key);
+        bounds = bounds && sameItem(searched.lower_bound(key), searched.end(), lower, searchedItems) &&
+                 sameItem(searched.upper_bound(key), searched.end(), upper, searchedItems) &&
+                 sameItem(range.first, searched.end(), lower, searchedItems) &&
+                 sameItem(range.second, searched.end(), upper, searchedItems) &&
+                 sameItem(searched.floor(key), searched.end(), below, searchedItems) &&
+                 sameItem(searched.ceiling(key), searched.end(), lower, searchedItems);
+
+        vector<int> seen, wanted;
+        searched.scan(key, 4, [&seen](const pair<const int,int>& item) {
+            seen.push_back(item.first);
+            return true;
+        });
+        for(map<int,int>::const_iterator it = lower; it != searchedItems.end() && wanted.size() < 4; ++it) {
+            wanted.push_back(it->first);
+        }
+        scans = scans && seen == wanted;
+        seen.clear();
+        wanted.clear();
+        size_t visited = searched.scan(key, key + 10, 100, [&seen](const pair<const int,int>& item) {
+            seen.push_back(item.first);
+            return true;
+        });
+        for(map<int,int>::const_iterator it = lower; it != searchedItems.lower_bound(key + 10); ++it) {
+            wanted.push_back(it->first);
+        }
+        scans = scans && seen == wanted && visited == wanted.size();
+    }
+    bounds = bounds && nothing.lower_bound(0) == nothing.end() &&
+             nothing.upper_bound(0) == nothing.end() && nothing.floor(0) == nothing.end();
+    report("lower_bound, upper_bound, equal_range, floor, ceiling", bounds);
+    report("scan", scans);
+    size_t stopped = searched.scan(0, 100, [](const pair<const int,int>& item) {
+        return item.first < 6;
+    });
+    report("scan stopped by callback", stopped == 3);
+
+    // Const and reverse iterators, on both kinds of tree
+    cout << "\nIterators:" << endl;
+    checkIterators("AVLTree", searched, searchedItems);
+    checkIterators("BinarySearchTree", plainBatched, plainItems);
+    checkIterators("empty tree", nothing, map<int,int>());
+    AVLTree<int,int> single;
+    map<int,int> singleItem;
+    fill(single, singleItem, 5, 6, 1);
+    checkIterators("single item", single, singleItem);
+
+    // Frozen copies, searched and walked both ways
+    cout << "\nFrozenTree:" << endl;
+    FrozenTree<int,int> frozen = searched.freeze();
+    check("freeze", frozen, searchedItems);
+    bool lookedUp = true;
+    for(int key = -2; key <= 1001; key++) {
+        map<int,int>::const_iterator want = searchedItems.find(key);
+        FrozenTree<int,int>::iterator it = frozen.find(key);
+        lookedUp = lookedUp && (want == searchedItems.end() ? it == frozen.end()
+                                : it != frozen.end() && it.key() == key && it.value() == want->second);
+        want = searchedItems.lower_bound(key);
+        it = frozen.lower_bound(key);
+        lookedUp = lookedUp && (want == searchedItems.end() ? it == frozen.end()
+                                : it != frozen.end() && it->first == want->first);
+    }
+    report("find and lower_bound", lookedUp);
+    bool backwards = (frozen.size() == searchedItems.size());
+    FrozenTree<int,int>::iterator back = frozen.end();
+    for(map<int,int>::reverse_iterator want = searchedItems.rbegin();
+        backwards && want != searchedItems.rend(); ++want) {
+        --back;
+        backwards = (back->first == want->first && back->second == want->second);
+    }
+    report("backward iteration", backwards && back == frozen.begin());
+    report("--end() is the largest", (--frozen.end())->first == searchedItems.rbegin()->first);
+    FrozenTree<int,int> frozenEmpty = nothing.freeze();
+    report("empty freeze", frozenEmpty.empty() && frozenEmpty.begin() == frozenEmpty.end() &&
+                           frozenEmpty.find(0) == frozenEmpty.end());
+
+    // Snapshots
+    cout << "\nSnapshots:" << endl;
+    string snapshot = "bst-test-snapshot";
+    removeFiles(snapshot);
+    batched.save(snapshot);
+    AVLTree<int,int> loaded;
+    loaded.insert(std::make_pair(-5, 5));
+    loaded.load(snapshot);
+    check("save/load", loaded, batchItems);
+    {
+        //drop the last few bytes, as a crash while writing might
+        ifstream in(snapshot.c_str(), ios::binary);
+        string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        ofstream out(snapshot.c_str(), ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size() - 5);
+    }
+    bool rejected = false;
+    try {
+        loaded.load(snapshot);
+    }
+    catch(const std::runtime_error&) {
+        rejected = true;
+    }
+    //its size no longer matches the header, so the tree is left as it was
+    check("truncated snapshot", loaded, batchItems);
+    cout << "truncated snapshot " << (rejected ? "rejected" : "ACCEPTED") << endl;
+    if(!rejected) {
+        failures++;
+    }
+    removeFiles(snapshot);
+
+    // Memory-mapped AVL Tree
+    cout << "\nMappedAVLTree:" << endl;
+    string mapped = "bst-test-mapped";
+    removeFiles(mapped);
+    map<int,int> mappedItems;
+    {
+        MappedAVLTree<int,int> mt(mapped);
+        for(int key = 0; key < 3000; key++) {
+            mt.insert(std::make_pair(key, key * 2));
+            mappedItems[key] = key * 2;
+        }
+        for(int key = 0; key < 3000; key += 4) {
+            mt.remove(key);
+            mappedItems.erase(key);
+        }
+        mt.sync();
+    }
+    {
+        MappedAVLTree<int,int> mt(mapped);
+        check("reopen", mt, mappedItems);
+    }
+    removeFiles(mapped);
+
+    // Durable AVL Tree
+    cout << "\nDurableAVLTree:" << endl;
+    string durable = "bst-test-durable";
+    removeFiles(durable);
+    map<int,int> durableItems;
+    {
+        DurableAVLTree<int,int> dt(durable);
+        for(int key = 0; key < 200; key++) {
+            dt.insert(std::make_pair(key, key));
+            durableItems[key] = key;
+        }
+        dt.checkpoint();
+        for(int key = 0; key < 200; key += 3) {
+            dt.remove(key);
+            durableItems.erase(key);
+        }
+        dt.insert(std::make_pair(500, 1));
+        durableItems[500] = 1;
+    }
+    {
+        //a record torn by a crash
+        ofstream wal((durable + ".wal").c_str(), ios::binary | ios::app);
+        wal << "\x01garbage";
+    }
+    {
+        DurableAVLTree<int,int> dt(durable);
+        dt.read([&](const AVLTree<int,int>& tree) {
+            check("replay after garbage", tree, durableItems);
+        });
+    }
+    removeFiles(durable);
+
+    return failures == 0 ? 0 : 1;
 }
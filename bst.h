@@ -5,20 +5,60 @@
 #include <exception>
 #include <cstdlib>
 #include <utility>
+#include <tuple>
+#include <iterator>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <memory>
+#include <vector>
+#include <thread>
+#include "node_pool.h"
+#include "snapshot.h"
+#include "tree_stats.h"
+
+// Number of searches find_batch() keeps in flight at once. Each lane has
+// its next node prefetched while the other lanes are being compared, so
+// this should be about the number of cache misses the core can overlap.
+#ifndef BST_BATCH_LANES
+#define BST_BATCH_LANES 16
+#endif
+
+// Number of threads the parallel members (sorting in insert_batch and
+// remove_batch, the AVLTree set operations) try to keep busy. Those need
+// -pthread.
+#ifndef BST_PARALLEL_THREADS
+#define BST_PARALLEL_THREADS std::thread::hardware_concurrency()
+#endif
+
+// Batches with fewer items than this are sorted on the calling thread.
+#ifndef BST_PARALLEL_SORT_MIN
+#define BST_PARALLEL_SORT_MIN 16384
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr) ((void)0)
+#endif
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Nothing here is virtual, so a node carries no vtable
+ * pointer and every getter can be inlined. Derived node
+ * types, such as AVLNode, hide the getters for
+ * parent/left/right with versions returning their own type.
+ * Derived nodes must not add members that need destruction,
+ * since the tree only ever destroys them through a Node*.
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    template<typename... Args>
+    explicit Node(Node<Key, Value>* parent, Args&&... args);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -26,20 +66,29 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
+
+#ifdef BST_ORDER_STATISTICS
+    std::size_t getSize() const;
+    void setSize(std::size_t size);
+#endif
 
 protected:
     std::pair<const Key, Value> item_;
     Node<Key, Value>* parent_;
     Node<Key, Value>* left_;
     Node<Key, Value>* right_;
+#ifdef BST_ORDER_STATISTICS
+    std::size_t size_;  // number of nodes in the subtree rooted here
+#endif
 };
 
 /*
@@ -57,6 +106,27 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
     parent_(parent),
     left_(NULL),
     right_(NULL)
+#ifdef BST_ORDER_STATISTICS
+    , size_(1)
+#endif
+{
+
+}
+
+/**
+* Constructor that builds the item in place from args, exactly as
+* std::pair<const Key, Value> would (including std::piecewise_construct).
+*/
+template<typename Key, typename Value>
+template<typename... Args>
+Node<Key, Value>::Node(Node<Key, Value>* parent, Args&&... args) :
+    item_(std::forward<Args>(args)...),
+    parent_(parent),
+    left_(NULL),
+    right_(NULL)
+#ifdef BST_ORDER_STATISTICS
+    , size_(1)
+#endif
 {
 
 }
@@ -118,7 +188,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -127,7 +197,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -136,7 +206,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -180,6 +250,46 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* A setter for the value of a node that moves from value.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
+#ifdef BST_ORDER_STATISTICS
+/**
+* A getter for the number of nodes in the subtree rooted at this node.
+*/
+template<typename Key, typename Value>
+std::size_t Node<Key, Value>::getSize() const
+{
+    return size_;
+}
+
+/**
+* A setter for the subtree size.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setSize(std::size_t size)
+{
+    size_ = size;
+}
+#endif
+
+/**
+* Hook called while building a tree from sorted input, once both subtrees
+* of a node are known. Plain nodes keep no balance information. Node types
+* that do provide a more specific overload (see AVLNode).
+*/
+template<typename Key, typename Value>
+void initSubtreeBalance(Node<Key, Value>* node, int leftHeight, int rightHeight)
+{
+
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
@@ -196,11 +306,39 @@ public:
     BinarySearchTree(); //TODO
     virtual ~BinarySearchTree(); //TODO
     virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    virtual void insert(std::pair<const Key, Value>&& keyValuePair);
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
+    template<typename ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last);
+    template<typename InputIt>
+    void insert_batch(InputIt first, InputIt last);
+    template<typename KeyIt>
+    void remove_batch(KeyIt first, KeyIt last);
+    void save(const std::string& path) const;
+    void load(const std::string& path);
     bool isBalanced() const; //TODO
     void print() const;
     bool empty() const;
+    std::size_t size() const;
+
+    /**
+    * A breakdown of the memory held by a tree, see memory_usage().
+    */
+    struct MemoryUsage
+    {
+        std::size_t nodeCount;      // nodes in the tree
+        std::size_t bytesPerNode;   // pool slot size, including padding
+        std::size_t nodeBytes;      // nodeCount * bytesPerNode
+        std::size_t reservedBytes;  // slab memory reserved by the pool
+        std::size_t overheadBytes;  // free slots, tree object, slab list
+        std::size_t totalBytes;     // everything above, end to end
+    };
+    MemoryUsage memory_usage() const;
+#ifdef BST_INSTRUMENT
+    const TreeStats& stats() const;
+    void reset_stats();
+#endif
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
@@ -211,6 +349,12 @@ public:
     class iterator  // TODO
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key,Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key,Value>* pointer;
+        typedef std::pair<const Key,Value>& reference;
+
         iterator();
 
         std::pair<const Key,Value>& operator*() const;
@@ -220,17 +364,87 @@ public:
         bool operator!=(const iterator& rhs) const;
 
         iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
 
     protected:
         friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value>* tree);
         Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value> *tree_;  // so that --end() works
+    };
+
+    /**
+    * Same as iterator, but only gives const access to the items.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key,Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key,Value>* pointer;
+        typedef const std::pair<const Key,Value>& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BinarySearchTree<Key, Value>;
+        const_iterator(const Node<Key,Value>* ptr, const BinarySearchTree<Key, Value>* tree);
+        const Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value> *tree_;
     };
 
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
 public:
     iterator begin() const;
     iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    const_reverse_iterator crbegin() const;
+    const_reverse_iterator crend() const;
     iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key) const;
+    iterator floor(const Key& key) const;
+    iterator ceiling(const Key& key) const;
+    template<typename Callback>
+    std::size_t scan(const Key& from, std::size_t limit, Callback callback) const;
+    template<typename Callback>
+    std::size_t scan(const Key& from, const Key& to, std::size_t limit, Callback callback) const;
+    template<typename KeyIt, typename OutIt>
+    std::size_t find_batch(KeyIt first, KeyIt last, OutIt out) const;
+    virtual iterator insert(iterator hint, const std::pair<const Key, Value>& keyValuePair);
+    virtual iterator insert(iterator hint, std::pair<const Key, Value>&& keyValuePair);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+#ifdef BST_ORDER_STATISTICS
+    iterator select(std::size_t k) const;
+    std::size_t rank(const Key& key) const;
+    std::size_t count_range(const Key& lo, const Key& hi) const;
+#endif
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
@@ -238,6 +452,7 @@ protected:
     // Mandatory helper functions
     Node<Key, Value>* internalFind(const Key& k) const; // TODO
     Node<Key, Value> *getSmallestNode() const;  // TODO
+    Node<Key, Value> *getLargestNode() const;
     static Node<Key, Value>* predecessor(Node<Key, Value>* current); // TODO
     // Note:  static means these functions don't have a "this" pointer
     //        and instead just use the input argument.
@@ -247,8 +462,105 @@ protected:
     virtual void printRoot (Node<Key, Value> *r) const;
     virtual void nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2) ;
 
+    // Node allocation, all nodes live in pool_ (whose slabs trees that
+    // exchanged nodes through AVLTree::split/join share)
+    BinarySearchTree(std::size_t nodeBytes, std::size_t nodeAlign);
+    template<typename NodeT, typename... Args>
+    NodeT* createNode(NodeT* parent, Args&&... args);
+    void destroyNode(Node<Key, Value>* node);
+    iterator makeIterator(Node<Key, Value>* node) const;
+    static Node<Key, Value>* iteratorNode(const iterator& it);
+
+    // Insertion core shared by every insert flavour. Each returns the node
+    // holding the key and whether it was newly linked into the tree.
+    Node<Key, Value>* findInsertPosition(const Key& key, Node<Key, Value>*& parent,
+                                         Node<Key, Value>* hint = NULL) const;
+    Node<Key, Value>* findHintedPosition(const Key& key, Node<Key, Value>*& parent,
+                                         Node<Key, Value>* hint) const;
+    void linkNode(Node<Key, Value>* parent, Node<Key, Value>* node);
+    void unlinkRightmost(Node<Key, Value>* node);
+    template<typename NodeT, typename Pair>
+    std::pair<Node<Key, Value>*, bool> insertItem(Pair&& item, Node<Key, Value>* hint = NULL);
+    template<typename NodeT, typename... Args>
+    std::pair<Node<Key, Value>*, bool> emplaceItem(Args&&... args);
+    template<typename NodeT, typename K, typename... Args>
+    std::pair<Node<Key, Value>*, bool> tryEmplaceItem(K&& key, Args&&... args);
+    template<typename NodeT, typename ForwardIt>
+    void assignSortedNodes(ForwardIt first, std::size_t count);
+    template<typename NodeT, typename ForwardIt>
+    NodeT* buildSorted(ForwardIt& it, std::size_t count, int& height);
+
+    // Node-building hooks. emplace, try_emplace, assign_sorted and the
+    // batch members are templates and so can't be virtual; they hand
+    // their items to these instead, which a derived tree overrides to
+    // build its own kind of node and rebalance. That way they work
+    // through a BinarySearchTree reference to a derived tree too.
+    class ItemSource
+    {
+    public:
+        // builds the next item, which the new node then takes over
+        virtual std::pair<const Key, Value> make() = 0;
+    protected:
+        ~ItemSource() { }
+    };
+    template<typename Make>
+    class ItemMaker : public ItemSource
+    {
+    public:
+        explicit ItemMaker(Make& make) : make_(make) { }
+        std::pair<const Key, Value> make() { return make_(); }
+    private:
+        Make& make_;
+    };
+    // Reads an ItemSource as buildSorted reads an iterator
+    struct SourceCursor
+    {
+        std::pair<const Key, Value> operator*() const { return source->make(); }
+        SourceCursor& operator++() { return *this; }
+        ItemSource* source;
+    };
+    template<typename NodeT>
+    std::pair<Node<Key, Value>*, bool> insertMissing(const Key& key, ItemSource& item);
+    virtual std::pair<iterator, bool> emplaceNode(ItemSource& item);
+    virtual std::pair<iterator, bool> tryEmplaceNode(const Key& key, ItemSource& item);
+    virtual void assignSortedItems(ItemSource& items, std::size_t count);
+    virtual void insertBatch(std::vector<std::pair<Key, Value> >& batch);
+    virtual void removeBatch(std::vector<Key>& keys);
+
+    // Batch preparation for insert_batch/remove_batch
+    struct ItemLess
+    {
+        bool operator()(const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) const
+        {
+            return a.first < b.first;
+        }
+    };
+    struct KeyLess
+    {
+        bool operator()(const Key& a, const Key& b) const
+        {
+            return a < b;
+        }
+    };
+    template<typename T, typename Less>
+    static void sortBatch(std::vector<T>& batch, Less less);
+    void insertMedians(std::vector<std::pair<Key, Value> >& batch, std::size_t first,
+                       std::size_t last);
+    Node<Key, Value>* findFrom(Node<Key, Value>* start, const Key& key) const;
+    template<typename Task>
+    static void parallelFor(std::size_t tasks, Task task);
+
+#ifdef BST_ORDER_STATISTICS
+    // Subtree size upkeep, see select/rank
+    static std::size_t subtreeSize(const Node<Key, Value>* node);
+    static void updateSize(Node<Key, Value>* node);
+    static void growPath(Node<Key, Value>* node);
+    static void shrinkPath(Node<Key, Value>* node);
+#endif
+
     // Add helper functions here
 		int calculateHeightIfBalanced(Node<Key, Value>* node) const;
+		void removeNode(Node<Key, Value>* goal);
 		void noChildRemove(Node<Key, Value>* goal);
 		void oneChildRemove(Node<Key, Value>* goal, int sideIndicate);
 		void clearHelper(Node<Key, Value> *node);
@@ -256,7 +568,12 @@ protected:
 
 protected:
     Node<Key, Value>* root_;
-    // You should not need other data members
+    Node<Key, Value>* rightmost_;   // largest node, so appends skip the descent
+    std::size_t nodeCount_;
+    NodePool pool_;
+#ifdef BST_INSTRUMENT
+    mutable TreeStats stats_;       // counted by const lookups too
+#endif
 };
 
 /*
@@ -266,12 +583,15 @@ Begin implementations for the BinarySearchTree::iterator class.
 */
 
 /**
-* Explicit constructor that initializes an iterator with a given node pointer.
+* Explicit constructor that initializes an iterator with a given node pointer
+* and the tree it belongs to.
 */
 template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr,
+                                                 const BinarySearchTree<Key, Value>* tree)
 {
 	current_ = ptr;
+	tree_ = tree;
 }
 
 /**
@@ -281,6 +601,7 @@ template<class Key, class Value>
 BinarySearchTree<Key, Value>::iterator::iterator() 
 {
 		current_ = NULL;
+		tree_ = NULL;
 
 }
 
@@ -339,11 +660,51 @@ BinarySearchTree<Key, Value>::iterator::operator++()
 {
     // TODO
 		//find successor of current item
-		iterator it =  iterator(BinarySearchTree<Key, Value>::successor(current_));
-		*this = it;
+		current_ = BinarySearchTree<Key, Value>::successor(current_);
 		return *this;
 }
 
+/**
+* Advances the iterator, returning its old position
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::iterator::operator++(int)
+{
+		iterator old = *this;
+		++(*this);
+		return old;
+}
+
+/**
+* Moves the iterator back one item in in-order sequencing. Moving back
+* from end() lands on the largest item.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator&
+BinarySearchTree<Key, Value>::iterator::operator--()
+{
+		if(current_ == NULL){
+			current_ = tree_->rightmost_;
+		}
+		else{
+			current_ = BinarySearchTree<Key, Value>::predecessor(current_);
+		}
+		return *this;
+}
+
+/**
+* Moves the iterator back, returning its old position
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::iterator::operator--(int)
+{
+		iterator old = *this;
+		--(*this);
+		return old;
+}
+
 
 /*
 -------------------------------------------------------------
@@ -351,6 +712,143 @@ End implementations for the BinarySearchTree::iterator class.
 -------------------------------------------------------------
 */
 
+/*
+---------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::const_iterator class.
+---------------------------------------------------------------------
+*/
+
+/**
+* Explicit constructor that initializes an iterator with a given node pointer
+* and the tree it belongs to.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::const_iterator::const_iterator(const Node<Key,Value> *ptr,
+                                                             const BinarySearchTree<Key, Value>* tree)
+{
+	current_ = ptr;
+	tree_ = tree;
+}
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::const_iterator::const_iterator()
+{
+	current_ = NULL;
+	tree_ = NULL;
+}
+
+/**
+* Converts a mutable iterator to a const one.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::const_iterator::const_iterator(const iterator& it)
+{
+	current_ = it.current_;
+	tree_ = it.tree_;
+}
+
+/**
+* Provides const access to the item.
+*/
+template<class Key, class Value>
+const std::pair<const Key,Value> &
+BinarySearchTree<Key, Value>::const_iterator::operator*() const
+{
+    return current_->getItem();
+}
+
+/**
+* Provides the address of the item.
+*/
+template<class Key, class Value>
+const std::pair<const Key,Value> *
+BinarySearchTree<Key, Value>::const_iterator::operator->() const
+{
+    return &(current_->getItem());
+}
+
+/**
+* Checks if both iterators point at the same item
+*/
+template<class Key, class Value>
+bool
+BinarySearchTree<Key, Value>::const_iterator::operator==(
+    const BinarySearchTree<Key, Value>::const_iterator& rhs) const
+{
+	return current_ == rhs.current_;
+}
+
+/**
+* Checks if the iterators point at different items
+*/
+template<class Key, class Value>
+bool
+BinarySearchTree<Key, Value>::const_iterator::operator!=(
+    const BinarySearchTree<Key, Value>::const_iterator& rhs) const
+{
+	return current_ != rhs.current_;
+}
+
+/**
+* Advances the iterator's location using an in-order sequencing
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator&
+BinarySearchTree<Key, Value>::const_iterator::operator++()
+{
+	current_ = BinarySearchTree<Key, Value>::successor(const_cast<Node<Key, Value>*>(current_));
+	return *this;
+}
+
+/**
+* Advances the iterator, returning its old position
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator
+BinarySearchTree<Key, Value>::const_iterator::operator++(int)
+{
+	const_iterator old = *this;
+	++(*this);
+	return old;
+}
+
+/**
+* Moves the iterator back one item, landing on the largest item from end()
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator&
+BinarySearchTree<Key, Value>::const_iterator::operator--()
+{
+	if(current_ == NULL){
+		current_ = tree_->rightmost_;
+	}
+	else{
+		current_ = BinarySearchTree<Key, Value>::predecessor(const_cast<Node<Key, Value>*>(current_));
+	}
+	return *this;
+}
+
+/**
+* Moves the iterator back, returning its old position
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator
+BinarySearchTree<Key, Value>::const_iterator::operator--(int)
+{
+	const_iterator old = *this;
+	--(*this);
+	return old;
+}
+
+/*
+-------------------------------------------------------------------
+End implementations for the BinarySearchTree::const_iterator class.
+-------------------------------------------------------------------
+*/
+
 /*
 -----------------------------------------------------
 Begin implementations for the BinarySearchTree class.
@@ -361,9 +859,25 @@ Begin implementations for the BinarySearchTree class.
 * Default constructor for a BinarySearchTree, which sets the root to NULL.
 */
 template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() 
+BinarySearchTree<Key, Value>::BinarySearchTree() :
+    pool_(sizeof(Node<Key, Value>), alignof(Node<Key, Value>))
+{
+    root_ = NULL;
+    rightmost_ = NULL;
+    nodeCount_ = 0;
+}
+
+/**
+* Constructor for derived trees whose nodes are larger than a plain Node,
+* so that the pool hands out slots big enough for them.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(std::size_t nodeBytes, std::size_t nodeAlign) :
+    pool_(nodeBytes, nodeAlign)
 {
     root_ = NULL;
+    rightmost_ = NULL;
+    nodeCount_ = 0;
 }
 
 template<typename Key, typename Value>
@@ -383,6 +897,53 @@ bool BinarySearchTree<Key, Value>::empty() const
     return root_ == NULL;
 }
 
+/**
+ * Returns the number of items in the tree in O(1)
+*/
+template<class Key, class Value>
+std::size_t BinarySearchTree<Key, Value>::size() const
+{
+    return nodeCount_;
+}
+
+/**
+ * Reports how much memory the tree holds: the nodes themselves, and the
+ * total including free pool slots and bookkeeping.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::MemoryUsage
+BinarySearchTree<Key, Value>::memory_usage() const
+{
+    //after a split or join, slabs shared with other trees are counted in
+    //full for each of them
+    MemoryUsage usage;
+    usage.nodeCount = nodeCount_;
+    usage.bytesPerNode = pool_.slotBytes();
+    usage.nodeBytes = usage.nodeCount * usage.bytesPerNode;
+    usage.reservedBytes = pool_.reservedBytes();
+    usage.totalBytes = usage.reservedBytes + sizeof(*this) - sizeof(pool_) + pool_.bookkeepingBytes();
+    usage.overheadBytes = usage.totalBytes - usage.nodeBytes;
+    return usage;
+}
+
+#ifdef BST_INSTRUMENT
+/**
+* Hot-path counters since the tree was made or reset_stats() was called,
+* see tree_stats.h.
+*/
+template<class Key, class Value>
+const TreeStats& BinarySearchTree<Key, Value>::stats() const
+{
+    return stats_;
+}
+
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::reset_stats()
+{
+    stats_ = TreeStats();
+}
+#endif
+
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::print() const
 {
@@ -397,7 +958,7 @@ template<class Key, class Value>
 typename BinarySearchTree<Key, Value>::iterator
 BinarySearchTree<Key, Value>::begin() const
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
+    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode(), this);
     return begin;
 }
 
@@ -408,124 +969,697 @@ template<class Key, class Value>
 typename BinarySearchTree<Key, Value>::iterator
 BinarySearchTree<Key, Value>::end() const
 {
-    BinarySearchTree<Key, Value>::iterator end(NULL);
+    BinarySearchTree<Key, Value>::iterator end(NULL, this);
     return end;
 }
 
 /**
-* Returns an iterator to the item with the given key, k
-* or the end iterator if k does not exist in the tree
+* Returns a const iterator to the smallest item in the tree
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator
+BinarySearchTree<Key, Value>::cbegin() const
+{
+    return const_iterator(getSmallestNode(), this);
+}
+
+/**
+* Returns the const end iterator
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_iterator
+BinarySearchTree<Key, Value>::cend() const
+{
+    return const_iterator(NULL, this);
+}
+
+/**
+* Returns a reverse iterator to the largest item in the tree
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::reverse_iterator
+BinarySearchTree<Key, Value>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+* Returns the end of a reverse traversal
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::reverse_iterator
+BinarySearchTree<Key, Value>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+* Returns a const reverse iterator to the largest item in the tree
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_reverse_iterator
+BinarySearchTree<Key, Value>::crbegin() const
+{
+    return const_reverse_iterator(cend());
+}
+
+/**
+* Returns the end of a const reverse traversal
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::const_reverse_iterator
+BinarySearchTree<Key, Value>::crend() const
+{
+    return const_reverse_iterator(cbegin());
+}
+
+/**
+* Returns an iterator to the item with the given key, k
+* or the end iterator if k does not exist in the tree
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::find(const Key & k) const
+{
+    Node<Key, Value> *curr = internalFind(k);
+    BinarySearchTree<Key, Value>::iterator it(curr, this);
+    return it;
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::lower_bound(const Key& key) const
+{
+    Node<Key, Value> *temp = root_;
+    Node<Key, Value> *best = NULL;
+    while(temp != NULL){
+        //candidate, but something smaller may still qualify on the left
+        if(!BST_COMPARE(temp->getKey() < key)){
+            best = temp;
+            temp = temp->getLeft();
+        }
+        else{
+            temp = temp->getRight();
+        }
+    }
+    return iterator(best, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::upper_bound(const Key& key) const
+{
+    Node<Key, Value> *temp = root_;
+    Node<Key, Value> *best = NULL;
+    while(temp != NULL){
+        if(BST_COMPARE(key < temp->getKey())){
+            best = temp;
+            temp = temp->getLeft();
+        }
+        else{
+            temp = temp->getRight();
+        }
+    }
+    return iterator(best, this);
+}
+
+/**
+* Returns the range of items with the given key, which holds either
+* nothing or a single item.
+*/
+template<class Key, class Value>
+std::pair<typename BinarySearchTree<Key, Value>::iterator,
+          typename BinarySearchTree<Key, Value>::iterator>
+BinarySearchTree<Key, Value>::equal_range(const Key& key) const
+{
+    iterator first = lower_bound(key);
+    iterator last = first;
+    if(last != end() && !BST_COMPARE(key < last->first)){
+        ++last;
+    }
+    return std::make_pair(first, last);
+}
+
+/**
+* Returns an iterator to the item with the largest key not greater than
+* key, or end() if every key is greater.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::floor(const Key& key) const
+{
+    Node<Key, Value> *temp = root_;
+    Node<Key, Value> *best = NULL;
+    while(temp != NULL){
+        //candidate, but something larger may still qualify on the right
+        if(!BST_COMPARE(key < temp->getKey())){
+            best = temp;
+            temp = temp->getRight();
+        }
+        else{
+            temp = temp->getLeft();
+        }
+    }
+    return iterator(best, this);
+}
+
+/**
+* Returns an iterator to the item with the smallest key not less than
+* key, or end() if every key is smaller. Same as lower_bound.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::ceiling(const Key& key) const
+{
+    return lower_bound(key);
+}
+
+/**
+* Calls callback on up to limit items in key order, starting at the first
+* key not less than from. callback takes the item and returns false to
+* stop early, e.g. once a page is full. Returns the number of items
+* visited. The start is found in O(log n), so a page costs O(log n + limit).
+*/
+template<class Key, class Value>
+template<typename Callback>
+std::size_t BinarySearchTree<Key, Value>::scan(const Key& from, std::size_t limit,
+                                               Callback callback) const
+{
+    std::size_t visited = 0;
+    for(iterator it = lower_bound(from); it != end() && visited < limit; ++it){
+        visited++;
+        if(!callback(*it)){
+            break;
+        }
+    }
+    return visited;
+}
+
+/**
+* Same as above, but also stops at the first key not less than to, so
+* only keys in [from, to) are visited.
+*/
+template<class Key, class Value>
+template<typename Callback>
+std::size_t BinarySearchTree<Key, Value>::scan(const Key& from, const Key& to,
+                                               std::size_t limit, Callback callback) const
+{
+    std::size_t visited = 0;
+    for(iterator it = lower_bound(from); it != end() && visited < limit; ++it){
+        if(!BST_COMPARE(it->first < to)){
+            break;
+        }
+        visited++;
+        if(!callback(*it)){
+            break;
+        }
+    }
+    return visited;
+}
+
+/**
+* Looks up every key in [first, last) and writes one iterator per key to
+* out, in the same order, with end() for keys that are not in the tree.
+* Returns the number of keys found.
+*
+* Up to BST_BATCH_LANES descents run in lockstep: each step compares every
+* lane once and prefetches the child it moves to, so the cache misses of
+* different keys overlap instead of being paid one after another as they
+* are when calling find() in a loop. KeyIt must be a forward iterator.
+*/
+template<class Key, class Value>
+template<typename KeyIt, typename OutIt>
+std::size_t BinarySearchTree<Key, Value>::find_batch(KeyIt first, KeyIt last,
+                                                     OutIt out) const
+{
+    std::size_t found = 0;
+    while(first != last){
+        const Key* keys[BST_BATCH_LANES];
+        Node<Key, Value>* nodes[BST_BATCH_LANES];
+        std::size_t lanes = 0;
+        //fill the lanes; every search starts at the root
+        for(; first != last && lanes < BST_BATCH_LANES; ++first){
+            keys[lanes] = &*first;
+            nodes[lanes] = root_;
+            lanes++;
+        }
+        //pending holds the lanes still descending; a lane drops out once
+        //its node is NULL (missing key) or holds its key
+        std::size_t pending[BST_BATCH_LANES];
+        std::size_t numPending = 0;
+        for(std::size_t i = 0; i < lanes; i++){
+            if(nodes[i] != NULL){
+                pending[numPending++] = i;
+            }
+        }
+        while(numPending > 0){
+            std::size_t stillPending = 0;
+            for(std::size_t j = 0; j < numPending; j++){
+                std::size_t i = pending[j];
+                Node<Key, Value>* curr = nodes[i];
+                Node<Key, Value>* next;
+                if(BST_COMPARE(*keys[i] < curr->getKey())){
+                    next = curr->getLeft();
+                }
+                else if(BST_COMPARE(curr->getKey() < *keys[i])){
+                    next = curr->getRight();
+                }
+                else{
+                    continue;
+                }
+                nodes[i] = next;
+                if(next != NULL){
+                    BST_PREFETCH(next);
+                    pending[stillPending++] = i;
+                }
+            }
+            numPending = stillPending;
+        }
+        for(std::size_t i = 0; i < lanes; i++){
+            if(nodes[i] != NULL){
+                found++;
+            }
+            *out = iterator(nodes[i], this);
+            ++out;
+        }
+    }
+    return found;
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value>
+Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value>
+Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* An insert method to insert into a Binary Search Tree.
+* The tree will not remain balanced when inserting.
+* Recall: If key is already in the tree, you should 
+* overwrite the current value with the updated value.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+		insertItem<Node<Key, Value> >(keyValuePair);
+}
+
+/**
+* Same as above, but the value is moved into the tree (both when creating
+* the node and when overwriting an existing value).
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+		insertItem<Node<Key, Value> >(std::move(keyValuePair));
+}
+
+/**
+* Inserts (or overwrites) an item, starting the search at hint instead of
+* the root. If the key belongs right next to hint (just before it, or just
+* after it), no descent is needed at all. Passing end() as the hint makes
+* appends past the current largest key O(1). A wrong hint only costs a
+* regular insert. Returns an iterator to the item.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::insert(iterator hint, const std::pair<const Key, Value>& keyValuePair)
+{
+		return iterator(insertItem<Node<Key, Value> >(keyValuePair, hint.current_).first, this);
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::insert(iterator hint, std::pair<const Key, Value>&& keyValuePair)
+{
+		return iterator(insertItem<Node<Key, Value> >(std::move(keyValuePair), hint.current_).first, this);
+}
+
+/**
+* Constructs an item from args, std::map style. If the key is already in
+* the tree the new item is discarded and the old value is kept. Returns
+* an iterator to the item with the key and whether it was inserted.
+*
+* The item is built once and moved into its node, by emplaceNode(), so
+* that a derived tree builds its own kind of node even when called
+* through a BinarySearchTree reference.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value>::iterator, bool>
+BinarySearchTree<Key, Value>::emplace(Args&&... args)
+{
+		auto make = [&]() { return std::pair<const Key, Value>(std::forward<Args>(args)...); };
+		ItemMaker<decltype(make)> item(make);
+		return emplaceNode(item);
+}
+
+/**
+* If key is not in the tree, inserts it with a value constructed in place
+* from args. Otherwise does nothing, and args are left untouched.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value>::iterator, bool>
+BinarySearchTree<Key, Value>::try_emplace(const Key& key, Args&&... args)
+{
+		//only called once key turned out to be missing
+		auto make = [&]() {
+			return std::pair<const Key, Value>(std::piecewise_construct, std::forward_as_tuple(key),
+			                                   std::forward_as_tuple(std::forward<Args>(args)...));
+		};
+		ItemMaker<decltype(make)> item(make);
+		return tryEmplaceNode(key, item);
+}
+
+/**
+* Same as above, but the key is moved into the new node.
+*/
+template<class Key, class Value>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value>::iterator, bool>
+BinarySearchTree<Key, Value>::try_emplace(Key&& key, Args&&... args)
+{
+		auto make = [&]() {
+			return std::pair<const Key, Value>(std::piecewise_construct,
+			                                   std::forward_as_tuple(std::move(key)),
+			                                   std::forward_as_tuple(std::forward<Args>(args)...));
+		};
+		ItemMaker<decltype(make)> item(make);
+		return tryEmplaceNode(key, item);
+}
+
+#ifdef BST_ORDER_STATISTICS
+/**
+* Returns an iterator to the k-th smallest item (counting from 0), or
+* end() if the tree has k items or fewer. Runs in O(height).
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::select(std::size_t k) const
+{
+		Node<Key, Value>* temp = root_;
+		while(temp != NULL){
+			std::size_t leftSize = subtreeSize(temp->getLeft());
+			//the k-th item is in the left subtree
+			if(k < leftSize){
+				temp = temp->getLeft();
+			}
+			//skip the left subtree and this node, keep looking on the right
+			else if(k > leftSize){
+				k -= leftSize + 1;
+				temp = temp->getRight();
+			}
+			else{
+				return iterator(temp, this);
+			}
+		}
+		return end();
+}
+
+/**
+* Returns the number of keys strictly less than key, whether or not key
+* itself is in the tree. Runs in O(height).
+*/
+template<class Key, class Value>
+std::size_t BinarySearchTree<Key, Value>::rank(const Key& key) const
+{
+		std::size_t below = 0;
+		Node<Key, Value>* temp = root_;
+		while(temp != NULL){
+			//everything in the left subtree and this node are below key
+			if(BST_COMPARE(temp->getKey() < key)){
+				below += subtreeSize(temp->getLeft()) + 1;
+				temp = temp->getRight();
+			}
+			else{
+				temp = temp->getLeft();
+			}
+		}
+		return below;
+}
+
+/**
+* Returns the number of keys k with lo <= k < hi.
+*/
+template<class Key, class Value>
+std::size_t BinarySearchTree<Key, Value>::count_range(const Key& lo, const Key& hi) const
+{
+		if(!BST_COMPARE(lo < hi)){
+			return 0;
+		}
+		return rank(hi) - rank(lo);
+}
+
+/**
+* Size of the subtree rooted at node, 0 for an empty subtree.
+*/
+template<class Key, class Value>
+std::size_t BinarySearchTree<Key, Value>::subtreeSize(const Node<Key, Value>* node)
+{
+		return (node == NULL) ? 0 : node->getSize();
+}
+
+/**
+* Recomputes the size of node from its children, e.g. after a rotation.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::updateSize(Node<Key, Value>* node)
+{
+		node->setSize(subtreeSize(node->getLeft()) + subtreeSize(node->getRight()) + 1);
+}
+
+/**
+* Counts a newly linked node in node and all of its ancestors.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::growPath(Node<Key, Value>* node)
+{
+		for(Node<Key, Value>* temp = node; temp != NULL; temp = temp->getParent()){
+			temp->setSize(temp->getSize() + 1);
+		}
+}
+
+/**
+* Uncounts node, which is about to be unlinked, from all of its ancestors.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::shrinkPath(Node<Key, Value>* node)
+{
+		for(Node<Key, Value>* temp = node->getParent(); temp != NULL; temp = temp->getParent()){
+			temp->setSize(temp->getSize() - 1);
+		}
+}
+#endif
+
+/**
+* Looks for key in the tree. Returns its node if found, otherwise returns
+* NULL and sets parent to the node a new key would be linked under
+* (NULL when the tree is empty). The search first tries the slots next to
+* hint and past the largest key, and only then descends from the root.
+*/
+template<class Key, class Value>
+Node<Key, Value>*
+BinarySearchTree<Key, Value>::findInsertPosition(const Key& key, Node<Key, Value>*& parent,
+                                                 Node<Key, Value>* hint) const
+{
+		parent = NULL;
+		//if the key fits right next to the hint, we are done
+		if(hint != NULL){
+			Node<Key, Value>* found = findHintedPosition(key, parent, hint);
+			if(found != NULL || parent != NULL){
+				return found;
+			}
+		}
+		//if the key is past the largest one, it goes right of the largest node
+		if(rightmost_ != NULL && BST_COMPARE(key > rightmost_->getKey())){
+			parent = rightmost_;
+			return NULL;
+		}
+		Node<Key, Value> *temp = root_;
+		//while we haven't reached the end of the tree
+		while(temp != NULL){
+			//if the new item is greater than the current node, go right
+			if(BST_COMPARE(key > temp->getKey())){
+				parent = temp;
+				temp = temp->getRight();
+			}
+			//if the new item is less than the current node, go left
+			else if(BST_COMPARE(key < temp->getKey())){
+				parent = temp;
+				temp = temp->getLeft();
+			}
+			//if already in tree, this is the node
+			else{
+				return temp;
+			}
+		}
+		return NULL;
+}
+
+/**
+* Checks whether key belongs in a free slot right next to hint. Returns
+* hint if it holds key, sets parent if a slot was found, and otherwise
+* leaves parent NULL so the caller falls back to a full search.
+*/
+template<class Key, class Value>
+Node<Key, Value>*
+BinarySearchTree<Key, Value>::findHintedPosition(const Key& key, Node<Key, Value>*& parent,
+                                                 Node<Key, Value>* hint) const
+{
+		parent = NULL;
+		//key goes before hint, so it must also go after hint's predecessor
+		if(BST_COMPARE(key < hint->getKey())){
+			Node<Key, Value>* before = predecessor(hint);
+			if(before == NULL || BST_COMPARE(before->getKey() < key)){
+				//one of the two always has a free slot between them
+				parent = (hint->getLeft() == NULL) ? hint : before;
+			}
+			return NULL;
+		}
+		//key goes after hint, so it must also go before hint's successor
+		if(BST_COMPARE(hint->getKey() < key)){
+			Node<Key, Value>* after = successor(hint);
+			if(after == NULL || BST_COMPARE(key < after->getKey())){
+				parent = (hint->getRight() == NULL) ? hint : after;
+			}
+			return NULL;
+		}
+		return hint;
+}
+
+/**
+* Links a new node in as a leaf under parent, or as the root if parent is NULL.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::linkNode(Node<Key, Value>* parent, Node<Key, Value>* node)
+{
+		node->setParent(parent);
+		nodeCount_++;
+		if(parent == NULL){
+			root_ = node;
+			rightmost_ = node;
+		}
+		else if(BST_COMPARE(node->getKey() < parent->getKey())){
+			parent->setLeft(node);
+		}
+		else{
+			parent->setRight(node);
+			//a right child of the largest node is the new largest node
+			if(parent == rightmost_){
+				rightmost_ = node;
+			}
+		}
+#ifdef BST_ORDER_STATISTICS
+		growPath(parent);
+#endif
+}
+
+/**
+* Called before node is unlinked by a remove. If node is the largest one,
+* its predecessor takes over. The largest node never has a right child, so
+* nodeSwap never moves it and rotations don't change which node it is.
 */
 template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+void BinarySearchTree<Key, Value>::unlinkRightmost(Node<Key, Value>* node)
 {
-    Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+		if(node == rightmost_){
+			rightmost_ = predecessor(node);
+		}
 }
 
 /**
- * @precondition The key exists in the map
- * Returns the value associated with the key
- */
+* Inserts item (a pair), overwriting the value if the key already exists.
+* An rvalue item is moved both into a new node and over an old value.
+*/
 template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+template<typename NodeT, typename Pair>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value>::insertItem(Pair&& item, Node<Key, Value>* hint)
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+		Node<Key, Value>* parent;
+		Node<Key, Value>* existing = findInsertPosition(item.first, parent, hint);
+		//if already in tree, replace current value with new value
+		if(existing != NULL){
+			existing->setValue(std::forward<Pair>(item).second);
+			return std::make_pair(existing, false);
+		}
+		NodeT* node = createNode<NodeT>(NULL, std::forward<Pair>(item));
+		linkNode(parent, node);
+		return std::make_pair(static_cast<Node<Key, Value>*>(node), true);
 }
+
+/**
+* Builds the node first, since the key is only known once the item exists,
+* and gives it back to the pool if the key turns out to be in the tree.
+*/
 template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+template<typename NodeT, typename... Args>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value>::emplaceItem(Args&&... args)
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+		NodeT* node = createNode<NodeT>(NULL, std::forward<Args>(args)...);
+		Node<Key, Value>* parent;
+		Node<Key, Value>* existing = findInsertPosition(node->getKey(), parent);
+		if(existing != NULL){
+			destroyNode(node);
+			return std::make_pair(existing, false);
+		}
+		linkNode(parent, node);
+		return std::make_pair(static_cast<Node<Key, Value>*>(node), true);
 }
 
 /**
-* An insert method to insert into a Binary Search Tree.
-* The tree will not remain balanced when inserting.
-* Recall: If key is already in the tree, you should 
-* overwrite the current value with the updated value.
+* Only constructs a node when key is missing, building the key and the
+* value directly inside it.
 */
 template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<typename NodeT, typename K, typename... Args>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value>::tryEmplaceItem(K&& key, Args&&... args)
 {
-		//if the tree is empty, set root to be the new key and value pair
-		if(root_ == NULL){
-			root_ = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
-			return;
-		}
-		//if the root is the only thing in the tree, insert
-		//the new node as the right or left child appropriately
-		if(root_->getLeft() == NULL && root_->getRight() == NULL){
-			//if the new key is greater than the root_, right child
-			if(keyValuePair.first > root_->getKey()){
-				Node<Key, Value> *newNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
-				root_->setRight(newNode);
-				newNode->setParent(root_);
-			}
-			//if the new key is less than the root_, left child
-			if(keyValuePair.first < root_->getKey()){
-				Node<Key, Value> *newNode = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
-				root_->setLeft(newNode);
-				newNode->setParent(root_);
-			}
-			//if already in the tree, set the root's value to the new value
-			if(keyValuePair.first == root_->getKey()){
-				root_->setValue(keyValuePair.second);
-			}
-			return;
-		}
-		//if it is not the root, create a temp variable to store current loc
-		Node<Key, Value> *temp = root_;
-		Node<Key, Value>* potentialParent = temp;
-		//while we haven't reached the end of the tree
-		while(temp!=NULL){
-			//if the new item is greater than the current node
-			if(keyValuePair.first > temp->getKey()){
-				//advance temp to its right child, advance parent to temp
-				potentialParent = temp;
-				temp = temp->getRight();
-				//if temp was a leaf node (aka is null when it is advanced)
-				//insert the new node as the right child of the leaf node
-				if(temp == NULL){
-					Node<Key, Value> *rightChild = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
-					potentialParent->setRight(rightChild);
-					rightChild->setParent(potentialParent);
-					return;
-				}
-			}
-			//if the new item is less than the current node
-			else if(keyValuePair.first < temp->getKey()){
-				//advance temp to its left child, advance parent to temp
-				potentialParent = temp;
-				temp = temp->getLeft();
-				//if temp was a leaf node (aka is null when it is advanced)
-				//insert the new node as the left child of the leaf node				
-				if(temp == NULL){
-					Node<Key, Value> *leftChild = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
-					potentialParent->setLeft(leftChild);
-					leftChild->setParent(potentialParent);
-					return;
-				}
-			}
-			//if already in tree, replace current value with new value
-			else if(keyValuePair.first == temp->getKey()){
-				temp->setValue(keyValuePair.second);
-				return;
-			}
+		Node<Key, Value>* parent;
+		Node<Key, Value>* existing = findInsertPosition(key, parent);
+		if(existing != NULL){
+			return std::make_pair(existing, false);
 		}
-		return;
-
-
+		NodeT* node = createNode<NodeT>(NULL, std::piecewise_construct,
+			std::forward_as_tuple(std::forward<K>(key)),
+			std::forward_as_tuple(std::forward<Args>(args)...));
+		linkNode(parent, node);
+		return std::make_pair(static_cast<Node<Key, Value>*>(node), true);
 }
 
 //helper function for 0 child remove case
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::noChildRemove(Node<Key, Value>* goal){
+#ifdef BST_ORDER_STATISTICS
+		shrinkPath(goal);
+#endif
 		Node<Key, Value> *goalParent = goal->getParent();
 		Node<Key, Value> *goalrChild = goalParent->getRight();
 		Node<Key, Value> *goallChild = goalParent->getLeft();
@@ -538,7 +1672,7 @@ void BinarySearchTree<Key, Value>::noChildRemove(Node<Key, Value>* goal){
 			goalParent->setLeft(NULL);
 		}
 		//delete and null node
-		delete goal;
+		destroyNode(goal);
 		goal = NULL;
 		return;
 }
@@ -547,13 +1681,16 @@ void BinarySearchTree<Key, Value>::noChildRemove(Node<Key, Value>* goal){
 // 0 refers to a left child, 1 refers to a right child
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::oneChildRemove(Node<Key, Value>* goal, int sideIndicate){
+#ifdef BST_ORDER_STATISTICS
+		shrinkPath(goal);
+#endif
 		
 		//if the node to remove is the root and it has a left child but no right
 		if(goal->getKey() == root_->getKey() && sideIndicate == 0){
 			//set the left child to be the new root and delete and null the old root
 			root_ = root_->getLeft();
 			root_->setParent(NULL);
-			delete goal;
+			destroyNode(goal);
 			goal = NULL;
 			return;
 		}
@@ -562,12 +1699,12 @@ void BinarySearchTree<Key, Value>::oneChildRemove(Node<Key, Value>* goal, int si
 			//set the right child to be the new root and delete and null the old root
 			root_ = root_->getRight();
 			root_->setParent(NULL);
-			delete goal;
+			destroyNode(goal);
 			goal = NULL;
 			return;
 		}
 		
-		Node<Key, Value> *goalChild;
+		Node<Key, Value> *goalChild = NULL;
 		//if child is left, set goalChild left
 		if(sideIndicate == 0){
 			goalChild = goal->getLeft();
@@ -579,7 +1716,7 @@ void BinarySearchTree<Key, Value>::oneChildRemove(Node<Key, Value>* goal, int si
 
 		//get goals parent, delete goal, promote goal node child to where goal used to be
 		Node<Key, Value> *goalParent = goal->getParent();
-		delete goal;
+		destroyNode(goal);
 		goal = NULL;
 		goalChild->setParent(goalParent);
 		if(goalParent->getKey() < goalChild->getKey()){
@@ -612,12 +1749,23 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
 		if(goal == NULL){
 			return;
 		}
+		removeNode(goal);
+}
+
+/**
+* Takes goal, a node of this tree, out of the tree and frees it.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::removeNode(Node<Key, Value>* goal)
+{
+		unlinkRightmost(goal);
+		nodeCount_--;
 		//case 1, 0 children, delete node, null parent pointers
 		if(goal->getLeft() == NULL && goal->getRight() == NULL){
 			//if the node to be removed is the root
 			if(goal->getKey() == root_->getKey()){
 				root_ = NULL;
-				delete goal;
+				destroyNode(goal);
 				return;
 			}
 			else{
@@ -694,18 +1842,15 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 		}
 		return temp;
 	}
-	//otherwise, walk up until you traverse right child pointer
-	//aka where child is greater than parent
-	else if(temp->getLeft() == NULL){
-		while(temp->getParent() != NULL){
-			//right child link
-			if((temp->getParent())->getKey() < temp->getKey()){
-				temp = temp->getParent();
-				return temp;
-			}
-		}
+	//otherwise, walk up until you traverse right child pointer,
+	//checking links by pointer so that no keys get compared
+	Node<Key, Value> *parent = temp->getParent();
+	while(parent != NULL && temp == parent->getLeft()){
+		temp = parent;
+		parent = parent->getParent();
 	}
-	return NULL;
+	//NULL if we came up from the leftmost node
+	return parent;
 
 }
 
@@ -736,20 +1881,65 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
 		}
 		return temp;
 	}
-	//otherwise walk up until you find a left child link
-	//aka the child is smaller than the parent
-	else if(temp->getRight() == NULL){
-		while(temp->getParent() != NULL){
-			//left child link
-			if((temp->getParent())->getKey() > temp->getKey()){
-				temp = temp->getParent();
-				return temp;
-			}
-			temp = temp->getParent();
-		}
+	//otherwise walk up until you find a left child link,
+	//checking links by pointer so that no keys get compared
+	Node<Key, Value> *parent = temp->getParent();
+	while(parent != NULL && temp == parent->getRight()){
+		temp = parent;
+		parent = parent->getParent();
 	}
-	return NULL;
+	//NULL if we came up from the rightmost node
+	return parent;
+
+}
+
+/**
+* Constructs a node of type NodeT in a slot taken from the pool, building
+* its item from args.
+*/
+template<typename Key, typename Value>
+template<typename NodeT, typename... Args>
+NodeT* BinarySearchTree<Key, Value>::createNode(NodeT* parent, Args&&... args)
+{
+		void* slot = pool_.allocate();
+		try{
+			return new (slot) NodeT(parent, std::forward<Args>(args)...);
+		}
+		catch(...){
+			pool_.deallocate(slot);
+			throw;
+		}
+}
+
+/**
+* Gets the node an iterator points at, for derived trees.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>*
+BinarySearchTree<Key, Value>::iteratorNode(const iterator& it)
+{
+		return it.current_;
+}
+
+/**
+* Wraps a node in an iterator, for derived trees which can't reach the
+* iterator's protected constructor.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::makeIterator(Node<Key, Value>* node) const
+{
+		return iterator(node, this);
+}
 
+/**
+* Destroys a node and returns its slot to the pool.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::destroyNode(Node<Key, Value>* node)
+{
+		node->~Node();
+		pool_.deallocate(node);
 }
 
 template<typename Key, typename Value>
@@ -764,7 +1954,7 @@ void BinarySearchTree<Key, Value>::clearHelper(Node<Key, Value> *node){
 	clearHelper(node->getRight());
 
 	//delete and null all nodes
-	delete node;
+	destroyNode(node);
 	node = NULL;
 }
 
@@ -775,13 +1965,402 @@ void BinarySearchTree<Key, Value>::clearHelper(Node<Key, Value> *node){
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::clear()
 {	
-		//call clearHelper function
-		clearHelper(root_);
+		//nodes holding trivially destructible items need no per-node work,
+		//otherwise call clearHelper function to run their destructors
+		if(!std::is_trivially_destructible<std::pair<const Key, Value> >::value){
+			clearHelper(root_);
+		}
+		//hand every slab back at once (slabs other trees still have nodes
+		//in after a split stay reserved for them)
+		pool_.release();
 
 		root_ = NULL;
+		rightmost_ = NULL;
+		nodeCount_ = 0;
+
+}
+
+/**
+* Replaces the contents of the tree with the items in [first, last), which
+* must be sorted by strictly increasing key. The result is height-balanced
+* and is built in O(n) without a single comparison or rotation.
+*/
+template<typename Key, typename Value>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value>::assign_sorted(ForwardIt first, ForwardIt last)
+{
+		std::size_t count = std::distance(first, last);
+		auto make = [&]() { return std::pair<const Key, Value>(*first++); };
+		ItemMaker<decltype(make)> items(make);
+		assignSortedItems(items, count);
+}
+
+/**
+* Inserts every item of [first, last), in any order, overwriting existing
+* values as insert does (a key repeated in the batch keeps its last value).
+* See insertBatch for how.
+*/
+template<typename Key, typename Value>
+template<typename InputIt>
+void BinarySearchTree<Key, Value>::insert_batch(InputIt first, InputIt last)
+{
+		std::vector<std::pair<Key, Value> > batch(first, last);
+		insertBatch(batch);
+}
+
+/**
+* Removes every key in [first, last); keys that are not in the tree are
+* ignored. See removeBatch for how.
+*/
+template<typename Key, typename Value>
+template<typename KeyIt>
+void BinarySearchTree<Key, Value>::remove_batch(KeyIt first, KeyIt last)
+{
+		std::vector<Key> keys(first, last);
+		removeBatch(keys);
+}
+
+/**
+* Inserts key with the item source builds, unless key is already in the
+* tree, in which case source is left alone.
+*/
+template<typename Key, typename Value>
+template<typename NodeT>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value>::insertMissing(const Key& key, ItemSource& item)
+{
+		Node<Key, Value>* parent;
+		Node<Key, Value>* existing = findInsertPosition(key, parent);
+		if(existing != NULL){
+			return std::make_pair(existing, false);
+		}
+		NodeT* node = createNode<NodeT>(NULL, item.make());
+		linkNode(parent, node);
+		return std::make_pair(static_cast<Node<Key, Value>*>(node), true);
+}
+
+/**
+* Hook behind emplace: inserts the item unless its key is already there.
+*/
+template<typename Key, typename Value>
+std::pair<typename BinarySearchTree<Key, Value>::iterator, bool>
+BinarySearchTree<Key, Value>::emplaceNode(ItemSource& item)
+{
+		std::pair<Node<Key, Value>*, bool> result = emplaceItem<Node<Key, Value> >(item.make());
+		return std::make_pair(iterator(result.first, this), result.second);
+}
+
+/**
+* Hook behind try_emplace: builds the item only if key is missing.
+*/
+template<typename Key, typename Value>
+std::pair<typename BinarySearchTree<Key, Value>::iterator, bool>
+BinarySearchTree<Key, Value>::tryEmplaceNode(const Key& key, ItemSource& item)
+{
+		std::pair<Node<Key, Value>*, bool> result = insertMissing<Node<Key, Value> >(key, item);
+		return std::make_pair(iterator(result.first, this), result.second);
+}
+
+/**
+* Hook behind assign_sorted: replaces the contents with the next count
+* items of items, in increasing key order.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::assignSortedItems(ItemSource& items, std::size_t count)
+{
+		SourceCursor cursor = { &items };
+		assignSortedNodes<Node<Key, Value> >(cursor, count);
+}
+
+/**
+* Hook behind insert_batch. The batch is sorted first (on several threads
+* when it is large). An empty tree is then built balanced straight from
+* it; otherwise the items go in median first, see insertMedians, since
+* inserting sorted keys one after the other would grow them into a chain
+* in a tree that never rebalances.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::insertBatch(std::vector<std::pair<Key, Value> >& batch)
+{
+		sortBatch(batch, ItemLess());
+		if(root_ == NULL){
+			assignSortedNodes<Node<Key, Value> >(std::make_move_iterator(batch.begin()), batch.size());
+			return;
+		}
+		insertMedians(batch, 0, batch.size());
+}
+
+/**
+* Inserts the sorted items batch[first, last) middle one first, then the
+* two halves around it the same way, so that the new keys spread over the
+* tree the way buildSorted would lay them out.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::insertMedians(std::vector<std::pair<Key, Value> >& batch,
+                                                 std::size_t first, std::size_t last)
+{
+		if(first == last){
+			return;
+		}
+		std::size_t middle = first + (last - first) / 2;
+		insertItem<Node<Key, Value> >(std::move(batch[middle]));
+		insertMedians(batch, first, middle);
+		insertMedians(batch, middle + 1, last);
+}
+
+/**
+* Hook behind remove_batch. The keys are sorted (and duplicates dropped)
+* first. Each key is then looked for starting from the successor of the
+* last key removed, see findFrom, rather than from the root, so a batch
+* of nearby keys only walks the part of the tree between them.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::removeBatch(std::vector<Key>& keys)
+{
+		sortBatch(keys, KeyLess());
+		//every key in the tree below next is below the keys still to go
+		Node<Key, Value>* next = getSmallestNode();
+		for(std::size_t i = 0; i < keys.size() && next != NULL; i++){
+			Node<Key, Value>* goal = findFrom(next, keys[i]);
+			if(goal != NULL){
+				next = successor(goal);
+				removeNode(goal);
+			}
+		}
+}
+
+/**
+* Finds key in the tree, or returns NULL, given that no key in the tree
+* below start's is at or above key. Climbs from start only as far as the
+* first ancestor whose subtree can hold key, then descends from there.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>*
+BinarySearchTree<Key, Value>::findFrom(Node<Key, Value>* start, const Key& key) const
+{
+		Node<Key, Value>* temp = start;
+		for(;;){
+			//the keys of temp's subtree stay below the parent of the first
+			//ancestor (temp included) that is a left child
+			Node<Key, Value>* child = temp;
+			while(child->getParent() != NULL && child->getParent()->getRight() == child){
+				child = child->getParent();
+			}
+			Node<Key, Value>* bound = child->getParent();
+			if(bound == NULL || BST_COMPARE(key < bound->getKey())){
+				break;
+			}
+			temp = bound;
+		}
+		while(temp != NULL){
+			if(BST_COMPARE(key < temp->getKey())){
+				temp = temp->getLeft();
+			}
+			else if(BST_COMPARE(temp->getKey() < key)){
+				temp = temp->getRight();
+			}
+			else{
+				return temp;
+			}
+		}
+		return NULL;
+}
+
+/**
+* Sorts batch stably by less, then drops all but the last of each run of
+* equal elements. A batch of at least BST_PARALLEL_SORT_MIN elements is
+* cut into one chunk per thread; the chunks are sorted in parallel and
+* then merged pairwise, again in parallel, until one is left.
+*/
+template<typename Key, typename Value>
+template<typename T, typename Less>
+void BinarySearchTree<Key, Value>::sortBatch(std::vector<T>& batch, Less less)
+{
+		std::size_t count = batch.size();
+		std::size_t chunks = 1;
+		if(count >= BST_PARALLEL_SORT_MIN){
+			while(chunks * 2 <= BST_PARALLEL_THREADS){
+				chunks *= 2;
+			}
+		}
+		std::vector<std::size_t> bounds(chunks + 1);
+		for(std::size_t i = 0; i <= chunks; i++){
+			bounds[i] = count / chunks * i + count % chunks * i / chunks;
+		}
+		typename std::vector<T>::iterator begin = batch.begin();
+		parallelFor(chunks, [&](std::size_t i) {
+			std::stable_sort(begin + bounds[i], begin + bounds[i + 1], less);
+		});
+		for(std::size_t width = 1; width < chunks; width *= 2){
+			parallelFor(chunks / (2 * width), [&](std::size_t i) {
+				std::size_t chunk = 2 * width * i;
+				std::inplace_merge(begin + bounds[chunk], begin + bounds[chunk + width],
+				                   begin + bounds[chunk + 2 * width], less);
+			});
+		}
+
+		//keep the last of equal elements, as inserting them one by one would
+		std::size_t kept = 0;
+		for(std::size_t i = 0; i < count; i++){
+			if(i + 1 < count && !less(batch[i], batch[i + 1])){
+				continue;
+			}
+			if(kept != i){
+				batch[kept] = std::move(batch[i]);
+			}
+			kept++;
+		}
+		batch.erase(batch.begin() + kept, batch.end());
+}
+
+/**
+* Runs task(0) ... task(tasks - 1), each on its own thread except task(0),
+* which runs on the calling one. Tasks that can't get a thread run on the
+* calling thread too. Returns once all are done, rethrowing the first
+* exception any of them threw.
+*/
+template<typename Key, typename Value>
+template<typename Task>
+void BinarySearchTree<Key, Value>::parallelFor(std::size_t tasks, Task task)
+{
+		std::vector<std::exception_ptr> errors(tasks);
+		std::vector<std::thread> workers;
+		workers.reserve(tasks);
+		auto run = [&](std::size_t i) {
+			try{
+				task(i);
+			}
+			catch(...){
+				errors[i] = std::current_exception();
+			}
+		};
+		for(std::size_t i = 1; i < tasks; i++){
+			try{
+				workers.push_back(std::thread(run, i));
+			}
+			catch(...){
+				run(i);
+			}
+		}
+		if(tasks > 0){
+			run(0);
+		}
+		for(std::size_t i = 0; i < workers.size(); i++){
+			workers[i].join();
+		}
+		for(std::size_t i = 0; i < tasks; i++){
+			if(errors[i]){
+				std::rethrow_exception(errors[i]);
+			}
+		}
+}
+
+/**
+* Writes every item to a snapshot file at path (see snapshot.h), replacing
+* any file already there only once the new one is complete. Key and Value
+* must be trivially copyable; they are stored as raw bytes.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::save(const std::string& path) const
+{
+		static_assert(std::is_trivially_copyable<Key>::value &&
+		              std::is_trivially_copyable<Value>::value,
+		              "save() stores keys and values as raw bytes");
+		SnapshotWriter writer(path, sizeof(Key), sizeof(Value), size());
+		for(Node<Key, Value>* temp = getSmallestNode(); temp != NULL; temp = successor(temp)){
+			writer.write(&temp->getKey(), sizeof(Key));
+			writer.write(&temp->getValue(), sizeof(Value));
+		}
+		writer.finish();
+}
 
+/**
+* Replaces the contents of the tree with a snapshot written by save(). The
+* items are streamed straight into a balanced tree in O(n), with no
+* parsing and no comparisons beyond checking their order. Throws
+* std::runtime_error if the file can't be read, is not a snapshot of this
+* Key/Value type or is damaged. A file whose header is rejected (including
+* one whose size doesn't match its item count) leaves the tree unchanged;
+* one whose items turn out damaged leaves it empty.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::load(const std::string& path)
+{
+		static_assert(std::is_trivially_copyable<Key>::value &&
+		              std::is_trivially_copyable<Value>::value,
+		              "load() reads keys and values as raw bytes");
+		SnapshotReader reader(path, sizeof(Key), sizeof(Value));
+		SnapshotItems<Key, Value> items(reader);
+		//built through the assign_sorted hook, so a derived tree gets its
+		//own kind of node
+		auto make = [&]() {
+			std::pair<const Key, Value> item(*items);
+			++items;
+			return item;
+		};
+		ItemMaker<decltype(make)> source(make);
+		assignSortedItems(source, static_cast<std::size_t>(reader.count()));
+		//the tree is complete either way, so a bad file can simply be
+		//cleared away again
+		if(!items.ordered() || !reader.finish()){
+			clear();
+			throw std::runtime_error("Snapshot " + path + " is damaged");
+		}
+}
+
+template<typename Key, typename Value>
+template<typename NodeT, typename ForwardIt>
+void BinarySearchTree<Key, Value>::assignSortedNodes(ForwardIt first, std::size_t count)
+{
+		clear();
+		int height = 0;
+		root_ = buildSorted<NodeT>(first, count, height);
+		rightmost_ = getLargestNode();
+		nodeCount_ = count;
 }
 
+/**
+* Builds a balanced subtree out of the next count items of it, advancing it
+* past them, and stores the subtree's height in height. Nodes are created in
+* key order, so neighbouring keys also end up close together in the pool.
+*/
+template<typename Key, typename Value>
+template<typename NodeT, typename ForwardIt>
+NodeT* BinarySearchTree<Key, Value>::buildSorted(ForwardIt& it, std::size_t count, int& height)
+{
+		//base case, an empty range makes an empty subtree
+		if(count == 0){
+			height = 0;
+			return NULL;
+		}
+		//count / 2 items go left and the rest, less the middle one, go
+		//right, so the two halves differ in size by at most one
+		int leftHeight = 0;
+		int rightHeight = 0;
+		std::size_t leftCount = count / 2;
+		NodeT* left = buildSorted<NodeT>(it, leftCount, leftHeight);
+
+		//the middle item becomes the subtree root
+		NodeT* node = createNode<NodeT>(NULL, *it);
+		++it;
+		node->setLeft(left);
+		if(left != NULL){
+			left->setParent(node);
+		}
+
+		NodeT* right = buildSorted<NodeT>(it, count - leftCount - 1, rightHeight);
+		node->setRight(right);
+		if(right != NULL){
+			right->setParent(node);
+		}
+
+		initSubtreeBalance(node, leftHeight, rightHeight);
+#ifdef BST_ORDER_STATISTICS
+		node->setSize(count);
+#endif
+		height = std::max(leftHeight, rightHeight) + 1;
+		return node;
+}
 
 /**
 * A helper function to find the smallest node in the tree.
@@ -802,6 +2381,25 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 		return temp;
 }
 
+/**
+* A helper function to find the largest node in the tree.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>*
+BinarySearchTree<Key, Value>::getLargestNode() const
+{
+		Node<Key, Value> *temp = root_;
+		//if empty, return NULL
+		if(temp == NULL){
+			return NULL;
+		}
+		//otherwise go to the right most node of the tree which would be the largest
+		while(temp->getRight() != NULL){
+			temp = temp->getRight();
+		}
+		return temp;
+}
+
 /**
 * Helper function to find a node with given key, k and
 * return a pointer to it or NULL if no item with that key
@@ -810,27 +2408,31 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 template<typename Key, typename Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
 {
+		BST_STAT(TreeStats::Lookup lookup(stats_));
 		//if empty, return
 		if(root_ == NULL){
 			return NULL;
 		}
 		//if the node to find is the root, return the root
-		if(root_->getKey() == key){
+		BST_STAT(lookup.visit());
+		if(BST_COMPARE(root_->getKey() == key)){
 			return root_;
 		}
 		Node<Key, Value> *temp = root_;
 		//while we haven't reached the end of the tree
 		while(temp != NULL){
+			//the root was counted above
+			BST_STAT(if(temp != root_) lookup.visit());
 			//if the key we want is greater than the current node, go right
-			if(key > temp->getKey()){
+			if(BST_COMPARE(key > temp->getKey())){
 				temp = temp->getRight();
 			}
 			// else if the key we want is less than the current node, go left
-			else if(key < temp->getKey()){
+			else if(BST_COMPARE(key < temp->getKey())){
 				temp = temp->getLeft();
 			}
 			//else if the key is equal to the current node, return the current node
-			else if(key == temp->getKey()){
+			else if(BST_COMPARE(key == temp->getKey())){
 				return temp;
 			}
 		}
@@ -895,6 +2497,7 @@ int BinarySearchTree<Key, Value>::calculateHeightIfBalanced(Node<Key, Value>* no
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
+    BST_STAT(stats_.nodeSwaps++);
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
     }
@@ -974,6 +2577,13 @@ void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value
         this->root_ = n1;
     }
 
+#ifdef BST_ORDER_STATISTICS
+    // the nodes traded places, so they trade subtree sizes too
+    std::size_t n1size = n1->getSize();
+    n1->setSize(n2->getSize());
+    n2->setSize(n1size);
+#endif
+
 }
 
 /**
@@ -0,0 +1,1019 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include "node_pool.h"
+
+// B+ tree with the same map interface as BinarySearchTree, so that
+//
+//     typedef BTree<int, std::string> Index;   // was AVLTree<int, std::string>
+//
+// is all it takes to switch containers. Every node fills NodeLines cache
+// lines: leaves hold as many key/value pairs as fit and are chained for
+// iteration, internal nodes hold as many separator keys and child pointers
+// as fit. With 4-byte keys and values and the default 4 lines, a leaf holds
+// 28 items and an internal node 20 children, so 30M keys are 6 or 7 levels
+// deep instead of the ~25 of a binary tree, and each level is a single
+// (prefetched) node.
+//
+// Differences from BinarySearchTree: *it yields a pair of references
+// (it->first, it->second and (*it).second = v all work, but a
+// std::pair<const Key, Value>& cannot be bound to it), and iterators are
+// invalidated by any insert or remove.
+
+#ifndef BTREE_CACHE_LINE
+#define BTREE_CACHE_LINE 64
+#endif
+
+#ifndef BTREE_NODE_LINES
+#define BTREE_NODE_LINES 4
+#endif
+
+// deepest possible tree: every internal node has at least 2 children
+#define BTREE_MAX_DEPTH 64
+
+#ifndef BST_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr) ((void)0)
+#endif
+#endif
+
+template <typename Key, typename Value, std::size_t NodeLines = BTREE_NODE_LINES>
+class BTree
+{
+private:
+    struct NodeBase
+    {
+        std::size_t count;  // number of keys
+        bool leaf;
+    };
+
+    static constexpr std::size_t nodeBytes = NodeLines * BTREE_CACHE_LINE;
+    static constexpr std::size_t leafHeader = sizeof(NodeBase) + 2 * sizeof(void*);
+    static constexpr std::size_t internalHeader = sizeof(NodeBase) + sizeof(void*);
+    static constexpr std::size_t leafFit = nodeBytes > leafHeader ?
+        (nodeBytes - leafHeader) / (sizeof(Key) + sizeof(Value)) : 0;
+    static constexpr std::size_t internalFit = nodeBytes > internalHeader ?
+        (nodeBytes - internalHeader) / (sizeof(Key) + sizeof(void*)) : 0;
+
+public:
+    // fan-out; at least 3 so that splitting and merging always work
+    static constexpr std::size_t leafCapacity = leafFit < 3 ? 3 : leafFit;
+    static constexpr std::size_t internalCapacity = internalFit < 3 ? 3 : internalFit;
+
+private:
+    typedef typename std::aligned_storage<sizeof(Key), alignof(Key)>::type KeySlot;
+    typedef typename std::aligned_storage<sizeof(Value), alignof(Value)>::type ValueSlot;
+
+    struct Leaf : public NodeBase
+    {
+        Leaf* prev;
+        Leaf* next;
+        KeySlot keys[leafCapacity];
+        ValueSlot values[leafCapacity];
+    };
+
+    struct Internal : public NodeBase
+    {
+        // children[i] holds the keys below keys[i], children[i+1] the rest
+        NodeBase* children[internalCapacity + 1];
+        KeySlot keys[internalCapacity];
+    };
+
+    static constexpr std::size_t minLeaf = leafCapacity / 2;
+    static constexpr std::size_t minInternal = (internalCapacity - 1) / 2;
+
+public:
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, Value&> reference;
+
+        /**
+        * Lets it->first / it->second work even though the key and value
+        * live in different arrays.
+        */
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& item) : item_(item) { }
+            const reference* operator->() const { return &item_; }
+        private:
+            reference item_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, NodeLines>;
+        iterator(Leaf* leaf, std::size_t slot, const BTree<Key, Value, NodeLines>* tree);
+        Leaf* leaf_;        // NULL means end()
+        std::size_t slot_;
+        const BTree<Key, Value, NodeLines> *tree_;  // so that --end() works
+    };
+
+    BTree();
+    ~BTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+    std::size_t height() const;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+private:
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+
+    static Key* keysOf(Leaf* leaf);
+    static Value* valuesOf(Leaf* leaf);
+    static Key* keysOf(Internal* node);
+    static std::size_t lowerIndex(const Key* keys, std::size_t count, const Key& key);
+    static std::size_t upperIndex(const Key* keys, std::size_t count, const Key& key);
+    static void prefetchNode(const NodeBase* node);
+
+    template<typename T, typename U>
+    static void slotInsert(T* items, std::size_t count, std::size_t pos, U&& item);
+    template<typename T>
+    static void slotErase(T* items, std::size_t count, std::size_t pos);
+    template<typename T>
+    static void slotTransfer(T* src, std::size_t from, std::size_t n, T* dst, std::size_t at);
+
+    Leaf* newLeaf();
+    Internal* newInternal();
+    void freeLeaf(Leaf* leaf);
+    void freeInternal(Internal* node);
+
+    Leaf* findLeaf(const Key& key) const;
+    Leaf* firstLeaf() const;
+    Leaf* lastLeaf() const;
+    template<typename V>
+    void insertItem(const Key& key, V&& value);
+    void insertSeparator(Internal** path, std::size_t* slots, std::size_t depth,
+                         const Key& separator, NodeBase* rightChild);
+    void rebalanceLeaf(Leaf* leaf, Internal* parent, std::size_t slot);
+    void rebalanceInternal(Internal* node, Internal* parent, std::size_t slot);
+    void mergeInternal(Internal* left, Internal* right, Internal* parent, std::size_t slot);
+    void clearHelper(NodeBase* node);
+
+    NodeBase* root_;
+    std::size_t count_;
+    NodePool leafPool_;
+    NodePool internalPool_;
+};
+
+/*
+---------------------------------------------------
+Begin implementations for the BTree::iterator class.
+---------------------------------------------------
+*/
+
+template<typename Key, typename Value, std::size_t NodeLines>
+BTree<Key, Value, NodeLines>::iterator::iterator() :
+    leaf_(NULL),
+    slot_(0),
+    tree_(NULL)
+{
+
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+BTree<Key, Value, NodeLines>::iterator::iterator(Leaf* leaf, std::size_t slot,
+                                                 const BTree<Key, Value, NodeLines>* tree) :
+    leaf_(leaf),
+    slot_(slot),
+    tree_(tree)
+{
+
+}
+
+/**
+* Provides access to the item, as a pair of references.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator::reference
+BTree<Key, Value, NodeLines>::iterator::operator*() const
+{
+    return reference(keysOf(leaf_)[slot_], valuesOf(leaf_)[slot_]);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator::pointer
+BTree<Key, Value, NodeLines>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+bool BTree<Key, Value, NodeLines>::iterator::operator==(const iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && slot_ == rhs.slot_;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+bool BTree<Key, Value, NodeLines>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Advances to the next key, moving on to the next leaf at the end of this one.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator&
+BTree<Key, Value, NodeLines>::iterator::operator++()
+{
+    slot_++;
+    if(slot_ == leaf_->count){
+        leaf_ = leaf_->next;
+        slot_ = 0;
+    }
+    return *this;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator
+BTree<Key, Value, NodeLines>::iterator::operator++(int)
+{
+    iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves back to the previous key; from end() that is the largest key.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator&
+BTree<Key, Value, NodeLines>::iterator::operator--()
+{
+    if(leaf_ == NULL){
+        leaf_ = tree_->lastLeaf();
+        slot_ = leaf_->count;
+    }
+    else if(slot_ == 0){
+        leaf_ = leaf_->prev;
+        slot_ = leaf_->count;
+    }
+    slot_--;
+    return *this;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator
+BTree<Key, Value, NodeLines>::iterator::operator--(int)
+{
+    iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------
+End implementations for the BTree::iterator class.
+-------------------------------------------------
+*/
+
+/**
+* Creates an empty tree; nodes come from two pools, one per node kind,
+* and start on cache line boundaries.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+BTree<Key, Value, NodeLines>::BTree() :
+    root_(NULL),
+    count_(0),
+    leafPool_(sizeof(Leaf), BTREE_CACHE_LINE),
+    internalPool_(sizeof(Internal), BTREE_CACHE_LINE)
+{
+
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+BTree<Key, Value, NodeLines>::~BTree()
+{
+    clear();
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already present.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    insertItem(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Same as above, but the value is moved into the tree.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    insertItem(keyValuePair.first, std::move(keyValuePair.second));
+}
+
+/**
+* Removes the key, if present. Leaves that drop below half full borrow
+* from or merge with a sibling, and the same is repeated up the tree.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::remove(const Key& key)
+{
+    if(root_ == NULL){
+        return;
+    }
+    //remember the way down, since nodes don't point at their parents
+    Internal* path[BTREE_MAX_DEPTH];
+    std::size_t slots[BTREE_MAX_DEPTH];
+    std::size_t depth = 0;
+    NodeBase* node = root_;
+    while(!node->leaf){
+        Internal* internal = static_cast<Internal*>(node);
+        std::size_t slot = upperIndex(keysOf(internal), internal->count, key);
+        path[depth] = internal;
+        slots[depth] = slot;
+        depth++;
+        node = internal->children[slot];
+        prefetchNode(node);
+    }
+    Leaf* leaf = static_cast<Leaf*>(node);
+    std::size_t pos = lowerIndex(keysOf(leaf), leaf->count, key);
+    if(pos == leaf->count || key < keysOf(leaf)[pos]){
+        return;
+    }
+    slotErase(keysOf(leaf), leaf->count, pos);
+    slotErase(valuesOf(leaf), leaf->count, pos);
+    leaf->count--;
+    count_--;
+
+    //a root leaf may hold any number of keys
+    if(depth == 0){
+        if(leaf->count == 0){
+            freeLeaf(leaf);
+            root_ = NULL;
+        }
+        return;
+    }
+    if(leaf->count >= minLeaf){
+        return;
+    }
+    std::size_t level = depth - 1;
+    rebalanceLeaf(leaf, path[level], slots[level]);
+    //the parent may have lost a key; fix internal nodes up to the root
+    while(true){
+        Internal* internal = path[level];
+        if(level == 0){
+            //a root without keys has a single child, which becomes the root
+            if(internal->count == 0){
+                root_ = internal->children[0];
+                freeInternal(internal);
+            }
+            break;
+        }
+        if(internal->count >= minInternal){
+            break;
+        }
+        rebalanceInternal(internal, path[level - 1], slots[level - 1]);
+        level--;
+    }
+}
+
+/**
+* Deletes every item. Nodes are only visited one by one if the keys or
+* values need destroying; otherwise the pools just drop their slabs.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::clear()
+{
+    if(!std::is_trivially_destructible<Key>::value ||
+       !std::is_trivially_destructible<Value>::value){
+        if(root_ != NULL){
+            clearHelper(root_);
+        }
+    }
+    leafPool_.release();
+    internalPool_.release();
+    root_ = NULL;
+    count_ = 0;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+bool BTree<Key, Value, NodeLines>::empty() const
+{
+    return root_ == NULL;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+std::size_t BTree<Key, Value, NodeLines>::size() const
+{
+    return count_;
+}
+
+/**
+* Number of levels, counting the leaves; 0 for an empty tree.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+std::size_t BTree<Key, Value, NodeLines>::height() const
+{
+    std::size_t levels = 0;
+    for(NodeBase* node = root_; node != NULL; levels++){
+        if(node->leaf){
+            node = NULL;
+        }
+        else{
+            node = static_cast<Internal*>(node)->children[0];
+        }
+    }
+    return levels;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator BTree<Key, Value, NodeLines>::begin() const
+{
+    return iterator(firstLeaf(), 0, this);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator BTree<Key, Value, NodeLines>::end() const
+{
+    return iterator(NULL, 0, this);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator
+BTree<Key, Value, NodeLines>::find(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if(leaf == NULL){
+        return end();
+    }
+    std::size_t pos = lowerIndex(keysOf(leaf), leaf->count, key);
+    if(pos == leaf->count || key < keysOf(leaf)[pos]){
+        return end();
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator
+BTree<Key, Value, NodeLines>::lower_bound(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if(leaf == NULL){
+        return end();
+    }
+    std::size_t pos = lowerIndex(keysOf(leaf), leaf->count, key);
+    //the answer may be the first key of the next leaf
+    if(pos == leaf->count){
+        return iterator(leaf->next, 0, this);
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::iterator
+BTree<Key, Value, NodeLines>::upper_bound(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if(leaf == NULL){
+        return end();
+    }
+    std::size_t pos = upperIndex(keysOf(leaf), leaf->count, key);
+    if(pos == leaf->count){
+        return iterator(leaf->next, 0, this);
+    }
+    return iterator(leaf, pos, this);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<typename Key, typename Value, std::size_t NodeLines>
+Value& BTree<Key, Value, NodeLines>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return (*it).second;
+}
+template<typename Key, typename Value, std::size_t NodeLines>
+Value const & BTree<Key, Value, NodeLines>::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return (*it).second;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+Key* BTree<Key, Value, NodeLines>::keysOf(Leaf* leaf)
+{
+    return reinterpret_cast<Key*>(leaf->keys);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+Value* BTree<Key, Value, NodeLines>::valuesOf(Leaf* leaf)
+{
+    return reinterpret_cast<Value*>(leaf->values);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+Key* BTree<Key, Value, NodeLines>::keysOf(Internal* node)
+{
+    return reinterpret_cast<Key*>(node->keys);
+}
+
+/**
+* Index of the first key not less than key (count if there is none).
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+std::size_t BTree<Key, Value, NodeLines>::lowerIndex(const Key* keys, std::size_t count,
+                                                     const Key& key)
+{
+    std::size_t lo = 0;
+    std::size_t hi = count;
+    while(lo < hi){
+        std::size_t mid = lo + (hi - lo) / 2;
+        if(keys[mid] < key){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+* Index of the first key greater than key (count if there is none).
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+std::size_t BTree<Key, Value, NodeLines>::upperIndex(const Key* keys, std::size_t count,
+                                                     const Key& key)
+{
+    std::size_t lo = 0;
+    std::size_t hi = count;
+    while(lo < hi){
+        std::size_t mid = lo + (hi - lo) / 2;
+        if(key < keys[mid]){
+            hi = mid;
+        }
+        else{
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/**
+* Asks for every line of a node at once, so the binary search inside it
+* waits for one miss instead of one per line it touches.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::prefetchNode(const NodeBase* node)
+{
+    const char* bytes = reinterpret_cast<const char*>(node);
+    for(std::size_t line = 0; line < NodeLines; line++){
+        BST_PREFETCH(bytes + line * BTREE_CACHE_LINE);
+    }
+}
+
+/**
+* Inserts item at pos in an array of count constructed items, shifting
+* the ones after it up by one.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+template<typename T, typename U>
+void BTree<Key, Value, NodeLines>::slotInsert(T* items, std::size_t count, std::size_t pos,
+                                              U&& item)
+{
+    if(pos == count){
+        new (&items[count]) T(std::forward<U>(item));
+        return;
+    }
+    new (&items[count]) T(std::move(items[count - 1]));
+    std::move_backward(items + pos, items + count - 1, items + count);
+    items[pos] = std::forward<U>(item);
+}
+
+/**
+* Removes the item at pos from an array of count constructed items.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+template<typename T>
+void BTree<Key, Value, NodeLines>::slotErase(T* items, std::size_t count, std::size_t pos)
+{
+    std::move(items + pos + 1, items + count, items + pos);
+    items[count - 1].~T();
+}
+
+/**
+* Moves src[from, from + n) into the unconstructed dst[at, at + n) and
+* destroys the originals.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+template<typename T>
+void BTree<Key, Value, NodeLines>::slotTransfer(T* src, std::size_t from, std::size_t n,
+                                                T* dst, std::size_t at)
+{
+    for(std::size_t i = 0; i < n; i++){
+        new (&dst[at + i]) T(std::move(src[from + i]));
+        src[from + i].~T();
+    }
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::Leaf* BTree<Key, Value, NodeLines>::newLeaf()
+{
+    Leaf* leaf = new (leafPool_.allocate()) Leaf;
+    leaf->count = 0;
+    leaf->leaf = true;
+    leaf->prev = NULL;
+    leaf->next = NULL;
+    return leaf;
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::Internal* BTree<Key, Value, NodeLines>::newInternal()
+{
+    Internal* node = new (internalPool_.allocate()) Internal;
+    node->count = 0;
+    node->leaf = false;
+    return node;
+}
+
+/**
+* Unlinks an empty leaf from the leaf chain and gives it back to the pool.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::freeLeaf(Leaf* leaf)
+{
+    if(leaf->prev != NULL){
+        leaf->prev->next = leaf->next;
+    }
+    if(leaf->next != NULL){
+        leaf->next->prev = leaf->prev;
+    }
+    leafPool_.deallocate(leaf);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::freeInternal(Internal* node)
+{
+    internalPool_.deallocate(node);
+}
+
+/**
+* Descends to the leaf that holds key, if it is anywhere.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::Leaf*
+BTree<Key, Value, NodeLines>::findLeaf(const Key& key) const
+{
+    NodeBase* node = root_;
+    if(node == NULL){
+        return NULL;
+    }
+    while(!node->leaf){
+        Internal* internal = static_cast<Internal*>(node);
+        node = internal->children[upperIndex(keysOf(internal), internal->count, key)];
+        prefetchNode(node);
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::Leaf* BTree<Key, Value, NodeLines>::firstLeaf() const
+{
+    NodeBase* node = root_;
+    if(node == NULL){
+        return NULL;
+    }
+    while(!node->leaf){
+        node = static_cast<Internal*>(node)->children[0];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<typename Key, typename Value, std::size_t NodeLines>
+typename BTree<Key, Value, NodeLines>::Leaf* BTree<Key, Value, NodeLines>::lastLeaf() const
+{
+    NodeBase* node = root_;
+    if(node == NULL){
+        return NULL;
+    }
+    while(!node->leaf){
+        Internal* internal = static_cast<Internal*>(node);
+        node = internal->children[internal->count];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+/**
+* Puts key/value in its leaf, splitting the leaf in two halves if it is
+* full and passing the first key of the new right half up as a separator.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+template<typename V>
+void BTree<Key, Value, NodeLines>::insertItem(const Key& key, V&& value)
+{
+    if(root_ == NULL){
+        Leaf* leaf = newLeaf();
+        new (&keysOf(leaf)[0]) Key(key);
+        try{
+            new (&valuesOf(leaf)[0]) Value(std::forward<V>(value));
+        }
+        catch(...){
+            keysOf(leaf)[0].~Key();
+            freeLeaf(leaf);
+            throw;
+        }
+        leaf->count = 1;
+        root_ = leaf;
+        count_ = 1;
+        return;
+    }
+    Internal* path[BTREE_MAX_DEPTH];
+    std::size_t slots[BTREE_MAX_DEPTH];
+    std::size_t depth = 0;
+    NodeBase* node = root_;
+    while(!node->leaf){
+        Internal* internal = static_cast<Internal*>(node);
+        std::size_t slot = upperIndex(keysOf(internal), internal->count, key);
+        path[depth] = internal;
+        slots[depth] = slot;
+        depth++;
+        node = internal->children[slot];
+        prefetchNode(node);
+    }
+    Leaf* leaf = static_cast<Leaf*>(node);
+    Key* keys = keysOf(leaf);
+    std::size_t pos = lowerIndex(keys, leaf->count, key);
+    //the key is already there, so just overwrite the value
+    if(pos < leaf->count && !(key < keys[pos])){
+        valuesOf(leaf)[pos] = std::forward<V>(value);
+        return;
+    }
+    if(leaf->count < leafCapacity){
+        slotInsert(keys, leaf->count, pos, key);
+        slotInsert(valuesOf(leaf), leaf->count, pos, std::forward<V>(value));
+        leaf->count++;
+        count_++;
+        return;
+    }
+
+    //split: the upper half moves to a new leaf to the right
+    Leaf* right = newLeaf();
+    std::size_t half = leafCapacity / 2;
+    slotTransfer(keys, half, leafCapacity - half, keysOf(right), 0);
+    slotTransfer(valuesOf(leaf), half, leafCapacity - half, valuesOf(right), 0);
+    right->count = leafCapacity - half;
+    leaf->count = half;
+    right->next = leaf->next;
+    if(right->next != NULL){
+        right->next->prev = right;
+    }
+    right->prev = leaf;
+    leaf->next = right;
+    if(pos <= half){
+        slotInsert(keys, leaf->count, pos, key);
+        slotInsert(valuesOf(leaf), leaf->count, pos, std::forward<V>(value));
+        leaf->count++;
+    }
+    else{
+        slotInsert(keysOf(right), right->count, pos - half, key);
+        slotInsert(valuesOf(right), right->count, pos - half, std::forward<V>(value));
+        right->count++;
+    }
+    count_++;
+    insertSeparator(path, slots, depth, keysOf(right)[0], right);
+}
+
+/**
+* Adds separator, with rightChild just after it, to the deepest node on
+* path. Full nodes split around their middle key, which moves up a level
+* instead; if the root splits, the tree grows a new root.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::insertSeparator(Internal** path, std::size_t* slots,
+                                                   std::size_t depth, const Key& separator,
+                                                   NodeBase* rightChild)
+{
+    Key carry(separator);
+    NodeBase* carryChild = rightChild;
+    while(depth > 0){
+        depth--;
+        Internal* parent = path[depth];
+        std::size_t pos = slots[depth];
+        Key* keys = keysOf(parent);
+        if(parent->count < internalCapacity){
+            slotInsert(keys, parent->count, pos, std::move(carry));
+            slotInsert(parent->children, parent->count + 1, pos + 1, carryChild);
+            parent->count++;
+            return;
+        }
+        //keys after mid go right, mid itself moves up
+        Internal* right = newInternal();
+        std::size_t mid = internalCapacity / 2;
+        Key promoted(std::move(keys[mid]));
+        slotTransfer(keys, mid + 1, internalCapacity - mid - 1, keysOf(right), 0);
+        slotTransfer(parent->children, mid + 1, internalCapacity - mid, right->children, 0);
+        keys[mid].~Key();
+        right->count = internalCapacity - mid - 1;
+        parent->count = mid;
+        if(pos <= mid){
+            slotInsert(keys, parent->count, pos, std::move(carry));
+            slotInsert(parent->children, parent->count + 1, pos + 1, carryChild);
+            parent->count++;
+        }
+        else{
+            slotInsert(keysOf(right), right->count, pos - mid - 1, std::move(carry));
+            slotInsert(right->children, right->count + 1, pos - mid, carryChild);
+            right->count++;
+        }
+        carry = std::move(promoted);
+        carryChild = right;
+    }
+    Internal* root = newInternal();
+    new (&keysOf(root)[0]) Key(std::move(carry));
+    root->children[0] = root_;
+    root->children[1] = carryChild;
+    root->count = 1;
+    root_ = root;
+}
+
+/**
+* Refills a leaf that fell below half full, which is child slot of
+* parent: borrow an item from a sibling that can spare one, or else merge
+* with a sibling, which takes a key out of parent.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::rebalanceLeaf(Leaf* leaf, Internal* parent, std::size_t slot)
+{
+    Leaf* left = slot > 0 ? static_cast<Leaf*>(parent->children[slot - 1]) : NULL;
+    Leaf* right = slot < parent->count ? static_cast<Leaf*>(parent->children[slot + 1]) : NULL;
+    if(left != NULL && left->count > minLeaf){
+        std::size_t last = left->count - 1;
+        slotInsert(keysOf(leaf), leaf->count, 0, std::move(keysOf(left)[last]));
+        slotInsert(valuesOf(leaf), leaf->count, 0, std::move(valuesOf(left)[last]));
+        keysOf(left)[last].~Key();
+        valuesOf(left)[last].~Value();
+        leaf->count++;
+        left->count--;
+        keysOf(parent)[slot - 1] = keysOf(leaf)[0];
+        return;
+    }
+    if(right != NULL && right->count > minLeaf){
+        slotInsert(keysOf(leaf), leaf->count, leaf->count, std::move(keysOf(right)[0]));
+        slotInsert(valuesOf(leaf), leaf->count, leaf->count, std::move(valuesOf(right)[0]));
+        slotErase(keysOf(right), right->count, 0);
+        slotErase(valuesOf(right), right->count, 0);
+        leaf->count++;
+        right->count--;
+        keysOf(parent)[slot] = keysOf(right)[0];
+        return;
+    }
+    //merge the right one of the two leaves into the left one
+    std::size_t separator = slot;
+    if(left != NULL){
+        right = leaf;
+        separator = slot - 1;
+    }
+    else{
+        left = leaf;
+    }
+    slotTransfer(keysOf(right), 0, right->count, keysOf(left), left->count);
+    slotTransfer(valuesOf(right), 0, right->count, valuesOf(left), left->count);
+    left->count += right->count;
+    right->count = 0;
+    freeLeaf(right);
+    slotErase(keysOf(parent), parent->count, separator);
+    slotErase(parent->children, parent->count + 1, separator + 1);
+    parent->count--;
+}
+
+/**
+* Same as rebalanceLeaf for an internal node, except that keys rotate
+* through the parent instead of being copied up.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::rebalanceInternal(Internal* node, Internal* parent,
+                                                     std::size_t slot)
+{
+    Internal* left = slot > 0 ? static_cast<Internal*>(parent->children[slot - 1]) : NULL;
+    Internal* right = slot < parent->count ?
+                      static_cast<Internal*>(parent->children[slot + 1]) : NULL;
+    Key* parentKeys = keysOf(parent);
+    if(left != NULL && left->count > minInternal){
+        std::size_t last = left->count - 1;
+        slotInsert(keysOf(node), node->count, 0, std::move(parentKeys[slot - 1]));
+        slotInsert(node->children, node->count + 1, 0, left->children[left->count]);
+        node->count++;
+        parentKeys[slot - 1] = std::move(keysOf(left)[last]);
+        keysOf(left)[last].~Key();
+        left->count--;
+        return;
+    }
+    if(right != NULL && right->count > minInternal){
+        slotInsert(keysOf(node), node->count, node->count, std::move(parentKeys[slot]));
+        slotInsert(node->children, node->count + 1, node->count + 1, right->children[0]);
+        node->count++;
+        parentKeys[slot] = std::move(keysOf(right)[0]);
+        slotErase(keysOf(right), right->count, 0);
+        slotErase(right->children, right->count + 1, 0);
+        right->count--;
+        return;
+    }
+    if(left != NULL){
+        mergeInternal(left, node, parent, slot - 1);
+    }
+    else{
+        mergeInternal(node, right, parent, slot);
+    }
+}
+
+/**
+* Appends the separator at slot of parent and all of right to left, then
+* removes the separator and right from parent.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::mergeInternal(Internal* left, Internal* right,
+                                                 Internal* parent, std::size_t slot)
+{
+    Key* parentKeys = keysOf(parent);
+    new (&keysOf(left)[left->count]) Key(std::move(parentKeys[slot]));
+    slotTransfer(keysOf(right), 0, right->count, keysOf(left), left->count + 1);
+    slotTransfer(right->children, 0, right->count + 1, left->children, left->count + 1);
+    left->count += right->count + 1;
+    freeInternal(right);
+    slotErase(parentKeys, parent->count, slot);
+    slotErase(parent->children, parent->count + 1, slot + 1);
+    parent->count--;
+}
+
+/**
+* Destroys the keys and values below node; the memory goes with the pools.
+*/
+template<typename Key, typename Value, std::size_t NodeLines>
+void BTree<Key, Value, NodeLines>::clearHelper(NodeBase* node)
+{
+    if(node->leaf){
+        Leaf* leaf = static_cast<Leaf*>(node);
+        for(std::size_t i = 0; i < leaf->count; i++){
+            keysOf(leaf)[i].~Key();
+            valuesOf(leaf)[i].~Value();
+        }
+        return;
+    }
+    Internal* internal = static_cast<Internal*>(node);
+    for(std::size_t i = 0; i <= internal->count; i++){
+        clearHelper(internal->children[i]);
+    }
+    for(std::size_t i = 0; i < internal->count; i++){
+        keysOf(internal)[i].~Key();
+    }
+}
+
+#endif
@@ -0,0 +1,389 @@
+#ifndef CONCURRENTAVL_H
+#define CONCURRENTAVL_H
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <pthread.h>
+#include "avlbst.h"
+
+// AVLTree that many threads can share (build with -pthread).
+//
+// Writers are serialized by a read/write lock and, while they hold it,
+// keep a version counter odd. When the key is a plain number or enum (see
+// OptimisticKey) and Value is trivially copyable, lookups take no lock at
+// all: they note the version, descend
+// the tree as if nothing were happening, copy out what they found and
+// then check that the version is unchanged and was even, retrying if a
+// writer got in the way (a seqlock). Readers never write shared memory, so
+// they scale with the number of cores. A reader that races a writer may
+// follow pointers into nodes that are being rotated or were just freed;
+// that is safe because freed nodes stay inside the node pool, whose slabs
+// are only given back when the tree is destroyed, and descents are cut off
+// after CONCURRENT_AVL_MAX_STEPS nodes in case they meet a half-done
+// rotation. After CONCURRENT_AVL_RETRIES failed attempts, or always for
+// other keys and values, readers take the read lock.
+//
+// A racing reader also compares keys that a writer is overwriting, or
+// that belong to a freed node whose first bytes now hold a free-list
+// link. That is harmless for numbers, but a key such as a const char*
+// compared with strcmp, or a struct holding pointers, would be
+// dereferenced as garbage. Such keys use the read lock unless
+// OptimisticKey is specialized for them, which is only safe if their
+// operator< never follows a pointer or otherwise depends on the bytes
+// making sense.
+
+#ifndef CONCURRENT_AVL_RETRIES
+#define CONCURRENT_AVL_RETRIES 16
+#endif
+
+// well above the height of any AVL tree that fits in memory
+#define CONCURRENT_AVL_MAX_STEPS 128
+
+/**
+* Whether ConcurrentAVLTree may compare keys of this type without holding
+* the lock, i.e. on bytes that may be torn or stale.
+*/
+template <typename Key>
+struct OptimisticKey :
+    std::integral_constant<bool, std::is_arithmetic<Key>::value || std::is_enum<Key>::value>
+{
+};
+
+template <typename Key, typename Value>
+class ConcurrentAVLTree : private AVLTree<Key, Value>
+{
+public:
+    ConcurrentAVLTree();
+    ~ConcurrentAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value at(const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    template<typename Reader>
+    void read(Reader reader) const;
+
+private:
+    ConcurrentAVLTree(const ConcurrentAVLTree&) = delete;
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&) = delete;
+
+    typedef std::integral_constant<bool,
+        OptimisticKey<Key>::value &&
+        std::is_trivially_copyable<Key>::value &&
+        std::is_trivially_copyable<Value>::value> optimistic;
+    typedef typename std::aligned_storage<sizeof(Value), alignof(Value)>::type ValueSlot;
+
+    /**
+    * Holds the write lock and keeps the version odd for as long as it lives.
+    */
+    class WriteGuard
+    {
+    public:
+        explicit WriteGuard(const ConcurrentAVLTree* tree);
+        ~WriteGuard();
+    private:
+        const ConcurrentAVLTree* tree_;
+    };
+
+    /**
+    * Holds the read lock for as long as it lives.
+    */
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(const ConcurrentAVLTree* tree);
+        ~ReadGuard();
+    private:
+        const ConcurrentAVLTree* tree_;
+    };
+
+    template<typename Attempt>
+    bool tryOptimistic(Attempt& attempt) const;
+    bool descend(const Key& key, Node<Key, Value>*& found) const;
+    bool findHelper(const Key& key, Value* value, std::true_type) const;
+    bool findHelper(const Key& key, Value* value, std::false_type) const;
+    std::size_t sizeHelper(std::true_type) const;
+    std::size_t sizeHelper(std::false_type) const;
+    static void relax();
+
+    mutable pthread_rwlock_t lock_;
+    mutable std::atomic<unsigned long> version_;  // odd while a writer is active
+};
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::WriteGuard::WriteGuard(const ConcurrentAVLTree* tree) :
+    tree_(tree)
+{
+    pthread_rwlock_wrlock(&tree_->lock_);
+    unsigned long version = tree_->version_.load(std::memory_order_relaxed);
+    tree_->version_.store(version + 1, std::memory_order_relaxed);
+    //readers must not see any of our writes before they see the odd version
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::WriteGuard::~WriteGuard()
+{
+    unsigned long version = tree_->version_.load(std::memory_order_relaxed);
+    tree_->version_.store(version + 1, std::memory_order_release);
+    pthread_rwlock_unlock(&tree_->lock_);
+}
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::ReadGuard::ReadGuard(const ConcurrentAVLTree* tree) :
+    tree_(tree)
+{
+    pthread_rwlock_rdlock(&tree_->lock_);
+}
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::ReadGuard::~ReadGuard()
+{
+    pthread_rwlock_unlock(&tree_->lock_);
+}
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::ConcurrentAVLTree() :
+    version_(0)
+{
+    if(pthread_rwlock_init(&lock_, NULL) != 0){
+        throw std::runtime_error("Could not create tree lock");
+    }
+}
+
+/**
+* No other thread may be using the tree any more.
+*/
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::~ConcurrentAVLTree()
+{
+    pthread_rwlock_destroy(&lock_);
+}
+
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    WriteGuard guard(this);
+    AVLTree<Key, Value>::insert(keyValuePair);
+}
+
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    WriteGuard guard(this);
+    AVLTree<Key, Value>::insert(std::move(keyValuePair));
+}
+
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::remove(const Key& key)
+{
+    WriteGuard guard(this);
+    AVLTree<Key, Value>::remove(key);
+}
+
+/**
+* Removes the items one at a time rather than dropping the pool's slabs,
+* which lock-free readers may still be looking at.
+*/
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::clear()
+{
+    WriteGuard guard(this);
+    while(this->root_ != NULL){
+        AVLTree<Key, Value>::remove(this->getSmallestNode()->getKey());
+    }
+}
+
+/**
+* Copies the value stored under key into value and returns true, or
+* returns false (leaving value alone) if the key is not in the tree.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::find(const Key& key, Value& value) const
+{
+    return findHelper(key, &value, optimistic());
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::contains(const Key& key) const
+{
+    return findHelper(key, NULL, optimistic());
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns a copy of the value associated with the key
+ */
+template<class Key, class Value>
+Value ConcurrentAVLTree<Key, Value>::at(const Key& key) const
+{
+    ReadGuard guard(this);
+    Node<Key, Value>* node = this->internalFind(key);
+    if(node == NULL) throw std::out_of_range("Invalid key");
+    return node->getValue();
+}
+
+template<class Key, class Value>
+std::size_t ConcurrentAVLTree<Key, Value>::size() const
+{
+    return sizeHelper(optimistic());
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* Calls reader with the underlying AVLTree while holding the read lock,
+* for anything beyond single lookups (iteration, range queries, ...).
+* Other readers run alongside; writers wait.
+*/
+template<class Key, class Value>
+template<typename Reader>
+void ConcurrentAVLTree<Key, Value>::read(Reader reader) const
+{
+    ReadGuard guard(this);
+    reader(static_cast<const AVLTree<Key, Value>&>(*this));
+}
+
+/**
+* Runs attempt() between two reads of the version until it completes
+* with no writer having been active, giving up after
+* CONCURRENT_AVL_RETRIES tries. attempt returns false if what it saw
+* was inconsistent.
+*/
+template<class Key, class Value>
+template<typename Attempt>
+bool ConcurrentAVLTree<Key, Value>::tryOptimistic(Attempt& attempt) const
+{
+    for(unsigned tries = 0; tries < CONCURRENT_AVL_RETRIES; tries++){
+        unsigned long before = version_.load(std::memory_order_acquire);
+        if(before & 1){
+            relax();
+            continue;
+        }
+        bool complete = attempt();
+        //none of attempt's reads may move past the second version check
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(complete && version_.load(std::memory_order_relaxed) == before){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* Bounded, lock-free descent. Returns false if it ran for too long,
+* which can only happen while a writer is restructuring the tree.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::descend(const Key& key, Node<Key, Value>*& found) const
+{
+    Node<Key, Value>* temp = this->root_;
+    for(unsigned steps = 0; steps < CONCURRENT_AVL_MAX_STEPS; steps++){
+        if(temp == NULL){
+            found = NULL;
+            return true;
+        }
+        if(key < temp->getKey()){
+            temp = temp->getLeft();
+        }
+        else if(temp->getKey() < key){
+            temp = temp->getRight();
+        }
+        else{
+            found = temp;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* Lock-free lookup; the value is copied bytewise into a local slot and only
+* handed out once the version check says the copy is not torn.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::findHelper(const Key& key, Value* value,
+                                               std::true_type) const
+{
+    ValueSlot copy;
+    Node<Key, Value>* node = NULL;
+    auto attempt = [&]() -> bool {
+        if(!descend(key, node)){
+            return false;
+        }
+        if(node != NULL && value != NULL){
+            std::memcpy(&copy, &node->getValue(), sizeof(Value));
+        }
+        return true;
+    };
+    if(tryOptimistic(attempt)){
+        if(node != NULL && value != NULL){
+            std::memcpy(value, &copy, sizeof(Value));
+        }
+        return node != NULL;
+    }
+    return findHelper(key, value, std::false_type());
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::findHelper(const Key& key, Value* value,
+                                               std::false_type) const
+{
+    ReadGuard guard(this);
+    Node<Key, Value>* node = this->internalFind(key);
+    if(node == NULL){
+        return false;
+    }
+    if(value != NULL){
+        *value = node->getValue();
+    }
+    return true;
+}
+
+template<class Key, class Value>
+std::size_t ConcurrentAVLTree<Key, Value>::sizeHelper(std::true_type) const
+{
+    std::size_t count = 0;
+    auto attempt = [&]() -> bool {
+        count = this->nodeCount_;
+        return true;
+    };
+    if(tryOptimistic(attempt)){
+        return count;
+    }
+    return sizeHelper(std::false_type());
+}
+
+template<class Key, class Value>
+std::size_t ConcurrentAVLTree<Key, Value>::sizeHelper(std::false_type) const
+{
+    ReadGuard guard(this);
+    return this->nodeCount_;
+}
+
+/**
+* Backs off briefly while a writer finishes.
+*/
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef DURABLEAVL_H
+#define DURABLEAVL_H
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "avlbst.h"
+#include "wal.h"
+
+// AVLTree whose changes survive crashes (build with -pthread).
+//
+// The tree lives in memory; durability comes from two files next to each
+// other, path + ".snap" (a snapshot, see BinarySearchTree::save) and
+// path + ".wal" (a write-ahead log of every insert and remove since that
+// snapshot, see wal.h). insert() and remove() first wait until their log
+// record is on disk, with concurrent callers sharing syncs (group commit),
+// and only then change the tree, so lookups never see a change that a
+// crash could still undo. checkpoint() writes a fresh snapshot and
+// empties the log; opening the tree loads the snapshot and replays the
+// log on top of it.
+//
+// Lookups may run in any number of threads alongside each other and
+// alongside writers; changes are applied one at a time, in log order.
+// If the log can't be written, the change that hit the error and every
+// later one throw std::runtime_error and leave the tree as it was, so
+// memory never gets ahead of the disk. Key and Value must be trivially
+// copyable.
+
+template <typename Key, typename Value>
+class DurableAVLTree
+{
+public:
+    explicit DurableAVLTree(const std::string& path, const WalOptions& options = WalOptions());
+    ~DurableAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void checkpoint();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    template<typename Reader>
+    void read(Reader reader) const;
+
+    uint64_t sync_count() const;
+
+private:
+    DurableAVLTree(const DurableAVLTree&) = delete;
+    DurableAVLTree& operator=(const DurableAVLTree&) = delete;
+
+    /**
+    * Holds the tree lock, shared or exclusive, for as long as it lives.
+    */
+    class LockGuard
+    {
+    public:
+        LockGuard(const DurableAVLTree* tree, bool exclusive);
+        ~LockGuard();
+    private:
+        const DurableAVLTree* tree_;
+    };
+
+    void write(WriteAheadLog::RecordType type, const Key& key, const Value* value);
+    void recover();
+
+    std::string snapshotPath_;
+    AVLTree<Key, Value> tree_;
+    mutable pthread_rwlock_t lock_;  // guards tree_
+    std::mutex writers_;             // guards what follows
+    std::condition_variable turn_;   // signalled whenever applied_ or failed_ change
+    uint64_t appended_;              // sequence number of the last log append
+    uint64_t applied_;               // changes up to this one are in tree_
+    bool failed_;                    // the log failed; refuse further changes
+    WriteAheadLog log_;
+};
+
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::LockGuard::LockGuard(const DurableAVLTree* tree, bool exclusive) :
+    tree_(tree)
+{
+    if(exclusive){
+        pthread_rwlock_wrlock(&tree_->lock_);
+    }
+    else{
+        pthread_rwlock_rdlock(&tree_->lock_);
+    }
+}
+
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::LockGuard::~LockGuard()
+{
+    pthread_rwlock_unlock(&tree_->lock_);
+}
+
+/**
+* Opens the tree stored under path, creating it if there is nothing
+* there yet. Throws std::runtime_error if the snapshot or log can't be
+* read or belong to a tree of other types.
+*/
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::DurableAVLTree(const std::string& path, const WalOptions& options) :
+    snapshotPath_(path + ".snap"),
+    appended_(0),
+    applied_(0),
+    failed_(false),
+    log_(path + ".wal", sizeof(Key), sizeof(Value), options)
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "DurableAVLTree logs keys and values as raw bytes");
+    if(pthread_rwlock_init(&lock_, NULL) != 0){
+        throw std::runtime_error("Could not create tree lock");
+    }
+    try{
+        recover();
+    }
+    catch(...){
+        pthread_rwlock_destroy(&lock_);
+        throw;
+    }
+}
+
+/**
+* No other thread may be using the tree any more.
+*/
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::~DurableAVLTree()
+{
+    pthread_rwlock_destroy(&lock_);
+}
+
+/**
+* Inserts (or overwrites) the item once that is durable.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    write(WriteAheadLog::insertRecord, keyValuePair.first, &keyValuePair.second);
+}
+
+/**
+* Removes the key (if present) once that is durable.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::remove(const Key& key)
+{
+    write(WriteAheadLog::removeRecord, key, NULL);
+}
+
+/**
+* Saves a snapshot of the tree and empties the log, so that the next
+* start has less to replay. Writers wait meanwhile; readers don't.
+*
+* Changes still on their way from the log to the tree are let in first,
+* since emptying the log would otherwise lose them. A crash after the
+* snapshot is in place but before the log is emptied is harmless: every
+* record sets a key's state outright, so replaying records the snapshot
+* already reflects changes nothing.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::checkpoint()
+{
+    std::unique_lock<std::mutex> order(writers_);
+    while(applied_ != appended_ && !failed_){
+        turn_.wait(order);
+    }
+    if(failed_){
+        throw std::runtime_error("Could not checkpoint: the log has failed");
+    }
+    {
+        LockGuard guard(this, false);
+        tree_.save(snapshotPath_);
+    }
+    log_.reset();
+}
+
+/**
+* Copies the value stored under key into value and returns true, or
+* returns false if the key is not in the tree.
+*/
+template<class Key, class Value>
+bool DurableAVLTree<Key, Value>::find(const Key& key, Value& value) const
+{
+    LockGuard guard(this, false);
+    typename AVLTree<Key, Value>::iterator it = tree_.find(key);
+    if(it == tree_.end()){
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value>
+bool DurableAVLTree<Key, Value>::contains(const Key& key) const
+{
+    LockGuard guard(this, false);
+    return tree_.find(key) != tree_.end();
+}
+
+template<class Key, class Value>
+std::size_t DurableAVLTree<Key, Value>::size() const
+{
+    LockGuard guard(this, false);
+    return tree_.size();
+}
+
+template<class Key, class Value>
+bool DurableAVLTree<Key, Value>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* Calls reader with the underlying AVLTree while holding the read lock.
+*/
+template<class Key, class Value>
+template<typename Reader>
+void DurableAVLTree<Key, Value>::read(Reader reader) const
+{
+    LockGuard guard(this, false);
+    reader(static_cast<const AVLTree<Key, Value>&>(tree_));
+}
+
+/**
+* Number of log syncs so far (see WalOptions for trading latency for
+* fewer of them).
+*/
+template<class Key, class Value>
+uint64_t DurableAVLTree<Key, Value>::sync_count() const
+{
+    return log_.syncCount();
+}
+
+/**
+* Logs a change, waits until it is durable, then applies it to the tree.
+* Changes are applied in log order, each waiting for its turn, while the
+* syncs themselves are still shared between writers.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::write(WriteAheadLog::RecordType type, const Key& key,
+                                       const Value* value)
+{
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> order(writers_);
+        if(failed_){
+            throw std::runtime_error("Could not change the tree: the log has failed");
+        }
+        sequence = log_.append(type, &key, value);
+        appended_ = sequence;
+    }
+    try{
+        log_.commit(sequence);
+    }
+    catch(...){
+        //every later change fails too, so nobody waits for this one
+        std::lock_guard<std::mutex> order(writers_);
+        failed_ = true;
+        turn_.notify_all();
+        throw;
+    }
+
+    std::unique_lock<std::mutex> order(writers_);
+    while(applied_ + 1 != sequence){
+        turn_.wait(order);
+    }
+    try{
+        LockGuard guard(this, true);
+        if(type == WriteAheadLog::insertRecord){
+            tree_.insert(std::pair<const Key, Value>(key, *value));
+        }
+        else{
+            tree_.remove(key);
+        }
+    }
+    catch(...){
+        //the tree is now behind the log; let the others through, but no more
+        failed_ = true;
+        applied_ = sequence;
+        turn_.notify_all();
+        throw;
+    }
+    applied_ = sequence;
+    turn_.notify_all();
+}
+
+/**
+* Loads the last snapshot, if any, and replays the log on top of it.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::recover()
+{
+    struct stat info;
+    if(stat(snapshotPath_.c_str(), &info) == 0){
+        tree_.load(snapshotPath_);
+    }
+    typedef typename std::aligned_storage<sizeof(Key), alignof(Key)>::type KeySlot;
+    typedef typename std::aligned_storage<sizeof(Value), alignof(Value)>::type ValueSlot;
+    log_.replay([&](uint8_t type, const char* keyBytes, const char* valueBytes) {
+        //records are packed, so copy the bytes somewhere properly aligned
+        KeySlot key;
+        std::memcpy(&key, keyBytes, sizeof(Key));
+        const Key& k = *reinterpret_cast<const Key*>(&key);
+        if(type == WriteAheadLog::insertRecord){
+            ValueSlot value;
+            std::memcpy(&value, valueBytes, sizeof(Value));
+            tree_.insert(std::pair<const Key, Value>(k, *reinterpret_cast<const Value*>(&value)));
+        }
+        else{
+            tree_.remove(k);
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,532 @@
+#ifndef FROZENBST_H
+#define FROZENBST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <utility>
+
+// Read-only snapshot of a search tree, as produced by AVLTree::freeze().
+//
+// Keys are stored in one contiguous array in Eytzinger (BFS) order: the
+// root is at index 1 and the children of index k are at 2k and 2k+1. A
+// search touches the same slots as a descent of a perfectly balanced tree,
+// but needs no pointers, so the next comparison is simply 2k + (key < x)
+// and the compiler can turn it into a conditional move instead of a branch.
+// Because the 16 (for 4-byte keys) great-great-grandchildren of a slot are
+// adjacent, the whole level four steps ahead is prefetched with a single
+// cache line. Values live in a parallel array in the same order and are
+// only touched once the search is over.
+
+#ifndef FROZEN_CACHE_LINE
+#define FROZEN_CACHE_LINE 64
+#endif
+
+#ifndef BST_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr) ((void)0)
+#endif
+#endif
+
+template <typename Key, typename Value>
+class FrozenTree
+{
+public:
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        /**
+        * Lets it->first / it->second work even though the key and value
+        * live in different arrays.
+        */
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& item) : item_(item) { }
+            const reference* operator->() const { return &item_; }
+        private:
+            reference item_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+        const Key& key() const;
+        const Value& value() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class FrozenTree<Key, Value>;
+        iterator(std::size_t slot, const FrozenTree<Key, Value>* tree);
+        std::size_t slot_;  // 0 means end()
+        const FrozenTree<Key, Value> *tree_;
+    };
+
+    FrozenTree();
+    template<typename ForwardIt>
+    FrozenTree(ForwardIt first, ForwardIt last, std::size_t count);
+    FrozenTree(FrozenTree&& other);
+    FrozenTree& operator=(FrozenTree&& other);
+    ~FrozenTree();
+
+    bool empty() const;
+    std::size_t size() const;
+    std::size_t memory_bytes() const;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+
+private:
+    FrozenTree(const FrozenTree&) = delete;
+    FrozenTree& operator=(const FrozenTree&) = delete;
+
+    std::size_t lowerBoundSlot(const Key& key) const;
+    static std::size_t firstSlot(std::size_t count);
+    static std::size_t lastSlot(std::size_t count);
+    static std::size_t nextSlot(std::size_t slot, std::size_t count);
+    static std::size_t prevSlot(std::size_t slot, std::size_t count);
+    static void* allocateAligned(std::size_t bytes, void*& raw);
+    void destroy();
+
+    void* rawKeys_;
+    void* rawValues_;
+    Key* keys_;      // keys_[1..count_], keys_ itself is cache line aligned
+    Value* values_;  // values_[k] belongs to keys_[k]
+    std::size_t count_;
+};
+
+/*
+--------------------------------------------------------
+Begin implementations for the FrozenTree::iterator class.
+--------------------------------------------------------
+*/
+
+template<typename Key, typename Value>
+FrozenTree<Key, Value>::iterator::iterator() :
+    slot_(0),
+    tree_(NULL)
+{
+
+}
+
+template<typename Key, typename Value>
+FrozenTree<Key, Value>::iterator::iterator(std::size_t slot,
+                                           const FrozenTree<Key, Value>* tree) :
+    slot_(slot),
+    tree_(tree)
+{
+
+}
+
+/**
+* Provides access to the item, as a pair of references.
+*/
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator::reference
+FrozenTree<Key, Value>::iterator::operator*() const
+{
+    return reference(tree_->keys_[slot_], tree_->values_[slot_]);
+}
+
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator::pointer
+FrozenTree<Key, Value>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<typename Key, typename Value>
+const Key& FrozenTree<Key, Value>::iterator::key() const
+{
+    return tree_->keys_[slot_];
+}
+
+template<typename Key, typename Value>
+const Value& FrozenTree<Key, Value>::iterator::value() const
+{
+    return tree_->values_[slot_];
+}
+
+template<typename Key, typename Value>
+bool FrozenTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return slot_ == rhs.slot_;
+}
+
+template<typename Key, typename Value>
+bool FrozenTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return slot_ != rhs.slot_;
+}
+
+/**
+* Advances to the next key in sorted order.
+*/
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator&
+FrozenTree<Key, Value>::iterator::operator++()
+{
+    slot_ = FrozenTree<Key, Value>::nextSlot(slot_, tree_->count_);
+    return *this;
+}
+
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator
+FrozenTree<Key, Value>::iterator::operator++(int)
+{
+    iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves back to the previous key; from end() that is the largest key.
+*/
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator&
+FrozenTree<Key, Value>::iterator::operator--()
+{
+    if(slot_ == 0){
+        slot_ = FrozenTree<Key, Value>::lastSlot(tree_->count_);
+    }
+    else{
+        slot_ = FrozenTree<Key, Value>::prevSlot(slot_, tree_->count_);
+    }
+    return *this;
+}
+
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator
+FrozenTree<Key, Value>::iterator::operator--(int)
+{
+    iterator old = *this;
+    --(*this);
+    return old;
+}
+
+/*
+------------------------------------------------------
+End implementations for the FrozenTree::iterator class.
+------------------------------------------------------
+*/
+
+/**
+* Creates an empty snapshot.
+*/
+template<typename Key, typename Value>
+FrozenTree<Key, Value>::FrozenTree() :
+    rawKeys_(NULL),
+    rawValues_(NULL),
+    keys_(NULL),
+    values_(NULL),
+    count_(0)
+{
+
+}
+
+/**
+* Builds a snapshot of the count key/value pairs in [first, last), which
+* must already be sorted by key without duplicates (e.g. a tree's
+* begin()/end()), and count must be the length of the range.
+*/
+template<typename Key, typename Value>
+template<typename ForwardIt>
+FrozenTree<Key, Value>::FrozenTree(ForwardIt first, ForwardIt last, std::size_t count) :
+    rawKeys_(NULL),
+    rawValues_(NULL),
+    keys_(NULL),
+    values_(NULL),
+    count_(0)
+{
+    if(count == 0){
+        return;
+    }
+    //slot 0 is never used, so that the children of k are 2k and 2k+1
+    try{
+        keys_ = static_cast<Key*>(allocateAligned((count + 1) * sizeof(Key), rawKeys_));
+        values_ = static_cast<Value*>(allocateAligned((count + 1) * sizeof(Value), rawValues_));
+    }
+    catch(...){
+        ::operator delete(rawKeys_);
+        throw;
+    }
+    //an in-order walk of the implicit tree visits the slots in key order
+    std::size_t slot = firstSlot(count);
+    std::size_t built = 0;
+    try{
+        for(; first != last && built < count; ++first){
+            new (&keys_[slot]) Key(first->first);
+            try{
+                new (&values_[slot]) Value(first->second);
+            }
+            catch(...){
+                keys_[slot].~Key();
+                throw;
+            }
+            built++;
+            slot = nextSlot(slot, count);
+        }
+    }
+    catch(...){
+        //only the first built slots in key order hold objects
+        std::size_t undo = firstSlot(count);
+        for(std::size_t i = 0; i < built; i++){
+            keys_[undo].~Key();
+            values_[undo].~Value();
+            undo = nextSlot(undo, count);
+        }
+        ::operator delete(rawKeys_);
+        ::operator delete(rawValues_);
+        throw;
+    }
+    count_ = count;
+}
+
+template<typename Key, typename Value>
+FrozenTree<Key, Value>::FrozenTree(FrozenTree&& other) :
+    rawKeys_(other.rawKeys_),
+    rawValues_(other.rawValues_),
+    keys_(other.keys_),
+    values_(other.values_),
+    count_(other.count_)
+{
+    other.rawKeys_ = NULL;
+    other.rawValues_ = NULL;
+    other.keys_ = NULL;
+    other.values_ = NULL;
+    other.count_ = 0;
+}
+
+template<typename Key, typename Value>
+FrozenTree<Key, Value>& FrozenTree<Key, Value>::operator=(FrozenTree&& other)
+{
+    if(this != &other){
+        destroy();
+        std::swap(rawKeys_, other.rawKeys_);
+        std::swap(rawValues_, other.rawValues_);
+        std::swap(keys_, other.keys_);
+        std::swap(values_, other.values_);
+        std::swap(count_, other.count_);
+    }
+    return *this;
+}
+
+template<typename Key, typename Value>
+FrozenTree<Key, Value>::~FrozenTree()
+{
+    destroy();
+}
+
+template<typename Key, typename Value>
+bool FrozenTree<Key, Value>::empty() const
+{
+    return count_ == 0;
+}
+
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::size() const
+{
+    return count_;
+}
+
+/**
+* Bytes held by the two arrays, including the unused slot and alignment.
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::memory_bytes() const
+{
+    if(count_ == 0){
+        return sizeof(FrozenTree);
+    }
+    return sizeof(FrozenTree) + (count_ + 1) * (sizeof(Key) + sizeof(Value))
+           + 2 * FROZEN_CACHE_LINE;
+}
+
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator FrozenTree<Key, Value>::begin() const
+{
+    return iterator(firstSlot(count_), this);
+}
+
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator FrozenTree<Key, Value>::end() const
+{
+    return iterator(0, this);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator FrozenTree<Key, Value>::find(const Key& key) const
+{
+    std::size_t slot = lowerBoundSlot(key);
+    if(slot != 0 && key < keys_[slot]){
+        slot = 0;
+    }
+    return iterator(slot, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<typename Key, typename Value>
+typename FrozenTree<Key, Value>::iterator
+FrozenTree<Key, Value>::lower_bound(const Key& key) const
+{
+    return iterator(lowerBoundSlot(key), this);
+}
+
+/**
+* Branch-free descent. Going right is encoded as a 1 bit appended to k, so
+* once k falls off the bottom, the trailing 1 bits are the right turns
+* taken since the last left turn, and dropping them along with that left
+* turn gives the slot of the answer (0 if every turn was to the right).
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::lowerBoundSlot(const Key& key) const
+{
+    //slots 16k..16k+15 (for 4-byte keys) are the descendants four levels down
+    const std::size_t perLine = sizeof(Key) < FROZEN_CACHE_LINE ?
+                                FROZEN_CACHE_LINE / sizeof(Key) : 1;
+    std::size_t k = 1;
+    while(k <= count_){
+        if(k * perLine <= count_){
+            BST_PREFETCH(keys_ + k * perLine);
+        }
+        k = 2 * k + (keys_[k] < key);
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    k >>= __builtin_ctzll(~static_cast<unsigned long long>(k)) + 1;
+#else
+    while(k & 1){
+        k >>= 1;
+    }
+    k >>= 1;
+#endif
+    return k;
+}
+
+/**
+* The smallest key is the leftmost slot.
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::firstSlot(std::size_t count)
+{
+    if(count == 0){
+        return 0;
+    }
+    std::size_t k = 1;
+    while(2 * k <= count){
+        k = 2 * k;
+    }
+    return k;
+}
+
+/**
+* The largest key is the rightmost slot.
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::lastSlot(std::size_t count)
+{
+    if(count == 0){
+        return 0;
+    }
+    std::size_t k = 1;
+    while(2 * k + 1 <= count){
+        k = 2 * k + 1;
+    }
+    return k;
+}
+
+/**
+* In-order successor in the implicit tree, 0 after the largest key.
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::nextSlot(std::size_t k, std::size_t count)
+{
+    //leftmost slot of the right subtree, if there is one
+    if(2 * k + 1 <= count){
+        k = 2 * k + 1;
+        while(2 * k <= count){
+            k = 2 * k;
+        }
+        return k;
+    }
+    //otherwise walk up until we come up from a left child
+    while(k & 1){
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+/**
+* In-order predecessor in the implicit tree, 0 before the smallest key.
+*/
+template<typename Key, typename Value>
+std::size_t FrozenTree<Key, Value>::prevSlot(std::size_t k, std::size_t count)
+{
+    //rightmost slot of the left subtree, if there is one
+    if(2 * k <= count){
+        k = 2 * k;
+        while(2 * k + 1 <= count){
+            k = 2 * k + 1;
+        }
+        return k;
+    }
+    //otherwise walk up until we come up from a right child
+    while(k != 0 && (k & 1) == 0){
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+/**
+* Returns bytes bytes starting on a cache line boundary; raw receives the
+* pointer to hand back to operator delete.
+*/
+template<typename Key, typename Value>
+void* FrozenTree<Key, Value>::allocateAligned(std::size_t bytes, void*& raw)
+{
+    raw = ::operator new(bytes + FROZEN_CACHE_LINE);
+    std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(raw);
+    addr = (addr + FROZEN_CACHE_LINE - 1) / FROZEN_CACHE_LINE * FROZEN_CACHE_LINE;
+    return reinterpret_cast<void*>(addr);
+}
+
+template<typename Key, typename Value>
+void FrozenTree<Key, Value>::destroy()
+{
+    for(std::size_t k = 1; k <= count_; k++){
+        keys_[k].~Key();
+        values_[k].~Value();
+    }
+    ::operator delete(rawKeys_);
+    ::operator delete(rawValues_);
+    rawKeys_ = NULL;
+    rawValues_ = NULL;
+    keys_ = NULL;
+    values_ = NULL;
+    count_ = 0;
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Cheap per-operation latency measurement for the benchmark tools.
+//
+// CycleClock reads the CPU's timestamp counter where there is one (x86)
+// and the monotonic clock elsewhere. Its calibrate() works out how long a
+// tick is and how many ticks reading the clock twice costs, so that this
+// overhead can be taken off every sample.
+//
+// LatencyHistogram is log-bucketed in the style of HdrHistogram: values
+// below 2^LATENCY_SUB_BITS get a bucket each, and every power-of-two range
+// above that is split into 2^LATENCY_SUB_BITS equal buckets, so any value
+// is known to within about 3%. Recording is a few instructions and never
+// allocates; the whole histogram is a flat, trivially copyable array.
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_COUNT (1u << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+struct CycleClock
+{
+    double nsPerTick;
+    uint64_t overhead;   // ticks between two back-to-back now() calls
+
+    /**
+    * Current tick count. The fences keep the surrounding work from being
+    * reordered across the read.
+    */
+    static inline uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_lfence();
+        uint64_t ticks = __rdtsc();
+        _mm_lfence();
+        return ticks;
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    /**
+    * Elapsed ticks of a measured stretch, less the cost of measuring it.
+    */
+    uint64_t elapsed(uint64_t start, uint64_t end) const
+    {
+        uint64_t ticks = end - start;
+        return ticks > overhead ? ticks - overhead : 0;
+    }
+
+    double toNs(uint64_t ticks) const
+    {
+        return ticks * nsPerTick;
+    }
+
+    static CycleClock calibrate();
+};
+
+/**
+* Measures the tick length against the steady clock over about 20ms, and
+* the clock's own overhead as the cheapest of many back-to-back reads.
+*/
+inline CycleClock CycleClock::calibrate()
+{
+    CycleClock clock;
+    clock.overhead = ~static_cast<uint64_t>(0);
+    for(int i = 0; i < 1000; i++){
+        uint64_t start = now();
+        uint64_t end = now();
+        if(end - start < clock.overhead){
+            clock.overhead = end - start;
+        }
+    }
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+    uint64_t start = now();
+    std::chrono::steady_clock::time_point wallEnd;
+    do{
+        wallEnd = std::chrono::steady_clock::now();
+    } while(wallEnd - wallStart < std::chrono::milliseconds(20));
+    uint64_t end = now();
+    double ns = std::chrono::duration<double, std::nano>(wallEnd - wallStart).count();
+    clock.nsPerTick = (end > start) ? ns / (end - start) : 1.0;
+    return clock;
+}
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void merge(const LatencyHistogram& other);
+    void clear();
+
+    uint64_t count() const;
+    uint64_t max() const;
+    uint64_t percentile(double percent) const;
+
+private:
+    static std::size_t bucketOf(uint64_t value);
+    static uint64_t bucketTop(std::size_t bucket);
+
+    uint64_t counts_[LATENCY_BUCKETS];
+    uint64_t total_;
+    uint64_t max_;
+};
+
+inline LatencyHistogram::LatencyHistogram()
+{
+    clear();
+}
+
+inline void LatencyHistogram::record(uint64_t value)
+{
+    counts_[bucketOf(value)]++;
+    total_++;
+    if(value > max_){
+        max_ = value;
+    }
+}
+
+inline void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+    for(std::size_t i = 0; i < LATENCY_BUCKETS; i++){
+        counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    if(other.max_ > max_){
+        max_ = other.max_;
+    }
+}
+
+inline void LatencyHistogram::clear()
+{
+    std::memset(counts_, 0, sizeof(counts_));
+    total_ = 0;
+    max_ = 0;
+}
+
+inline uint64_t LatencyHistogram::count() const
+{
+    return total_;
+}
+
+inline uint64_t LatencyHistogram::max() const
+{
+    return max_;
+}
+
+/**
+* Smallest value that at least percent% of the samples are at or below,
+* rounded up to the top of its bucket (but never past the maximum seen).
+* Returns 0 for an empty histogram.
+*/
+inline uint64_t LatencyHistogram::percentile(double percent) const
+{
+    if(total_ == 0){
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total_ + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(std::size_t i = 0; i < LATENCY_BUCKETS; i++){
+        seen += counts_[i];
+        if(seen >= rank){
+            uint64_t top = bucketTop(i);
+            return top < max_ ? top : max_;
+        }
+    }
+    return max_;
+}
+
+inline std::size_t LatencyHistogram::bucketOf(uint64_t value)
+{
+    if(value < LATENCY_SUB_COUNT){
+        return static_cast<std::size_t>(value);
+    }
+    int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+    //value >> shift lies in [SUB_COUNT, 2 * SUB_COUNT)
+    return static_cast<std::size_t>((shift + 1) * LATENCY_SUB_COUNT +
+                                    ((value >> shift) - LATENCY_SUB_COUNT));
+}
+
+inline uint64_t LatencyHistogram::bucketTop(std::size_t bucket)
+{
+    if(bucket < LATENCY_SUB_COUNT){
+        return bucket;
+    }
+    std::size_t shift = bucket / LATENCY_SUB_COUNT - 1;
+    uint64_t mantissa = LATENCY_SUB_COUNT + bucket % LATENCY_SUB_COUNT;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+#endif
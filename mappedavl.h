@@ -0,0 +1,744 @@
+#ifndef MAPPEDAVL_H
+#define MAPPEDAVL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// AVL tree whose nodes live in a memory-mapped file (Linux).
+//
+// Opening an existing file maps it and the tree is ready at once: nothing
+// is read or rebuilt, and pages are only loaded from disk when a lookup
+// first touches them. Links between nodes are byte offsets into the file
+// (0 meaning none) rather than pointers, so the file can be mapped at any
+// address, and it can grow (ftruncate + mremap) even if that moves the
+// mapping. Offsets are only turned into pointers for as long as no node
+// is allocated.
+//
+// Changes go to the file through the shared mapping and are written back
+// by the kernel in its own time; sync() forces them to disk. An insert or
+// remove interrupted by a crash can leave the file inconsistent, so pair
+// this with a snapshot or a log if that matters. Only one process may
+// have the file open at a time (enforced with flock), and Key and Value
+// must be trivially copyable, since they are stored as raw bytes.
+//
+// File layout: a header (see MappedHeader) followed by fixed-size node
+// slots. Freed slots are chained through their left link and reused.
+
+#define MAPPED_AVL_VERSION 1u
+
+// Size of a newly created file; it doubles whenever it fills up.
+#ifndef MAPPED_AVL_INITIAL_BYTES
+#define MAPPED_AVL_INITIAL_BYTES (1u << 20)
+#endif
+
+template <typename Key, typename Value>
+class MappedAVLTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "MappedAVLTree stores keys and values as raw bytes");
+
+    struct MappedNode
+    {
+        Key key;
+        Value value;
+        uint64_t parent;
+        uint64_t left;
+        uint64_t right;
+        int32_t height;
+    };
+
+    struct MappedHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t keyBytes;
+        uint32_t valueBytes;
+        uint32_t nodeBytes;
+        uint32_t reserved;
+        uint64_t root;
+        uint64_t count;
+        uint64_t freeList;
+        uint64_t used;      // end of the slots handed out so far
+        uint64_t capacity;  // bytes mapped (the file may be longer)
+    };
+
+public:
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        /**
+        * Lets it->first / it->second work on the pair of references.
+        */
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& item) : item_(item) { }
+            const reference* operator->() const { return &item_; }
+        private:
+            reference item_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+        const Key& key() const;
+        const Value& value() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+
+    protected:
+        friend class MappedAVLTree<Key, Value>;
+        iterator(uint64_t offset, const MappedAVLTree<Key, Value>* tree);
+        uint64_t offset_;   // 0 means end()
+        const MappedAVLTree<Key, Value>* tree_;
+    };
+
+    explicit MappedAVLTree(const std::string& path);
+    ~MappedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+
+    bool empty() const;
+    std::size_t size() const;
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+
+    void sync();
+    void sync_async();
+
+private:
+    MappedAVLTree(const MappedAVLTree&) = delete;
+    MappedAVLTree& operator=(const MappedAVLTree&) = delete;
+
+    static std::size_t headerBytes();
+    MappedHeader* header() const;
+    MappedNode* at(uint64_t offset) const;
+    void openFile(const std::string& path);
+    void closeFile();
+
+    uint64_t allocate();
+    void deallocate(uint64_t offset);
+    void grow(uint64_t needed);
+
+    int height(uint64_t offset) const;
+    void updateHeight(uint64_t offset);
+    void replaceChild(uint64_t parent, uint64_t oldChild, uint64_t newChild);
+    uint64_t rotateLeft(uint64_t offset);
+    uint64_t rotateRight(uint64_t offset);
+    void rebalanceFrom(uint64_t offset);
+    uint64_t smallest(uint64_t offset) const;
+    uint64_t successor(uint64_t offset) const;
+
+    int fd_;
+    char* base_;
+    std::size_t mappedBytes_;
+};
+
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::iterator::iterator() :
+    offset_(0),
+    tree_(NULL)
+{
+
+}
+
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::iterator::iterator(uint64_t offset,
+                                              const MappedAVLTree<Key, Value>* tree) :
+    offset_(offset),
+    tree_(tree)
+{
+
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator::reference
+MappedAVLTree<Key, Value>::iterator::operator*() const
+{
+    return reference(key(), value());
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator::pointer
+MappedAVLTree<Key, Value>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value>
+const Key& MappedAVLTree<Key, Value>::iterator::key() const
+{
+    return tree_->at(offset_)->key;
+}
+
+template<class Key, class Value>
+const Value& MappedAVLTree<Key, Value>::iterator::value() const
+{
+    return tree_->at(offset_)->value;
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return offset_ == rhs.offset_;
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return offset_ != rhs.offset_;
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator&
+MappedAVLTree<Key, Value>::iterator::operator++()
+{
+    offset_ = tree_->successor(offset_);
+    return *this;
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator
+MappedAVLTree<Key, Value>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Opens the tree stored at path, or creates an empty one if the file does
+* not exist or is empty. Throws std::runtime_error if the file can't be
+* opened or mapped, is in use by another process, or holds something else
+* (including a tree of different Key/Value types).
+*/
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::MappedAVLTree(const std::string& path) :
+    fd_(-1),
+    base_(NULL),
+    mappedBytes_(0)
+{
+    openFile(path);
+}
+
+/**
+* Unmaps the file. Changes not yet synced are still written back by the
+* kernel, but only sync() guarantees they survive a system crash.
+*/
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::~MappedAVLTree()
+{
+    closeFile();
+}
+
+/**
+* Inserts the item, or overwrites the value if the key is already there.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    uint64_t parent = 0;
+    uint64_t current = header()->root;
+    bool left = false;
+    while(current != 0){
+        MappedNode* node = at(current);
+        if(keyValuePair.first < node->key){
+            parent = current;
+            current = node->left;
+            left = true;
+        }
+        else if(node->key < keyValuePair.first){
+            parent = current;
+            current = node->right;
+            left = false;
+        }
+        else{
+            node->value = keyValuePair.second;
+            return;
+        }
+    }
+    //allocating may move the mapping, so no node pointers are held across it
+    uint64_t offset = allocate();
+    MappedNode* node = at(offset);
+    new (&node->key) Key(keyValuePair.first);
+    new (&node->value) Value(keyValuePair.second);
+    node->parent = parent;
+    node->left = 0;
+    node->right = 0;
+    node->height = 1;
+    if(parent == 0){
+        header()->root = offset;
+    }
+    else if(left){
+        at(parent)->left = offset;
+    }
+    else{
+        at(parent)->right = offset;
+    }
+    header()->count++;
+    rebalanceFrom(parent);
+}
+
+/**
+* Removes the key if it is in the tree. A node with two children takes
+* over its successor's item, and the successor's slot is freed instead.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::remove(const Key& key)
+{
+    uint64_t offset = find(key).offset_;
+    if(offset == 0){
+        return;
+    }
+    MappedNode* node = at(offset);
+    if(node->left != 0 && node->right != 0){
+        uint64_t next = smallest(node->right);
+        node->key = at(next)->key;
+        node->value = at(next)->value;
+        offset = next;
+        node = at(offset);
+    }
+    uint64_t child = (node->left != 0) ? node->left : node->right;
+    uint64_t parent = node->parent;
+    if(child != 0){
+        at(child)->parent = parent;
+    }
+    replaceChild(parent, offset, child);
+    deallocate(offset);
+    header()->count--;
+    rebalanceFrom(parent);
+}
+
+/**
+* Removes every item. The file keeps its size, and its slots are reused.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::clear()
+{
+    MappedHeader* head = header();
+    head->root = 0;
+    head->count = 0;
+    head->freeList = 0;
+    head->used = headerBytes();
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::empty() const
+{
+    return header()->count == 0;
+}
+
+template<class Key, class Value>
+std::size_t MappedAVLTree<Key, Value>::size() const
+{
+    return static_cast<std::size_t>(header()->count);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::begin() const
+{
+    return iterator(smallest(header()->root), this);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::end() const
+{
+    return iterator(0, this);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::find(const Key& key) const
+{
+    uint64_t current = header()->root;
+    while(current != 0){
+        const MappedNode* node = at(current);
+        if(key < node->key){
+            current = node->left;
+        }
+        else if(node->key < key){
+            current = node->right;
+        }
+        else{
+            break;
+        }
+    }
+    return iterator(current, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key.
+*/
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator
+MappedAVLTree<Key, Value>::lower_bound(const Key& key) const
+{
+    uint64_t current = header()->root;
+    uint64_t best = 0;
+    while(current != 0){
+        const MappedNode* node = at(current);
+        if(node->key < key){
+            current = node->right;
+        }
+        else{
+            best = current;
+            current = node->left;
+        }
+    }
+    return iterator(best, this);
+}
+
+/**
+* Writes every change made so far to disk and waits for it (msync with
+* MS_SYNC).
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::sync()
+{
+    if(msync(base_, mappedBytes_, MS_SYNC) != 0){
+        throw std::runtime_error("Could not sync mapped tree");
+    }
+}
+
+/**
+* Starts writing the changes made so far to disk without waiting.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::sync_async()
+{
+    if(msync(base_, mappedBytes_, MS_ASYNC) != 0){
+        throw std::runtime_error("Could not sync mapped tree");
+    }
+}
+
+/**
+* Offset of the first slot: the header, padded to the node alignment.
+*/
+template<class Key, class Value>
+std::size_t MappedAVLTree<Key, Value>::headerBytes()
+{
+    std::size_t align = alignof(MappedNode);
+    return (sizeof(MappedHeader) + align - 1) / align * align;
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::MappedHeader* MappedAVLTree<Key, Value>::header() const
+{
+    return reinterpret_cast<MappedHeader*>(base_);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::MappedNode* MappedAVLTree<Key, Value>::at(uint64_t offset) const
+{
+    return reinterpret_cast<MappedNode*>(base_ + offset);
+}
+
+/**
+* Opens and maps the file, setting it up as an empty tree if it is new.
+*
+* The file may be larger than the header's capacity (a grow that got as
+* far as extending it), and only capacity bytes are mapped. A file whose
+* header is still all zeros was being created when the process died,
+* before anything could be stored, and is set up afresh.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::openFile(const std::string& path)
+{
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(fd_ < 0){
+        throw std::runtime_error("Could not open " + path);
+    }
+    struct stat info;
+    if(flock(fd_, LOCK_EX | LOCK_NB) != 0 || fstat(fd_, &info) != 0){
+        closeFile();
+        throw std::runtime_error(path + " is in use or can't be read");
+    }
+    MappedHeader stored;
+    std::memset(&stored, 0, sizeof(stored));
+    if(info.st_size > 0 &&
+       pread(fd_, &stored, sizeof(stored), 0) != static_cast<ssize_t>(sizeof(stored))){
+        closeFile();
+        throw std::runtime_error(path + " does not hold a tree of this type");
+    }
+    MappedHeader blank;
+    std::memset(&blank, 0, sizeof(blank));
+    bool created = std::memcmp(&stored, &blank, sizeof(stored)) == 0;
+
+    std::size_t bytes = static_cast<std::size_t>(stored.capacity);
+    if(created){
+        bytes = MAPPED_AVL_INITIAL_BYTES;
+        if(bytes < headerBytes() ||
+           (static_cast<uint64_t>(info.st_size) < bytes && ftruncate(fd_, bytes) != 0)){
+            closeFile();
+            throw std::runtime_error("Could not set up " + path);
+        }
+    }
+    else{
+        bool valid = std::memcmp(stored.magic, "BSTMAP", 7) == 0 &&
+                     stored.version == MAPPED_AVL_VERSION &&
+                     stored.byteOrder == 0x01020304u &&
+                     stored.keyBytes == sizeof(Key) &&
+                     stored.valueBytes == sizeof(Value) &&
+                     stored.nodeBytes == sizeof(MappedNode) &&
+                     stored.capacity >= headerBytes() &&
+                     stored.capacity <= static_cast<uint64_t>(info.st_size) &&
+                     stored.used >= headerBytes() && stored.used <= stored.capacity &&
+                     stored.root < stored.used && stored.freeList < stored.used;
+        if(!valid){
+            closeFile();
+            throw std::runtime_error(path + " does not hold a tree of this type");
+        }
+    }
+    void* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if(base == MAP_FAILED){
+        closeFile();
+        throw std::runtime_error("Could not map " + path);
+    }
+    base_ = static_cast<char*>(base);
+    mappedBytes_ = bytes;
+    if(!created){
+        return;
+    }
+
+    MappedHeader* head = header();
+    std::memset(head, 0, sizeof(MappedHeader));
+    std::memcpy(head->magic, "BSTMAP", 7);
+    head->version = MAPPED_AVL_VERSION;
+    head->byteOrder = 0x01020304u;
+    head->keyBytes = sizeof(Key);
+    head->valueBytes = sizeof(Value);
+    head->nodeBytes = sizeof(MappedNode);
+    head->used = headerBytes();
+    head->capacity = bytes;
+    //the file must not outlive us without its header
+    if(msync(base_, headerBytes(), MS_SYNC) != 0 || fsync(fd_) != 0){
+        closeFile();
+        throw std::runtime_error("Could not set up " + path);
+    }
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::closeFile()
+{
+    if(base_ != NULL){
+        munmap(base_, mappedBytes_);
+        base_ = NULL;
+    }
+    if(fd_ >= 0){
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+/**
+* Returns the offset of an unused slot, reusing freed ones first and
+* growing the file when it is full. May move the mapping.
+*/
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::allocate()
+{
+    MappedHeader* head = header();
+    if(head->freeList != 0){
+        uint64_t offset = head->freeList;
+        head->freeList = at(offset)->left;
+        return offset;
+    }
+    if(head->used + sizeof(MappedNode) > head->capacity){
+        grow(head->used + sizeof(MappedNode));
+        head = header();
+    }
+    uint64_t offset = head->used;
+    head->used += sizeof(MappedNode);
+    return offset;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::deallocate(uint64_t offset)
+{
+    at(offset)->left = header()->freeList;
+    header()->freeList = offset;
+}
+
+/**
+* Doubles the file (or more, to fit needed bytes) and remaps it. The new
+* size is on disk before the header's capacity says so; if we fail or
+* crash in between, the file is merely larger than it needs to be.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::grow(uint64_t needed)
+{
+    std::size_t bytes = mappedBytes_ * 2;
+    while(bytes < needed){
+        bytes *= 2;
+    }
+    if(ftruncate(fd_, bytes) != 0 || fdatasync(fd_) != 0){
+        throw std::runtime_error("Could not grow mapped tree");
+    }
+    void* base = mremap(base_, mappedBytes_, bytes, MREMAP_MAYMOVE);
+    if(base == MAP_FAILED){
+        throw std::runtime_error("Could not grow mapped tree");
+    }
+    base_ = static_cast<char*>(base);
+    mappedBytes_ = bytes;
+    header()->capacity = bytes;
+}
+
+template<class Key, class Value>
+int MappedAVLTree<Key, Value>::height(uint64_t offset) const
+{
+    return (offset == 0) ? 0 : at(offset)->height;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::updateHeight(uint64_t offset)
+{
+    MappedNode* node = at(offset);
+    node->height = std::max(height(node->left), height(node->right)) + 1;
+}
+
+/**
+* Points whatever linked to oldChild (its parent, or the root) at newChild.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::replaceChild(uint64_t parent, uint64_t oldChild,
+                                             uint64_t newChild)
+{
+    if(parent == 0){
+        header()->root = newChild;
+    }
+    else if(at(parent)->left == oldChild){
+        at(parent)->left = newChild;
+    }
+    else{
+        at(parent)->right = newChild;
+    }
+}
+
+/**
+* Rotates the subtree at offset to the left, returning its new root.
+*/
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::rotateLeft(uint64_t offset)
+{
+    MappedNode* node = at(offset);
+    uint64_t pivot = node->right;
+    MappedNode* raised = at(pivot);
+    node->right = raised->left;
+    if(raised->left != 0){
+        at(raised->left)->parent = offset;
+    }
+    raised->parent = node->parent;
+    replaceChild(node->parent, offset, pivot);
+    raised->left = offset;
+    node->parent = pivot;
+    updateHeight(offset);
+    updateHeight(pivot);
+    return pivot;
+}
+
+/**
+* Rotates the subtree at offset to the right, returning its new root.
+*/
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::rotateRight(uint64_t offset)
+{
+    MappedNode* node = at(offset);
+    uint64_t pivot = node->left;
+    MappedNode* raised = at(pivot);
+    node->left = raised->right;
+    if(raised->right != 0){
+        at(raised->right)->parent = offset;
+    }
+    raised->parent = node->parent;
+    replaceChild(node->parent, offset, pivot);
+    raised->right = offset;
+    node->parent = pivot;
+    updateHeight(offset);
+    updateHeight(pivot);
+    return pivot;
+}
+
+/**
+* Walks from offset up to the root, updating heights and rotating
+* wherever the two sides differ by two.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::rebalanceFrom(uint64_t offset)
+{
+    while(offset != 0){
+        updateHeight(offset);
+        MappedNode* node = at(offset);
+        int balance = height(node->right) - height(node->left);
+        if(balance > 1){
+            const MappedNode* right = at(node->right);
+            if(height(right->left) > height(right->right)){
+                rotateRight(node->right);
+            }
+            offset = rotateLeft(offset);
+        }
+        else if(balance < -1){
+            const MappedNode* left = at(node->left);
+            if(height(left->right) > height(left->left)){
+                rotateLeft(node->left);
+            }
+            offset = rotateRight(offset);
+        }
+        offset = at(offset)->parent;
+    }
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::smallest(uint64_t offset) const
+{
+    if(offset == 0){
+        return 0;
+    }
+    while(at(offset)->left != 0){
+        offset = at(offset)->left;
+    }
+    return offset;
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::successor(uint64_t offset) const
+{
+    if(at(offset)->right != 0){
+        return smallest(at(offset)->right);
+    }
+    uint64_t parent = at(offset)->parent;
+    while(parent != 0 && at(parent)->right == offset){
+        offset = parent;
+        parent = at(offset)->parent;
+    }
+    return parent;
+}
+
+#endif
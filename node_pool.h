@@ -0,0 +1,337 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#ifdef BST_POOL_HUGEPAGES
+#include <sys/mman.h>
+#endif
+
+// Slab allocator used by the search trees for their nodes.
+//
+// Every slot handed out has the same size, so a freed node can simply be
+// pushed on an intrusive free list and reused by the next insert. Slots are
+// carved out of large contiguous slabs, which keeps neighbouring nodes close
+// together in memory and lets release() give back everything at once.
+//
+// Build with -DBST_POOL_HUGEPAGES to back the slabs with 2MB huge pages
+// (MAP_HUGETLB, falling back to transparent huge pages if none are reserved).
+//
+// Trees that hand nodes to each other (AVLTree::split/join and the set
+// operations) still have a pool each, with its own free list, so they can
+// be changed on different threads afterwards. What they share is slabs: a
+// pool keeps every slab its nodes may live in alive through a
+// std::shared_ptr to the set of slabs another pool reserved (see share()
+// and absorb()), and a set of slabs is freed once no pool refers to it.
+
+#ifdef BST_POOL_HUGEPAGES
+#define NODE_POOL_SLAB_BYTES (2u * 1024u * 1024u)
+#else
+#define NODE_POOL_SLAB_BYTES (64u * 1024u)
+#endif
+
+class NodePool
+{
+public:
+    NodePool(std::size_t slotBytes, std::size_t slotAlign);
+
+    void* allocate();
+    void deallocate(void* slot);
+    void release();
+
+    void share(NodePool& other);
+    void absorb(NodePool& other);
+
+    std::size_t slotBytes() const;
+    std::size_t slabCount() const;
+    std::size_t reservedBytes() const;
+    std::size_t bookkeepingBytes() const;
+
+private:
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    /**
+    * The slabs one pool reserved, freed with the last pool holding them.
+    * Only that pool adds to the list, and only until it is first shared,
+    * so pools on other threads can read it safely.
+    */
+    struct Slabs
+    {
+        explicit Slabs(std::size_t bytes) : slabBytes(bytes) { }
+        ~Slabs();
+
+        std::vector<void*> list;
+        std::size_t slabBytes;
+    };
+
+    void* newSlab();
+    static void freeSlab(void* slab, std::size_t bytes);
+    void borrow(const std::shared_ptr<Slabs>& slabs);
+
+    std::shared_ptr<Slabs> own_;                    // where new slabs go
+    std::vector<std::shared_ptr<Slabs> > borrowed_; // other pools' slabs our nodes may be in
+    FreeSlot* freeList_;
+    FreeSlot* freeTail_;   // last free slot, so free lists splice in O(1)
+    char* bump_;
+    char* bumpEnd_;
+    std::size_t slotBytes_;
+    std::size_t slotAlign_;
+    std::size_t slabBytes_;
+};
+
+/**
+* Creates an empty pool handing out slots of (at least) slotBytes bytes,
+* each aligned to slotAlign. No memory is reserved until the first allocation.
+*/
+inline NodePool::NodePool(std::size_t slotBytes, std::size_t slotAlign) :
+    freeList_(NULL),
+    freeTail_(NULL),
+    bump_(NULL),
+    bumpEnd_(NULL),
+    slotBytes_(slotBytes),
+    slotAlign_(slotAlign),
+    slabBytes_(NODE_POOL_SLAB_BYTES)
+{
+    //every slot must be able to hold a free list link, and must keep the
+    //next slot suitably aligned for the node type
+    std::size_t align = slotAlign;
+    if(align < alignof(FreeSlot)){
+        align = alignof(FreeSlot);
+    }
+    slotAlign_ = align;
+    if(slotBytes_ < sizeof(FreeSlot)){
+        slotBytes_ = sizeof(FreeSlot);
+    }
+    slotBytes_ = (slotBytes_ + align - 1) / align * align;
+    //a slab always holds at least one aligned slot, however large the
+    //nodes are
+    if(slabBytes_ < slotBytes_ + align - 1){
+        slabBytes_ = slotBytes_ + align - 1;
+    }
+}
+
+inline NodePool::Slabs::~Slabs()
+{
+    for(std::size_t i = 0; i < list.size(); i++){
+        freeSlab(list[i], slabBytes);
+    }
+}
+
+/**
+* Returns uninitialized storage for one node. Recycled slots are preferred
+* over fresh ones, and a new slab is only reserved when both run out.
+*/
+inline void* NodePool::allocate()
+{
+    if(freeList_ != NULL){
+        FreeSlot* slot = freeList_;
+        freeList_ = slot->next;
+        return slot;
+    }
+    if(bump_ == bumpEnd_){
+        char* slab = static_cast<char*>(newSlab());
+        //the first slot may need to start past the slab's beginning when
+        //nodes ask for more alignment than the system gives (e.g. a cache line)
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(slab);
+        bump_ = slab + (slotAlign_ - addr % slotAlign_) % slotAlign_;
+        bumpEnd_ = bump_ + ((slab + slabBytes_ - bump_) / slotBytes_) * slotBytes_;
+    }
+    void* slot = bump_;
+    bump_ += slotBytes_;
+    return slot;
+}
+
+/**
+* Gives a slot back to the pool. The node living there must already have
+* been destroyed. The slot may be in a slab this pool borrowed.
+*/
+inline void NodePool::deallocate(void* slot)
+{
+    if(slot == NULL){
+        return;
+    }
+    FreeSlot* freed = static_cast<FreeSlot*>(slot);
+    if(freeList_ == NULL){
+        freeTail_ = freed;
+    }
+    freed->next = freeList_;
+    freeList_ = freed;
+}
+
+/**
+* Lets go of every slab in O(#slabs) and leaves the pool as good as new.
+* Slabs no other pool holds are freed; the rest live on until those
+* pools let go of them too. Any node still living in the pool is dropped
+* without running its destructor, so callers must destroy nodes that own
+* resources first.
+*/
+inline void NodePool::release()
+{
+    own_.reset();
+    borrowed_.clear();
+    freeList_ = NULL;
+    freeTail_ = NULL;
+    bump_ = NULL;
+    bumpEnd_ = NULL;
+}
+
+/**
+* Makes other keep alive every slab this pool uses, so that nodes from
+* this pool can be handed to other's tree. Both pools go on allocating
+* from their own free lists; neither touches the other, and this pool
+* puts any further slabs in a new set.
+*/
+inline void NodePool::share(NodePool& other)
+{
+    if(own_ && !own_->list.empty()){
+        borrowed_.push_back(own_);
+        own_.reset();
+    }
+    for(std::size_t i = 0; i < borrowed_.size(); i++){
+        other.borrow(borrowed_[i]);
+    }
+}
+
+/**
+* Takes over everything other has: the slabs it uses, its free slots and
+* its unused bump space. other must hand out slots of the same size, and
+* is left empty, as if new.
+*/
+inline void NodePool::absorb(NodePool& other)
+{
+    if(&other == this){
+        return;
+    }
+    other.share(*this);
+    //splice the free lists
+    if(other.freeList_ != NULL){
+        other.freeTail_->next = freeList_;
+        if(freeList_ == NULL){
+            freeTail_ = other.freeTail_;
+        }
+        freeList_ = other.freeList_;
+    }
+    //keep the larger untouched region for bump allocation, and put the
+    //(at most one slab's worth of) slots of the other on the free list
+    if(other.bumpEnd_ - other.bump_ > bumpEnd_ - bump_){
+        std::swap(bump_, other.bump_);
+        std::swap(bumpEnd_, other.bumpEnd_);
+    }
+    for(char* slot = other.bump_; slot != other.bumpEnd_; slot += slotBytes_){
+        deallocate(slot);
+    }
+    other.release();
+}
+
+/**
+* Size in bytes of a single slot, including alignment padding.
+*/
+inline std::size_t NodePool::slotBytes() const
+{
+    return slotBytes_;
+}
+
+/**
+* Number of slabs the pool keeps alive, its own and borrowed ones.
+*/
+inline std::size_t NodePool::slabCount() const
+{
+    std::size_t count = own_ ? own_->list.size() : 0;
+    for(std::size_t i = 0; i < borrowed_.size(); i++){
+        count += borrowed_[i]->list.size();
+    }
+    return count;
+}
+
+/**
+* Total bytes reserved from the system, whether in use or not. Slabs
+* borrowed from other pools are counted in full for each of them.
+*/
+inline std::size_t NodePool::reservedBytes() const
+{
+    return slabCount() * slabBytes_;
+}
+
+/**
+* Bytes the pool itself uses to keep track of its slabs.
+*/
+inline std::size_t NodePool::bookkeepingBytes() const
+{
+    std::size_t bytes = sizeof(NodePool) + borrowed_.capacity() * sizeof(borrowed_[0]);
+    if(own_){
+        bytes += sizeof(Slabs) + own_->list.capacity() * sizeof(void*);
+    }
+    return bytes;
+}
+
+/**
+* Starts keeping slabs alive, unless they are empty or already kept.
+*/
+inline void NodePool::borrow(const std::shared_ptr<Slabs>& slabs)
+{
+    if(!slabs || slabs->list.empty() || slabs == own_){
+        return;
+    }
+    for(std::size_t i = 0; i < borrowed_.size(); i++){
+        if(borrowed_[i] == slabs){
+            return;
+        }
+    }
+    borrowed_.push_back(slabs);
+}
+
+inline void* NodePool::newSlab()
+{
+    if(!own_){
+        own_ = std::make_shared<Slabs>(slabBytes_);
+    }
+    void* slab = NULL;
+#ifdef BST_POOL_HUGEPAGES
+    slab = mmap(NULL, slabBytes_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(slab == MAP_FAILED){
+        slab = mmap(NULL, slabBytes_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED){
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(slab, slabBytes_, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    slab = ::operator new(slabBytes_);
+#endif
+    //if bookkeeping fails, don't leak the slab we just got
+    try{
+        own_->list.push_back(slab);
+    }
+    catch(...){
+        freeSlab(slab, slabBytes_);
+        throw;
+    }
+    return slab;
+}
+
+inline void NodePool::freeSlab(void* slab, std::size_t bytes)
+{
+#ifdef BST_POOL_HUGEPAGES
+    munmap(slab, bytes);
+#else
+    (void)bytes;
+    ::operator delete(slab);
+#endif
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters for the benchmark tools, through Linux
+// perf_event_open.
+//
+// PerfCounters opens one counter per PerfEvent for the calling thread,
+// user space only, each on its own so that an event the CPU or kernel
+// doesn't offer (common in VMs and containers, or with a strict
+// perf_event_paranoid) just reads as unavailable while the others keep
+// working. Counters only run between start() and stop(), which adds what
+// they counted to a PerfCounts; wrap each phase that should be measured
+// in such a pair. When the kernel has to multiplex more events than the
+// PMU has registers, the counts are scaled up by enabled/running time.
+//
+// Off Linux, or without any permitted event, everything is unavailable
+// and start()/stop() cost nothing.
+
+enum PerfEvent
+{
+    perfInstructions,
+    perfCycles,
+    perfL1dMisses,
+    perfLlcMisses,
+    perfBranchMisses,
+    perfDtlbMisses,
+    perfEventCount
+};
+
+/**
+* Accumulated counts of one measured scope. An event is valid only if it
+* was counted (not just enabled) for some of the scope.
+*/
+struct PerfCounts
+{
+    double values[perfEventCount];
+    bool valid[perfEventCount];
+};
+
+class PerfCounters
+{
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    bool available(PerfEvent event) const;
+    bool anyAvailable() const;
+    static const char* name(PerfEvent event);
+
+    void start();
+    void stop(PerfCounts& counts);
+
+private:
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    struct Reading
+    {
+        uint64_t value;
+        uint64_t enabled;
+        uint64_t running;
+    };
+
+    bool read(int event, Reading& reading) const;
+
+    int fds_[perfEventCount];
+    Reading started_[perfEventCount];
+};
+
+/**
+* Opens (but doesn't start) every counter the system allows.
+*/
+inline PerfCounters::PerfCounters()
+{
+    std::memset(started_, 0, sizeof(started_));
+    for(int i = 0; i < perfEventCount; i++){
+        fds_[i] = -1;
+    }
+#ifdef __linux__
+    const uint32_t types[perfEventCount] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+    const uint64_t configs[perfEventCount] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    for(int i = 0; i < perfEventCount; i++){
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        fds_[i] = static_cast<int>(fd);
+    }
+#endif
+}
+
+inline PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for(int i = 0; i < perfEventCount; i++){
+        if(fds_[i] >= 0){
+            close(fds_[i]);
+        }
+    }
+#endif
+}
+
+inline bool PerfCounters::available(PerfEvent event) const
+{
+    return fds_[event] >= 0;
+}
+
+inline bool PerfCounters::anyAvailable() const
+{
+    for(int i = 0; i < perfEventCount; i++){
+        if(fds_[i] >= 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* Short name of an event, as used in column headers.
+*/
+inline const char* PerfCounters::name(PerfEvent event)
+{
+    static const char* const names[perfEventCount] = {
+        "instructions", "cycles", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"
+    };
+    return names[event];
+}
+
+/**
+* Starts counting. Every start() must be followed by a stop().
+*/
+inline void PerfCounters::start()
+{
+#ifdef __linux__
+    for(int i = 0; i < perfEventCount; i++){
+        if(fds_[i] >= 0 && read(i, started_[i])){
+            ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/**
+* Stops counting and adds the counts since start() to counts.
+*/
+inline void PerfCounters::stop(PerfCounts& counts)
+{
+#ifdef __linux__
+    for(int i = 0; i < perfEventCount; i++){
+        if(fds_[i] < 0){
+            continue;
+        }
+        ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+        Reading now;
+        if(!read(i, now)){
+            continue;
+        }
+        uint64_t running = now.running - started_[i].running;
+        if(running == 0){
+            continue;
+        }
+        double value = static_cast<double>(now.value - started_[i].value);
+        counts.values[i] += value * (now.enabled - started_[i].enabled) / running;
+        counts.valid[i] = true;
+    }
+#else
+    (void)counts;
+#endif
+}
+
+inline bool PerfCounters::read(int event, Reading& reading) const
+{
+#ifdef __linux__
+    return ::read(fds_[event], &reading, sizeof(reading)) == static_cast<ssize_t>(sizeof(reading));
+#else
+    (void)event;
+    (void)reading;
+    return false;
+#endif
+}
+
+#endif
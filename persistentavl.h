@@ -0,0 +1,577 @@
+#ifndef PERSISTENTAVL_H
+#define PERSISTENTAVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Persistent (path-copying) AVL tree.
+//
+// Nodes are never changed once built. An insert or remove creates new
+// copies of the O(log n) nodes on the path from the root to the change,
+// rebalancing as it goes, and shares every other subtree with the old
+// version through reference counts. A version is therefore nothing more
+// than a pointer to its root, so snapshot() is O(1). A Snapshot can be
+// searched and iterated for as long as it is kept, without any locking,
+// while writers carry on; its nodes are freed once the last snapshot or
+// iterator using them goes away.
+//
+// Writers are serialized by a mutex, and publish each new root
+// atomically, so any number of threads may take snapshots at any time.
+
+template <typename Key, typename Value>
+class PersistentAVLTree
+{
+private:
+    struct PNode;
+    typedef std::shared_ptr<const PNode> NodePtr;
+
+    /**
+    * Immutable node. Heights drive rebalancing, and subtree sizes give
+    * every version its size in O(1).
+    */
+    struct PNode
+    {
+        template<typename Item>
+        PNode(Item&& item, const NodePtr& left, const NodePtr& right);
+
+        std::pair<const Key, Value> item;
+        NodePtr left;
+        NodePtr right;
+        std::size_t size;
+        uint8_t height;
+    };
+
+public:
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+
+    protected:
+        friend class PersistentAVLTree<Key, Value>;
+        explicit iterator(const NodePtr& root);
+        void pushLeftSpine(const PNode* node);
+        NodePtr root_;  // keeps the version alive while we walk it
+        std::vector<const PNode*> path_;  // ancestors still to visit; top is current
+    };
+
+    /**
+    * One version of the tree. Cheap to copy and safe to use from any
+    * thread, since nothing it refers to ever changes.
+    */
+    class Snapshot
+    {
+    public:
+        Snapshot();
+
+        bool empty() const;
+        std::size_t size() const;
+        iterator begin() const;
+        iterator end() const;
+        iterator find(const Key& key) const;
+        iterator lower_bound(const Key& key) const;
+        bool contains(const Key& key) const;
+        Value const & operator[](const Key& key) const;
+
+    protected:
+        friend class PersistentAVLTree<Key, Value>;
+        explicit Snapshot(const NodePtr& root);
+        NodePtr root_;
+    };
+
+    PersistentAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+
+    Snapshot snapshot() const;
+    std::size_t size() const;
+    bool empty() const;
+
+private:
+    PersistentAVLTree(const PersistentAVLTree&) = delete;
+    PersistentAVLTree& operator=(const PersistentAVLTree&) = delete;
+
+    static int height(const NodePtr& node);
+    static std::size_t subtreeSize(const NodePtr& node);
+    template<typename Item>
+    static NodePtr makeNode(Item&& item, const NodePtr& left, const NodePtr& right);
+    template<typename Item>
+    static NodePtr balance(Item&& item, const NodePtr& left, const NodePtr& right);
+    template<typename Pair>
+    static NodePtr insertHelper(const NodePtr& node, Pair&& keyValuePair);
+    static NodePtr removeHelper(const NodePtr& node, const Key& key, bool& removed);
+    static NodePtr removeSmallest(const NodePtr& node);
+    void publish(const NodePtr& root);
+
+    NodePtr root_;  // only accessed through std::atomic_load/atomic_store
+    std::mutex writeLock_;
+};
+
+template<typename Key, typename Value>
+template<typename Item>
+PersistentAVLTree<Key, Value>::PNode::PNode(Item&& item, const NodePtr& left,
+                                            const NodePtr& right) :
+    item(std::forward<Item>(item)),
+    left(left),
+    right(right),
+    size(1 + subtreeSize(left) + subtreeSize(right))
+{
+    int lh = PersistentAVLTree<Key, Value>::height(left);
+    int rh = PersistentAVLTree<Key, Value>::height(right);
+    height = static_cast<uint8_t>(1 + (lh > rh ? lh : rh));
+}
+
+/*
+---------------------------------------------------------------
+Begin implementations for the PersistentAVLTree::iterator class.
+---------------------------------------------------------------
+*/
+
+template<typename Key, typename Value>
+PersistentAVLTree<Key, Value>::iterator::iterator()
+{
+
+}
+
+/**
+* Starts at the smallest key of the version rooted at root.
+*/
+template<typename Key, typename Value>
+PersistentAVLTree<Key, Value>::iterator::iterator(const NodePtr& root) :
+    root_(root)
+{
+    pushLeftSpine(root_.get());
+}
+
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::iterator::pushLeftSpine(const PNode* node)
+{
+    while(node != NULL){
+        path_.push_back(node);
+        node = node->left.get();
+    }
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator::reference
+PersistentAVLTree<Key, Value>::iterator::operator*() const
+{
+    return path_.back()->item;
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator::pointer
+PersistentAVLTree<Key, Value>::iterator::operator->() const
+{
+    return &(path_.back()->item);
+}
+
+/**
+* Iterators are equal if they stand on the same node (or are both at
+* the end).
+*/
+template<typename Key, typename Value>
+bool PersistentAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    if(path_.empty() || rhs.path_.empty()){
+        return path_.empty() && rhs.path_.empty();
+    }
+    return path_.back() == rhs.path_.back();
+}
+
+template<typename Key, typename Value>
+bool PersistentAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* The next key is the smallest one in the right subtree, or else the
+* nearest ancestor we went left from, which is already on the stack.
+*/
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator&
+PersistentAVLTree<Key, Value>::iterator::operator++()
+{
+    const PNode* current = path_.back();
+    path_.pop_back();
+    pushLeftSpine(current->right.get());
+    if(path_.empty()){
+        root_.reset();
+    }
+    return *this;
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator
+PersistentAVLTree<Key, Value>::iterator::operator++(int)
+{
+    iterator old = *this;
+    ++(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the PersistentAVLTree::iterator class.
+-------------------------------------------------------------
+*/
+
+/*
+---------------------------------------------------------------
+Begin implementations for the PersistentAVLTree::Snapshot class.
+---------------------------------------------------------------
+*/
+
+/**
+* An empty version.
+*/
+template<typename Key, typename Value>
+PersistentAVLTree<Key, Value>::Snapshot::Snapshot()
+{
+
+}
+
+template<typename Key, typename Value>
+PersistentAVLTree<Key, Value>::Snapshot::Snapshot(const NodePtr& root) :
+    root_(root)
+{
+
+}
+
+template<typename Key, typename Value>
+bool PersistentAVLTree<Key, Value>::Snapshot::empty() const
+{
+    return root_ == NULL;
+}
+
+template<typename Key, typename Value>
+std::size_t PersistentAVLTree<Key, Value>::Snapshot::size() const
+{
+    return subtreeSize(root_);
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator
+PersistentAVLTree<Key, Value>::Snapshot::begin() const
+{
+    return iterator(root_);
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator
+PersistentAVLTree<Key, Value>::Snapshot::end() const
+{
+    return iterator();
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator
+PersistentAVLTree<Key, Value>::Snapshot::find(const Key& key) const
+{
+    iterator it = lower_bound(key);
+    if(it != end() && key < it->first){
+        return end();
+    }
+    return it;
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end(). The nodes we go left from are exactly the ones the iterator
+* will visit next, so they become its stack.
+*/
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::iterator
+PersistentAVLTree<Key, Value>::Snapshot::lower_bound(const Key& key) const
+{
+    iterator it;
+    const PNode* temp = root_.get();
+    while(temp != NULL){
+        if(temp->item.first < key){
+            temp = temp->right.get();
+        }
+        else{
+            it.path_.push_back(temp);
+            temp = temp->left.get();
+        }
+    }
+    if(!it.path_.empty()){
+        it.root_ = root_;
+    }
+    return it;
+}
+
+template<typename Key, typename Value>
+bool PersistentAVLTree<Key, Value>::Snapshot::contains(const Key& key) const
+{
+    const PNode* temp = root_.get();
+    while(temp != NULL){
+        if(key < temp->item.first){
+            temp = temp->left.get();
+        }
+        else if(temp->item.first < key){
+            temp = temp->right.get();
+        }
+        else{
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<typename Key, typename Value>
+Value const & PersistentAVLTree<Key, Value>::Snapshot::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+/*
+-------------------------------------------------------------
+End implementations for the PersistentAVLTree::Snapshot class.
+-------------------------------------------------------------
+*/
+
+template<typename Key, typename Value>
+PersistentAVLTree<Key, Value>::PersistentAVLTree()
+{
+
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already present.
+* Snapshots taken before keep seeing the old contents.
+*/
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    std::lock_guard<std::mutex> guard(writeLock_);
+    publish(insertHelper(std::atomic_load(&root_), keyValuePair));
+}
+
+/**
+* Same as above, but the pair is moved into the new node.
+*/
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    std::lock_guard<std::mutex> guard(writeLock_);
+    publish(insertHelper(std::atomic_load(&root_), std::move(keyValuePair)));
+}
+
+/**
+* Removes the key, if present, without disturbing existing snapshots.
+*/
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::remove(const Key& key)
+{
+    std::lock_guard<std::mutex> guard(writeLock_);
+    bool removed = false;
+    NodePtr root = removeHelper(std::atomic_load(&root_), key, removed);
+    if(removed){
+        publish(root);
+    }
+}
+
+/**
+* Starts a new, empty version. The nodes live on for as long as older
+* snapshots need them.
+*/
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::clear()
+{
+    std::lock_guard<std::mutex> guard(writeLock_);
+    publish(NodePtr());
+}
+
+/**
+* Returns the current version in O(1).
+*/
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::Snapshot
+PersistentAVLTree<Key, Value>::snapshot() const
+{
+    return Snapshot(std::atomic_load(&root_));
+}
+
+template<typename Key, typename Value>
+std::size_t PersistentAVLTree<Key, Value>::size() const
+{
+    return subtreeSize(std::atomic_load(&root_));
+}
+
+template<typename Key, typename Value>
+bool PersistentAVLTree<Key, Value>::empty() const
+{
+    return std::atomic_load(&root_) == NULL;
+}
+
+template<typename Key, typename Value>
+int PersistentAVLTree<Key, Value>::height(const NodePtr& node)
+{
+    return node == NULL ? 0 : node->height;
+}
+
+template<typename Key, typename Value>
+std::size_t PersistentAVLTree<Key, Value>::subtreeSize(const NodePtr& node)
+{
+    return node == NULL ? 0 : node->size;
+}
+
+template<typename Key, typename Value>
+template<typename Item>
+typename PersistentAVLTree<Key, Value>::NodePtr
+PersistentAVLTree<Key, Value>::makeNode(Item&& item, const NodePtr& left, const NodePtr& right)
+{
+    return std::make_shared<const PNode>(std::forward<Item>(item), left, right);
+}
+
+/**
+* Builds a node for item over left and right, whose heights differ by at
+* most 2, rotating if they differ by 2. Only new nodes are created; the
+* subtrees being rotated are reused as they are.
+*/
+template<typename Key, typename Value>
+template<typename Item>
+typename PersistentAVLTree<Key, Value>::NodePtr
+PersistentAVLTree<Key, Value>::balance(Item&& item, const NodePtr& left, const NodePtr& right)
+{
+    int lh = height(left);
+    int rh = height(right);
+    if(lh > rh + 1){
+        //single right rotation, or a double one if left leans right
+        if(height(left->left) >= height(left->right)){
+            return makeNode(left->item, left->left,
+                            makeNode(std::forward<Item>(item), left->right, right));
+        }
+        const NodePtr& pivot = left->right;
+        return makeNode(pivot->item,
+                        makeNode(left->item, left->left, pivot->left),
+                        makeNode(std::forward<Item>(item), pivot->right, right));
+    }
+    if(rh > lh + 1){
+        if(height(right->right) >= height(right->left)){
+            return makeNode(right->item,
+                            makeNode(std::forward<Item>(item), left, right->left),
+                            right->right);
+        }
+        const NodePtr& pivot = right->left;
+        return makeNode(pivot->item,
+                        makeNode(std::forward<Item>(item), left, pivot->left),
+                        makeNode(right->item, pivot->right, right->right));
+    }
+    return makeNode(std::forward<Item>(item), left, right);
+}
+
+/**
+* Returns the root of a new version of the subtree at node that also
+* holds keyValuePair.
+*/
+template<typename Key, typename Value>
+template<typename Pair>
+typename PersistentAVLTree<Key, Value>::NodePtr
+PersistentAVLTree<Key, Value>::insertHelper(const NodePtr& node, Pair&& keyValuePair)
+{
+    if(node == NULL){
+        return makeNode(std::forward<Pair>(keyValuePair), NodePtr(), NodePtr());
+    }
+    if(keyValuePair.first < node->item.first){
+        return balance(node->item,
+                       insertHelper(node->left, std::forward<Pair>(keyValuePair)),
+                       node->right);
+    }
+    if(node->item.first < keyValuePair.first){
+        return balance(node->item, node->left,
+                       insertHelper(node->right, std::forward<Pair>(keyValuePair)));
+    }
+    //same key: only the value changes
+    return makeNode(std::forward<Pair>(keyValuePair), node->left, node->right);
+}
+
+/**
+* Returns the root of a new version of the subtree at node without key.
+* If key isn't there, node itself comes back and nothing is copied.
+*/
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::NodePtr
+PersistentAVLTree<Key, Value>::removeHelper(const NodePtr& node, const Key& key, bool& removed)
+{
+    if(node == NULL){
+        return node;
+    }
+    if(key < node->item.first){
+        NodePtr left = removeHelper(node->left, key, removed);
+        return removed ? balance(node->item, left, node->right) : node;
+    }
+    if(node->item.first < key){
+        NodePtr right = removeHelper(node->right, key, removed);
+        return removed ? balance(node->item, node->left, right) : node;
+    }
+    removed = true;
+    if(node->left == NULL){
+        return node->right;
+    }
+    if(node->right == NULL){
+        return node->left;
+    }
+    //two children: the successor takes this node's place
+    const PNode* successor = node->right.get();
+    while(successor->left != NULL){
+        successor = successor->left.get();
+    }
+    return balance(successor->item, node->left, removeSmallest(node->right));
+}
+
+template<typename Key, typename Value>
+typename PersistentAVLTree<Key, Value>::NodePtr
+PersistentAVLTree<Key, Value>::removeSmallest(const NodePtr& node)
+{
+    if(node->left == NULL){
+        return node->right;
+    }
+    return balance(node->item, removeSmallest(node->left), node->right);
+}
+
+/**
+* Makes root the current version for everyone calling snapshot().
+*/
+template<typename Key, typename Value>
+void PersistentAVLTree<Key, Value>::publish(const NodePtr& root)
+{
+    std::atomic_store(&root_, root);
+}
+
+#endif
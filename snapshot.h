@@ -0,0 +1,470 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Binary snapshot files, written by BinarySearchTree::save() and read back
+// by load().
+//
+// A snapshot is a fixed header, the items in increasing key order as raw
+// key and value bytes (packed, no per-record framing), and a checksum of
+// those bytes:
+//
+//   char     magic[8]     "BSTSNAP\0"
+//   uint32   version      SNAPSHOT_VERSION
+//   uint32   byteOrder    0x01020304 as written by the saving machine
+//   uint32   keyBytes     sizeof(Key)
+//   uint32   valueBytes   sizeof(Value)
+//   uint64   count        number of items
+//   ...      count * (keyBytes + valueBytes) bytes of items
+//   uint64   checksum     of the item bytes, see snapshotChecksum()
+//
+// Everything is in the saving machine's byte order, so only trivially
+// copyable keys and values can be stored, and a file only loads on a
+// machine (and build) with the same byte order and type sizes. The header
+// is checked against the file size before anything is built, and the
+// checksum and key order once the items are read.
+
+#define SNAPSHOT_VERSION 1u
+
+// Bytes moved to or from the file at a time. A multiple of 8, so that
+// checksumming the file chunk by chunk gives the same result as
+// checksumming it in one go.
+#define SNAPSHOT_CHUNK_BYTES (1u << 20)
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t keyBytes;
+    uint32_t valueBytes;
+    uint64_t count;
+};
+
+/**
+* Folds bytes into a running 64-bit checksum, eight bytes at a time
+* (multiply-xor, in the spirit of FNV-1a). Only the last call for a file
+* may pass a length that is not a multiple of 8.
+*/
+inline uint64_t snapshotChecksum(uint64_t hash, const char* data, std::size_t bytes)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    std::size_t i = 0;
+    for(; i + 8 <= bytes; i += 8){
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 31;
+    }
+    for(; i < bytes; i++){
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * prime;
+    }
+    return hash;
+}
+
+#define SNAPSHOT_CHECKSUM_SEED 0xcbf29ce484222325ULL
+
+/**
+* Syncs the directory holding path, so that a rename into it or a file
+* created in it survives a crash. Returns false if that fails.
+*/
+inline bool syncParentDirectory(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "." :
+                            (slash == 0) ? "/" : path.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0){
+        return false;
+    }
+    int result;
+    do{
+        result = fsync(fd);
+    } while(result != 0 && errno == EINTR);
+    close(fd);
+    return result == 0;
+}
+
+/**
+* Writes a snapshot to path + ".tmp" and renames it over path once it is
+* complete and synced, so a crash never leaves a half-written snapshot
+* under the real name.
+*/
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::string& path, std::size_t keyBytes, std::size_t valueBytes,
+                   uint64_t count);
+    ~SnapshotWriter();
+
+    void write(const void* data, std::size_t bytes);
+    void finish();
+
+private:
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    void flush();
+    void fail();
+
+    std::string path_;
+    std::string tempPath_;
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    std::size_t used_;
+    uint64_t checksum_;
+};
+
+/**
+* Reads a snapshot back. The constructor checks the header; the items are
+* then read with read(), and finish() tells whether the file was intact.
+* Running past the end of the file does not throw, it only makes finish()
+* fail, so a tree can always be built completely before it is judged.
+*/
+class SnapshotReader
+{
+public:
+    SnapshotReader(const std::string& path, std::size_t keyBytes, std::size_t valueBytes);
+    ~SnapshotReader();
+
+    uint64_t count() const;
+    void read(void* data, std::size_t bytes);
+    bool finish();
+
+private:
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    void refill();
+
+    std::FILE* file_;
+    uint64_t count_;
+    uint64_t remaining_;    // item bytes not yet read from the file
+    std::vector<char> buffer_;
+    std::size_t pos_;
+    std::size_t end_;
+    uint64_t checksum_;
+    bool failed_;
+};
+
+/**
+* Input iterator over the items of a snapshot, handing out each one as a
+* std::pair<const Key, Value>, for BinarySearchTree::buildSorted. It also
+* notes whether the keys came in strictly increasing order.
+*/
+template <typename Key, typename Value>
+class SnapshotItems
+{
+public:
+    explicit SnapshotItems(SnapshotReader& reader);
+
+    std::pair<const Key, Value> operator*() const;
+    SnapshotItems& operator++();
+    bool ordered() const;
+
+private:
+    typedef typename std::aligned_storage<sizeof(Key), alignof(Key)>::type KeySlot;
+    typedef typename std::aligned_storage<sizeof(Value), alignof(Value)>::type ValueSlot;
+
+    const Key& key() const;
+    const Value& value() const;
+    void next();
+
+    SnapshotReader* reader_;
+    KeySlot key_;
+    ValueSlot value_;
+    KeySlot previous_;
+    uint64_t left_;         // items not read yet
+    bool started_;
+    bool ordered_;
+};
+
+inline SnapshotWriter::SnapshotWriter(const std::string& path, std::size_t keyBytes,
+                                      std::size_t valueBytes, uint64_t count) :
+    path_(path),
+    tempPath_(path + ".tmp"),
+    file_(NULL),
+    buffer_(SNAPSHOT_CHUNK_BYTES),
+    used_(0),
+    checksum_(SNAPSHOT_CHECKSUM_SEED)
+{
+    file_ = std::fopen(tempPath_.c_str(), "wb");
+    if(file_ == NULL){
+        throw std::runtime_error("Could not create snapshot " + tempPath_);
+    }
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTSNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = 0x01020304u;
+    header.keyBytes = static_cast<uint32_t>(keyBytes);
+    header.valueBytes = static_cast<uint32_t>(valueBytes);
+    header.count = count;
+    if(std::fwrite(&header, sizeof(header), 1, file_) != 1){
+        fail();
+    }
+}
+
+/**
+* A snapshot that was never finished is deleted.
+*/
+inline SnapshotWriter::~SnapshotWriter()
+{
+    if(file_ != NULL){
+        std::fclose(file_);
+        std::remove(tempPath_.c_str());
+    }
+}
+
+inline void SnapshotWriter::write(const void* data, std::size_t bytes)
+{
+    const char* source = static_cast<const char*>(data);
+    while(bytes > 0){
+        std::size_t take = buffer_.size() - used_;
+        if(take > bytes){
+            take = bytes;
+        }
+        std::memcpy(&buffer_[used_], source, take);
+        used_ += take;
+        source += take;
+        bytes -= take;
+        if(used_ == buffer_.size()){
+            flush();
+        }
+    }
+}
+
+/**
+* Writes out what is buffered and the checksum, syncs the file to disk
+* and moves it into place, syncing the directory so the rename is
+* durable too before this returns.
+*/
+inline void SnapshotWriter::finish()
+{
+    flush();
+    if(std::fwrite(&checksum_, sizeof(checksum_), 1, file_) != 1 ||
+       std::fflush(file_) != 0 || fsync(fileno(file_)) != 0){
+        fail();
+    }
+    int closed = std::fclose(file_);
+    file_ = NULL;
+    if(closed != 0 || std::rename(tempPath_.c_str(), path_.c_str()) != 0){
+        std::remove(tempPath_.c_str());
+        throw std::runtime_error("Could not write snapshot " + path_);
+    }
+    if(!syncParentDirectory(path_)){
+        throw std::runtime_error("Could not write snapshot " + path_);
+    }
+}
+
+inline void SnapshotWriter::flush()
+{
+    if(used_ == 0){
+        return;
+    }
+    checksum_ = snapshotChecksum(checksum_, &buffer_[0], used_);
+    if(std::fwrite(&buffer_[0], 1, used_, file_) != used_){
+        fail();
+    }
+    used_ = 0;
+}
+
+inline void SnapshotWriter::fail()
+{
+    std::fclose(file_);
+    file_ = NULL;
+    std::remove(tempPath_.c_str());
+    throw std::runtime_error("Could not write snapshot " + path_);
+}
+
+inline SnapshotReader::SnapshotReader(const std::string& path, std::size_t keyBytes,
+                                      std::size_t valueBytes) :
+    file_(NULL),
+    count_(0),
+    remaining_(0),
+    buffer_(SNAPSHOT_CHUNK_BYTES),
+    pos_(0),
+    end_(0),
+    checksum_(SNAPSHOT_CHECKSUM_SEED),
+    failed_(false)
+{
+    file_ = std::fopen(path.c_str(), "rb");
+    if(file_ == NULL){
+        throw std::runtime_error("Could not open snapshot " + path);
+    }
+    SnapshotHeader header;
+    off_t fileBytes = -1;
+    if(fseeko(file_, 0, SEEK_END) == 0){
+        fileBytes = ftello(file_);
+    }
+    bool valid = fileBytes >= static_cast<off_t>(sizeof(header)) &&
+                 fseeko(file_, 0, SEEK_SET) == 0 &&
+                 std::fread(&header, sizeof(header), 1, file_) == 1 &&
+                 std::memcmp(header.magic, "BSTSNAP", 8) == 0;
+    if(!valid){
+        std::fclose(file_);
+        throw std::runtime_error("Not a snapshot: " + path);
+    }
+    if(header.version != SNAPSHOT_VERSION || header.byteOrder != 0x01020304u ||
+       header.keyBytes != keyBytes || header.valueBytes != valueBytes){
+        std::fclose(file_);
+        throw std::runtime_error("Snapshot " + path + " was saved with a different "
+                                 "version, byte order or key/value type");
+    }
+    //the size must match the count exactly, so that a damaged count can't
+    //make us build a huge tree out of a small file
+    uint64_t recordBytes = keyBytes + valueBytes;
+    uint64_t itemBytes = static_cast<uint64_t>(fileBytes) - sizeof(header) - sizeof(uint64_t);
+    if(static_cast<uint64_t>(fileBytes) < sizeof(header) + sizeof(uint64_t) ||
+       itemBytes % recordBytes != 0 || itemBytes / recordBytes != header.count){
+        std::fclose(file_);
+        throw std::runtime_error("Snapshot " + path + " is truncated or damaged");
+    }
+    count_ = header.count;
+    remaining_ = itemBytes;
+}
+
+inline SnapshotReader::~SnapshotReader()
+{
+    std::fclose(file_);
+}
+
+/**
+* Number of items the snapshot holds.
+*/
+inline uint64_t SnapshotReader::count() const
+{
+    return count_;
+}
+
+/**
+* Copies the next bytes of the items into data, or zeroes if the file ran
+* out (which makes finish() fail).
+*/
+inline void SnapshotReader::read(void* data, std::size_t bytes)
+{
+    char* target = static_cast<char*>(data);
+    while(bytes > 0){
+        if(pos_ == end_){
+            refill();
+            if(pos_ == end_){
+                failed_ = true;
+                std::memset(target, 0, bytes);
+                return;
+            }
+        }
+        std::size_t take = end_ - pos_;
+        if(take > bytes){
+            take = bytes;
+        }
+        std::memcpy(target, &buffer_[pos_], take);
+        pos_ += take;
+        target += take;
+        bytes -= take;
+    }
+}
+
+/**
+* True if every item was read and the file matches its checksum.
+*/
+inline bool SnapshotReader::finish()
+{
+    uint64_t stored;
+    if(failed_ || pos_ != end_ || remaining_ != 0 ||
+       std::fread(&stored, sizeof(stored), 1, file_) != 1){
+        return false;
+    }
+    return stored == checksum_;
+}
+
+inline void SnapshotReader::refill()
+{
+    std::size_t want = buffer_.size();
+    if(want > remaining_){
+        want = static_cast<std::size_t>(remaining_);
+    }
+    std::size_t got = (want == 0) ? 0 : std::fread(&buffer_[0], 1, want, file_);
+    if(got != want){
+        failed_ = true;
+    }
+    checksum_ = snapshotChecksum(checksum_, &buffer_[0], got);
+    remaining_ -= got;
+    pos_ = 0;
+    end_ = got;
+}
+
+template<class Key, class Value>
+SnapshotItems<Key, Value>::SnapshotItems(SnapshotReader& reader) :
+    reader_(&reader),
+    left_(reader.count()),
+    started_(false),
+    ordered_(true)
+{
+    next();
+}
+
+template<class Key, class Value>
+std::pair<const Key, Value> SnapshotItems<Key, Value>::operator*() const
+{
+    return std::pair<const Key, Value>(key(), value());
+}
+
+template<class Key, class Value>
+SnapshotItems<Key, Value>& SnapshotItems<Key, Value>::operator++()
+{
+    std::memcpy(&previous_, &key_, sizeof(Key));
+    started_ = true;
+    next();
+    return *this;
+}
+
+template<class Key, class Value>
+bool SnapshotItems<Key, Value>::ordered() const
+{
+    return ordered_;
+}
+
+template<class Key, class Value>
+const Key& SnapshotItems<Key, Value>::key() const
+{
+    return *reinterpret_cast<const Key*>(&key_);
+}
+
+template<class Key, class Value>
+const Value& SnapshotItems<Key, Value>::value() const
+{
+    return *reinterpret_cast<const Value*>(&value_);
+}
+
+/**
+* Reads the item after the current one; past the last item, reads nothing.
+*/
+template<class Key, class Value>
+void SnapshotItems<Key, Value>::next()
+{
+    if(left_ == 0){
+        return;
+    }
+    left_--;
+    reader_->read(&key_, sizeof(Key));
+    reader_->read(&value_, sizeof(Value));
+    if(started_ && !(*reinterpret_cast<const Key*>(&previous_) < key())){
+        ordered_ = false;
+    }
+}
+
+#endif
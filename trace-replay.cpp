@@ -0,0 +1,278 @@
+// Replays a workload trace (see trace.h) against BinarySearchTree,
+// AVLTree, BTree and std::map, and reports throughput and per-operation
+// latency for each.
+//
+// Every backend starts empty, applies the trace's load records untimed,
+// then runs the remaining records in order. Records are read from the file
+// in batches outside the timed region. As in bench, one operation in every
+// --sample (default 8; 0 for none) is timed on its own into a
+// LatencyHistogram per kind of operation.
+//
+// Keys may be 4- or 8-byte signed or unsigned integers, float or double;
+// values 4 or 8 bytes (replayed as integers of that size, which keeps the
+// node sizes of the recording tree).
+//
+// Usage: trace-replay [--trees bst,avl,btree,map] [--format csv|json]
+//                     [--sample N] trace-file
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bst.h"
+#include "avlbst.h"
+#include "bench_common.h"
+#include "btree.h"
+#include "latency.h"
+#include "trace.h"
+
+#define REPLAY_BATCH 4096
+#define REPLAY_SAMPLE_EVERY 8
+
+static const int opKinds = traceIterate + 1;
+static const char* const opNames[opKinds] = {
+    "all", "load", "insert", "remove", "find", "scan", "iterate"
+};
+
+struct ReplayResult
+{
+    uint64_t ops[opKinds];      // [0] is everything but loads
+    double seconds;
+    LatencyHistogram latency[opKinds];
+    uint64_t checksum;          // keeps the compiler from dropping lookups
+};
+
+struct Settings
+{
+    unsigned sampleEvery;
+    CycleClock clock;
+};
+
+template<typename Backend, typename Key, typename Value>
+static uint64_t apply(Backend& backend, const TraceRecord<Key, Value>& record)
+{
+    uint64_t sum = 0;
+    switch(record.op){
+    case traceLoad:
+    case traceInsert:
+        backend.insert(record.key, record.value);
+        break;
+    case traceRemove:
+        backend.remove(record.key);
+        break;
+    case traceFind:
+        sum = backend.find(record.key);
+        break;
+    case traceScan:
+    case traceIterate:{
+        typename Backend::iterator it = (record.op == traceScan) ?
+                                        backend.tree.lower_bound(record.key) : backend.tree.begin();
+        typename Backend::iterator end = backend.tree.end();
+        for(uint64_t i = 0; i < record.count && it != end; i++, ++it){
+            sum += static_cast<uint64_t>(it->second);
+        }
+        break;
+    }
+    }
+    return sum;
+}
+
+/**
+* Replays the trace at path against a fresh Backend.
+*/
+template<typename Backend, typename Key, typename Value>
+static void replay(const std::string& path, const Settings& settings, ReplayResult& result)
+{
+    Backend backend;
+    TraceReader<Key, Value> reader(path);
+    std::vector<TraceRecord<Key, Value> > batch(REPLAY_BATCH);
+    unsigned countdown = settings.sampleEvery;
+    for(;;){
+        std::size_t count = 0;
+        while(count < batch.size() && reader.next(batch[count])){
+            //loads set up the starting state and aren't measured
+            if(batch[count].op == traceLoad){
+                result.checksum += apply(backend, batch[count]);
+                continue;
+            }
+            result.ops[batch[count].op]++;
+            count++;
+        }
+        if(count == 0){
+            break;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(std::size_t i = 0; i < count; i++){
+            if(settings.sampleEvery == 0 || --countdown != 0){
+                result.checksum += apply(backend, batch[i]);
+                continue;
+            }
+            countdown = settings.sampleEvery;
+            uint64_t begin = CycleClock::now();
+            result.checksum += apply(backend, batch[i]);
+            result.latency[batch[i].op].record(settings.clock.elapsed(begin, CycleClock::now()));
+        }
+        result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.ops[0] += count;
+    }
+    for(int op = traceInsert; op < opKinds; op++){
+        result.latency[0].merge(result.latency[op]);
+    }
+}
+
+/**
+* Prints one row per kind of operation that occurs, CSV (with a header
+* line before the first) or JSON array elements.
+*/
+static void printResult(bool json, bool& first, const std::string& tree,
+                        const ReplayResult& result, const CycleClock& clock)
+{
+    std::string none = json ? "null" : "";
+    for(int op = 0; op < opKinds; op++){
+        if(op == traceLoad || (op != 0 && result.ops[op] == 0)){
+            continue;
+        }
+        bool total = (op == 0);
+        ResultFields fields;
+        fields.push_back(std::make_pair("tree", quoted(tree)));
+        fields.push_back(std::make_pair("op", quoted(opNames[op])));
+        fields.push_back(std::make_pair("ops", std::to_string(result.ops[op])));
+        //only the total has a time of its own
+        addThroughput(fields, result.ops[op], total ? result.seconds : -1, none);
+        addLatency(fields, &result.latency[op], clock, none);
+        printFields(json, first, fields);
+    }
+}
+
+template<typename Key, typename Value>
+static void replayAll(const std::string& path, const std::vector<std::string>& trees,
+                      bool json, const Settings& settings)
+{
+    bool first = true;
+    if(json){
+        std::cout << "[";
+    }
+    for(std::size_t t = 0; t < trees.size(); t++){
+        std::cerr << trees[t] << std::endl;
+        ReplayResult* result = new ReplayResult();
+        if(trees[t] == "bst"){
+            replay<TreeBackend<BinarySearchTree<Key, Value>, Key, Value>, Key, Value>(path, settings, *result);
+        }
+        else if(trees[t] == "avl"){
+            replay<TreeBackend<AVLTree<Key, Value>, Key, Value>, Key, Value>(path, settings, *result);
+        }
+        else if(trees[t] == "btree"){
+            replay<TreeBackend<BTree<Key, Value>, Key, Value>, Key, Value>(path, settings, *result);
+        }
+        else if(trees[t] == "map"){
+            replay<MapBackend<Key, Value>, Key, Value>(path, settings, *result);
+        }
+        else{
+            std::cerr << "unknown tree " << trees[t] << std::endl;
+            delete result;
+            continue;
+        }
+        printResult(json, first, trees[t], *result, settings.clock);
+        delete result;
+    }
+    if(json){
+        std::cout << "\n]" << std::endl;
+    }
+}
+
+template<typename Key>
+static bool replayWithKey(const TraceHeader& header, const std::string& path,
+                          const std::vector<std::string>& trees, bool json, const Settings& settings)
+{
+    if(header.valueBytes == 4){
+        replayAll<Key, int32_t>(path, trees, json, settings);
+    }
+    else if(header.valueBytes == 8){
+        replayAll<Key, int64_t>(path, trees, json, settings);
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "usage: " << program << " [--trees bst,avl,btree,map] [--format csv|json]"
+              << " [--sample N] trace-file" << std::endl;
+    std::exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> trees = splitList("bst,avl,btree,map");
+    bool json = false;
+    Settings settings;
+    settings.sampleEvery = REPLAY_SAMPLE_EVERY;
+    std::string path;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.compare(0, 2, "--") != 0){
+            if(!path.empty()){
+                usage(argv[0]);
+            }
+            path = arg;
+            continue;
+        }
+        if(i + 1 >= argc){
+            usage(argv[0]);
+        }
+        std::string value = argv[++i];
+        if(arg == "--trees"){
+            trees = splitList(value);
+        }
+        else if(arg == "--format" && (value == "csv" || value == "json")){
+            json = (value == "json");
+        }
+        else if(arg == "--sample"){
+            settings.sampleEvery = static_cast<unsigned>(std::strtoul(value.c_str(), NULL, 10));
+        }
+        else{
+            usage(argv[0]);
+        }
+    }
+    if(path.empty()){
+        usage(argv[0]);
+    }
+    settings.clock = CycleClock::calibrate();
+
+    try{
+        TraceHeader header = readTraceHeader(path);
+        bool supported = false;
+        if(header.keyKind == traceSignedKey && header.keyBytes == 4){
+            supported = replayWithKey<int32_t>(header, path, trees, json, settings);
+        }
+        else if(header.keyKind == traceSignedKey && header.keyBytes == 8){
+            supported = replayWithKey<int64_t>(header, path, trees, json, settings);
+        }
+        else if(header.keyKind == traceUnsignedKey && header.keyBytes == 4){
+            supported = replayWithKey<uint32_t>(header, path, trees, json, settings);
+        }
+        else if(header.keyKind == traceUnsignedKey && header.keyBytes == 8){
+            supported = replayWithKey<uint64_t>(header, path, trees, json, settings);
+        }
+        else if(header.keyKind == traceFloatKey && header.keyBytes == 4){
+            supported = replayWithKey<float>(header, path, trees, json, settings);
+        }
+        else if(header.keyKind == traceFloatKey && header.keyBytes == 8){
+            supported = replayWithKey<double>(header, path, trees, json, settings);
+        }
+        if(!supported){
+            std::cerr << path << ": no replay support for " << header.keyBytes << "-byte keys of kind "
+                      << header.keyKind << " with " << header.valueBytes << "-byte values" << std::endl;
+            return 1;
+        }
+    }
+    catch(const std::runtime_error& e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
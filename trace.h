@@ -0,0 +1,423 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+// Workload traces: a compact binary log of the operations run against a
+// tree, recorded in production with TraceRecorder and replayed offline
+// against any backend with trace-replay (see trace-replay.cpp).
+//
+// File layout:
+//
+//   char     magic[8]     "BSTTRACE"
+//   uint32   version      TRACE_VERSION
+//   uint32   byteOrder    0x01020304 as written by the recording machine
+//   uint32   keyBytes     sizeof(Key)
+//   uint32   valueBytes   sizeof(Value)
+//   uint32   keyKind      a TraceKeyKind, so replay can pick a matching type
+//   uint32   reserved
+//   ...      records
+//
+// Each record is an op byte followed by its operands, packed, as raw bytes
+// in the recording machine's byte order:
+//
+//   load     key, value   item already in the tree when recording began
+//   insert   key, value
+//   remove   key
+//   find     key
+//   scan     key, uint64 count   count items visited from lower_bound(key)
+//   iterate  uint64 count        count items visited from begin()
+//
+// Replay applies the load records untimed, so a trace started on a full
+// tree reproduces its lookups faithfully. Keys and values must be
+// trivially copyable.
+
+#define TRACE_VERSION 1u
+
+enum TraceOp
+{
+    traceLoad = 1,
+    traceInsert = 2,
+    traceRemove = 3,
+    traceFind = 4,
+    traceScan = 5,
+    traceIterate = 6
+};
+
+enum TraceKeyKind
+{
+    traceOtherKey = 0,
+    traceSignedKey = 1,
+    traceUnsignedKey = 2,
+    traceFloatKey = 3
+};
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t keyBytes;
+    uint32_t valueBytes;
+    uint32_t keyKind;
+    uint32_t reserved;
+};
+
+template<typename Key, typename Value>
+struct TraceRecord
+{
+    TraceOp op;
+    Key key;        // unused for iterate
+    Value value;    // load and insert only
+    uint64_t count; // scan and iterate only
+};
+
+/**
+* Appends records to a trace file through a large buffer. Throws
+* std::runtime_error if the file can't be written.
+*/
+template<typename Key, typename Value>
+class TraceWriter
+{
+public:
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+
+    void write(TraceOp op, const Key* key, const Value* value, uint64_t count);
+    void flush();
+
+private:
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    void put(const void* data, std::size_t bytes);
+
+    std::string path_;
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    std::size_t used_;
+};
+
+/**
+* Reads a trace back record by record. Throws std::runtime_error if the
+* file isn't a trace of this key/value type or ends inside a record.
+*/
+template<typename Key, typename Value>
+class TraceReader
+{
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+
+    bool next(TraceRecord<Key, Value>& record);
+
+private:
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    void get(void* data, std::size_t bytes);
+
+    std::string path_;
+    std::FILE* file_;
+};
+
+/**
+* Wraps a tree and records the operations made through it. Operations
+* made on the tree directly are not recorded. The tree's contents at the
+* time the recorder is made go into the trace as load records.
+*/
+template<typename Key, typename Value, typename Tree = AVLTree<Key, Value> >
+class TraceRecorder
+{
+public:
+    TraceRecorder(Tree& tree, const std::string& path);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    typename Tree::iterator find(const Key& key);
+    template<typename Callback>
+    std::size_t scan(const Key& from, std::size_t limit, Callback callback);
+    template<typename Callback>
+    std::size_t for_each(Callback callback);
+    void flush();
+
+    Tree& tree();
+
+private:
+    Tree& tree_;
+    TraceWriter<Key, Value> writer_;
+};
+
+/**
+* Describes Key for the trace header.
+*/
+template<typename Key>
+uint32_t traceKeyKind()
+{
+    if(std::is_floating_point<Key>::value){
+        return traceFloatKey;
+    }
+    if(std::is_integral<Key>::value){
+        return std::is_signed<Key>::value ? traceSignedKey : traceUnsignedKey;
+    }
+    return traceOtherKey;
+}
+
+/**
+* Reads just the header of a trace, to find out which types to replay it
+* with. Throws std::runtime_error if path is not a trace.
+*/
+inline TraceHeader readTraceHeader(const std::string& path)
+{
+    TraceHeader header;
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if(file == NULL){
+        throw std::runtime_error("Could not open trace " + path);
+    }
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1;
+    std::fclose(file);
+    if(!ok || std::memcmp(header.magic, "BSTTRACE", 8) != 0 ||
+       header.version != TRACE_VERSION || header.byteOrder != 0x01020304u){
+        throw std::runtime_error(path + " is not a trace for this machine");
+    }
+    return header;
+}
+
+template<typename Key, typename Value>
+TraceWriter<Key, Value>::TraceWriter(const std::string& path) :
+    path_(path),
+    file_(NULL),
+    buffer_(SNAPSHOT_CHUNK_BYTES),
+    used_(0)
+{
+    static_assert(std::is_trivially_copyable<Key>::value &&
+                  std::is_trivially_copyable<Value>::value,
+                  "traces store keys and values as raw bytes");
+    file_ = std::fopen(path.c_str(), "wb");
+    if(file_ == NULL){
+        throw std::runtime_error("Could not create trace " + path);
+    }
+    TraceHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTTRACE", 8);
+    header.version = TRACE_VERSION;
+    header.byteOrder = 0x01020304u;
+    header.keyBytes = sizeof(Key);
+    header.valueBytes = sizeof(Value);
+    header.keyKind = traceKeyKind<Key>();
+    put(&header, sizeof(header));
+}
+
+/**
+* Writes out whatever is still buffered. Errors can't be reported here;
+* call flush() first to see them.
+*/
+template<typename Key, typename Value>
+TraceWriter<Key, Value>::~TraceWriter()
+{
+    if(used_ > 0){
+        std::size_t ignored = std::fwrite(&buffer_[0], 1, used_, file_);
+        (void)ignored;
+    }
+    std::fclose(file_);
+}
+
+template<typename Key, typename Value>
+void TraceWriter<Key, Value>::write(TraceOp op, const Key* key, const Value* value, uint64_t count)
+{
+    uint8_t type = static_cast<uint8_t>(op);
+    put(&type, 1);
+    if(op != traceIterate){
+        put(key, sizeof(Key));
+    }
+    if(op == traceLoad || op == traceInsert){
+        put(value, sizeof(Value));
+    }
+    if(op == traceScan || op == traceIterate){
+        put(&count, sizeof(count));
+    }
+}
+
+template<typename Key, typename Value>
+void TraceWriter<Key, Value>::flush()
+{
+    if(used_ > 0 && std::fwrite(&buffer_[0], 1, used_, file_) != used_){
+        throw std::runtime_error("Could not write trace " + path_);
+    }
+    used_ = 0;
+    if(std::fflush(file_) != 0){
+        throw std::runtime_error("Could not write trace " + path_);
+    }
+}
+
+template<typename Key, typename Value>
+void TraceWriter<Key, Value>::put(const void* data, std::size_t bytes)
+{
+    if(used_ + bytes > buffer_.size()){
+        flush();
+    }
+    std::memcpy(&buffer_[used_], data, bytes);
+    used_ += bytes;
+}
+
+template<typename Key, typename Value>
+TraceReader<Key, Value>::TraceReader(const std::string& path) :
+    path_(path),
+    file_(NULL)
+{
+    TraceHeader header = readTraceHeader(path);
+    if(header.keyBytes != sizeof(Key) || header.valueBytes != sizeof(Value) ||
+       header.keyKind != traceKeyKind<Key>()){
+        throw std::runtime_error(path + " is not a trace for this key/value type");
+    }
+    file_ = std::fopen(path.c_str(), "rb");
+    if(file_ == NULL || std::fseek(file_, sizeof(TraceHeader), SEEK_SET) != 0){
+        if(file_ != NULL){
+            std::fclose(file_);
+        }
+        throw std::runtime_error("Could not open trace " + path);
+    }
+}
+
+template<typename Key, typename Value>
+TraceReader<Key, Value>::~TraceReader()
+{
+    std::fclose(file_);
+}
+
+/**
+* Reads the next record into record. Returns false at the end of the
+* trace.
+*/
+template<typename Key, typename Value>
+bool TraceReader<Key, Value>::next(TraceRecord<Key, Value>& record)
+{
+    int type = std::getc(file_);
+    if(type == EOF){
+        if(std::ferror(file_)){
+            throw std::runtime_error("Could not read trace " + path_);
+        }
+        return false;
+    }
+    if(type < traceLoad || type > traceIterate){
+        throw std::runtime_error(path_ + " has a bad record");
+    }
+    record.op = static_cast<TraceOp>(type);
+    if(record.op != traceIterate){
+        get(&record.key, sizeof(Key));
+    }
+    if(record.op == traceLoad || record.op == traceInsert){
+        get(&record.value, sizeof(Value));
+    }
+    record.count = 0;
+    if(record.op == traceScan || record.op == traceIterate){
+        get(&record.count, sizeof(record.count));
+    }
+    return true;
+}
+
+template<typename Key, typename Value>
+void TraceReader<Key, Value>::get(void* data, std::size_t bytes)
+{
+    if(std::fread(data, 1, bytes, file_) != bytes){
+        throw std::runtime_error(path_ + " ends inside a record");
+    }
+}
+
+template<typename Key, typename Value, typename Tree>
+TraceRecorder<Key, Value, Tree>::TraceRecorder(Tree& tree, const std::string& path) :
+    tree_(tree),
+    writer_(path)
+{
+    for(typename Tree::iterator it = tree_.begin(); it != tree_.end(); ++it){
+        writer_.write(traceLoad, &it->first, &it->second, 0);
+    }
+}
+
+template<typename Key, typename Value, typename Tree>
+void TraceRecorder<Key, Value, Tree>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    writer_.write(traceInsert, &keyValuePair.first, &keyValuePair.second, 0);
+    tree_.insert(keyValuePair);
+}
+
+template<typename Key, typename Value, typename Tree>
+void TraceRecorder<Key, Value, Tree>::remove(const Key& key)
+{
+    writer_.write(traceRemove, &key, NULL, 0);
+    tree_.remove(key);
+}
+
+template<typename Key, typename Value, typename Tree>
+typename Tree::iterator TraceRecorder<Key, Value, Tree>::find(const Key& key)
+{
+    writer_.write(traceFind, &key, NULL, 0);
+    return tree_.find(key);
+}
+
+/**
+* Same as Tree::scan, recording how many items were actually visited.
+*/
+template<typename Key, typename Value, typename Tree>
+template<typename Callback>
+std::size_t TraceRecorder<Key, Value, Tree>::scan(const Key& from, std::size_t limit,
+                                                  Callback callback)
+{
+    std::size_t visited = 0;
+    for(typename Tree::iterator it = tree_.lower_bound(from); it != tree_.end() && visited < limit; ++it){
+        visited++;
+        if(!callback(*it)){
+            break;
+        }
+    }
+    writer_.write(traceScan, &from, NULL, visited);
+    return visited;
+}
+
+/**
+* Calls callback with the items in order until it returns false, and
+* records an iteration over that many items.
+*/
+template<typename Key, typename Value, typename Tree>
+template<typename Callback>
+std::size_t TraceRecorder<Key, Value, Tree>::for_each(Callback callback)
+{
+    std::size_t visited = 0;
+    for(typename Tree::iterator it = tree_.begin(); it != tree_.end(); ++it){
+        visited++;
+        if(!callback(*it)){
+            break;
+        }
+    }
+    writer_.write(traceIterate, NULL, NULL, visited);
+    return visited;
+}
+
+/**
+* Pushes buffered records to the file, throwing if that fails.
+*/
+template<typename Key, typename Value, typename Tree>
+void TraceRecorder<Key, Value, Tree>::flush()
+{
+    writer_.flush();
+}
+
+/**
+* The wrapped tree, for operations that shouldn't be recorded.
+*/
+template<typename Key, typename Value, typename Tree>
+Tree& TraceRecorder<Key, Value, Tree>::tree()
+{
+    return tree_;
+}
+
+#endif
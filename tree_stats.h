@@ -0,0 +1,218 @@
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Hot-path counters for the search trees.
+//
+// Build with -DBST_INSTRUMENT and every BinarySearchTree/AVLTree counts
+// its key comparisons, the nodes each lookup visits, rotations, how far
+// insertFix/removeFix propagate and nodeSwap calls, readable through
+// stats() and reset with reset_stats(). TreeStats can print itself as
+// text or in the Prometheus exposition format.
+//
+// Without BST_INSTRUMENT the counting statements, the counters member and
+// stats()/reset_stats() are all compiled out.
+//
+// Several threads may look things up in one tree at once (the read lock
+// of ConcurrentAVLTree and DurableAVLTree), so every counter is a
+// StatCounter. Bumping one is a relaxed atomic load and store, not a
+// locked read-modify-write, so it costs what a plain increment does.
+// Concurrent bumps can be lost, which makes counts from such trees
+// approximate but never undefined.
+
+#ifdef BST_INSTRUMENT
+// Statement(s) that only exist in instrumented builds
+#define BST_STAT(...) __VA_ARGS__
+// A key comparison that is counted in instrumented builds
+#define BST_COMPARE(comparison) (this->stats_.comparisons++, (comparison))
+#else
+#define BST_STAT(...)
+#define BST_COMPARE(comparison) (comparison)
+#endif
+
+/**
+* A counter that threads may bump and read at the same time without a
+* data race; see above for what that costs and what it gives up.
+*/
+class StatCounter
+{
+public:
+    StatCounter() : value_(0) { }
+    StatCounter(const StatCounter& other) : value_(other.get()) { }
+    StatCounter& operator=(const StatCounter& other) { set(other.get()); return *this; }
+
+    operator uint64_t() const { return get(); }
+    void operator++(int) { set(get() + 1); }
+    void operator--(int) { set(get() - 1); }
+    void operator+=(uint64_t amount) { set(get() + amount); }
+    void raiseTo(uint64_t value) { if(value > get()) set(value); }
+
+private:
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+    void set(uint64_t value) { value_.store(value, std::memory_order_relaxed); }
+
+    std::atomic<uint64_t> value_;
+};
+
+struct TreeStats
+{
+    /**
+    * One rebalancing routine: each update that calls it starts a run,
+    * and every (recursive) call climbs one more level.
+    */
+    struct FixCounts
+    {
+        StatCounter runs;
+        StatCounter levels;      // over all runs
+        StatCounter maxLevels;   // of the longest run
+        StatCounter active;      // levels of the run under way
+    };
+
+    /**
+    * Counts one lookup and the nodes it visits, for as long as it lives.
+    */
+    class Lookup
+    {
+    public:
+        explicit Lookup(TreeStats& stats) : stats_(stats), nodes_(0) { }
+        ~Lookup();
+        void visit() { nodes_++; }
+    private:
+        TreeStats& stats_;
+        uint64_t nodes_;
+    };
+
+    /**
+    * Counts one level of a rebalancing run, for as long as it lives.
+    */
+    class FixLevel
+    {
+    public:
+        explicit FixLevel(FixCounts& counts);
+        ~FixLevel() { counts_.active--; }
+    private:
+        FixCounts& counts_;
+    };
+
+    TreeStats();
+
+    void print(std::ostream& out) const;
+    void printPrometheus(std::ostream& out, const std::string& prefix = "bst",
+                         const std::string& labels = "") const;
+
+    StatCounter lookups;
+    StatCounter lookupNodes;      // nodes visited over all lookups
+    StatCounter maxLookupNodes;   // by the deepest lookup
+    StatCounter comparisons;      // key comparisons in lookups and insert descents
+    StatCounter rotateLeft;
+    StatCounter rotateRight;
+    FixCounts insertFix;
+    FixCounts removeFix;
+    StatCounter nodeSwaps;
+};
+
+inline TreeStats::TreeStats()
+{
+}
+
+inline TreeStats::Lookup::~Lookup()
+{
+    stats_.lookups++;
+    stats_.lookupNodes += nodes_;
+    stats_.maxLookupNodes.raiseTo(nodes_);
+}
+
+inline TreeStats::FixLevel::FixLevel(FixCounts& counts) :
+    counts_(counts)
+{
+    if(counts_.active == 0){
+        counts_.runs++;
+    }
+    counts_.active++;
+    counts_.levels++;
+    counts_.maxLevels.raiseTo(counts_.active);
+}
+
+/**
+* Human-readable dump, one counter per line, with per-lookup and per-run
+* averages.
+*/
+inline void TreeStats::print(std::ostream& out) const
+{
+    out << "lookups: " << lookups << "\n"
+        << "nodes visited per lookup: "
+        << (lookups ? static_cast<double>(lookupNodes) / lookups : 0.0)
+        << " (max " << maxLookupNodes << ")\n"
+        << "key comparisons: " << comparisons << "\n"
+        << "rotations: " << rotateLeft << " left, " << rotateRight << " right\n"
+        << "insertFix: " << insertFix.runs << " runs, "
+        << (insertFix.runs ? static_cast<double>(insertFix.levels) / insertFix.runs : 0.0)
+        << " levels per run (max " << insertFix.maxLevels << ")\n"
+        << "removeFix: " << removeFix.runs << " runs, "
+        << (removeFix.runs ? static_cast<double>(removeFix.levels) / removeFix.runs : 0.0)
+        << " levels per run (max " << removeFix.maxLevels << ")\n"
+        << "nodeSwap calls: " << nodeSwaps << "\n";
+}
+
+/**
+* Dumps the counters in the Prometheus text exposition format. Metric
+* names start with prefix; labels (e.g. tree="users") are added to every
+* sample.
+*/
+inline void TreeStats::printPrometheus(std::ostream& out, const std::string& prefix,
+                                       const std::string& labels) const
+{
+    struct Metric
+    {
+        const char* name;
+        const char* type;
+        const char* help;
+        const char* label;   // extra label for this sample, or NULL
+        uint64_t value;
+    };
+    const Metric metrics[] = {
+        { "lookups_total", "counter", "Lookups (internalFind calls).", NULL, lookups },
+        { "lookup_nodes_total", "counter", "Nodes visited by lookups.", NULL, lookupNodes },
+        { "lookup_nodes_max", "gauge", "Most nodes visited by a single lookup.", NULL, maxLookupNodes },
+        { "comparisons_total", "counter", "Key comparisons in lookups and insert descents.",
+          NULL, comparisons },
+        { "rotations_total", "counter", "Rotations.", "direction=\"left\"", rotateLeft },
+        { "rotations_total", NULL, NULL, "direction=\"right\"", rotateRight },
+        { "insert_fix_runs_total", "counter", "Rebalancing runs after an insert.", NULL, insertFix.runs },
+        { "insert_fix_levels_total", "counter", "Levels climbed by insert rebalancing.",
+          NULL, insertFix.levels },
+        { "insert_fix_levels_max", "gauge", "Levels climbed by the longest insert rebalancing run.",
+          NULL, insertFix.maxLevels },
+        { "remove_fix_runs_total", "counter", "Rebalancing runs after a remove.", NULL, removeFix.runs },
+        { "remove_fix_levels_total", "counter", "Levels climbed by remove rebalancing.",
+          NULL, removeFix.levels },
+        { "remove_fix_levels_max", "gauge", "Levels climbed by the longest remove rebalancing run.",
+          NULL, removeFix.maxLevels },
+        { "node_swaps_total", "counter", "nodeSwap calls.", NULL, nodeSwaps },
+    };
+    for(std::size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++){
+        const Metric& metric = metrics[i];
+        std::string name = prefix + "_" + metric.name;
+        //a sample sharing the previous metric's name shares its HELP/TYPE
+        if(metric.type != NULL){
+            out << "# HELP " << name << " " << metric.help << "\n"
+                << "# TYPE " << name << " " << metric.type << "\n";
+        }
+        std::string sampleLabels = labels;
+        if(metric.label != NULL){
+            sampleLabels += (sampleLabels.empty() ? "" : ",") + std::string(metric.label);
+        }
+        out << name;
+        if(!sampleLabels.empty()){
+            out << "{" << sampleLabels << "}";
+        }
+        out << " " << metric.value << "\n";
+    }
+}
+
+#endif
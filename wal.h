@@ -0,0 +1,395 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+// Write-ahead log of tree mutations, as used by DurableAVLTree
+// (build with -pthread).
+//
+// Each insert or remove is appended as a small fixed-size record: a type
+// byte, the raw key bytes, the raw value bytes (inserts only) and a 32-bit
+// checksum of the record. Appending only copies the record into a memory
+// buffer; commit() then waits until it is on disk. Commits use group
+// commit: the first waiting thread becomes the leader, writes out
+// everything buffered so far with a single write() and fdatasync(), and
+// wakes every thread whose record that covered. Threads that arrive
+// meanwhile queue up for the next sync, so under load there are many
+// commits per fsync.
+//
+// Two knobs trade commit latency for fewer syncs (see WalOptions): the
+// leader can wait up to commitDelay before syncing, to let more records
+// join the batch, and syncs can be capped at maxSyncsPerSecond.
+//
+// On startup replay() hands back every intact record in order. The log
+// ends at the first record that is incomplete or fails its checksum (a
+// write torn by a crash), and the file is cut back to there.
+//
+// File layout: a header (magic "BSTWAL\0\0", version, byte order, key and
+// value sizes as in snapshot.h) followed by the records.
+
+#define WAL_VERSION 1u
+
+/**
+* Group commit tuning. The defaults sync as soon as a commit asks for it;
+* batching then only comes from commits that arrive during a sync.
+*/
+struct WalOptions
+{
+    WalOptions() : commitDelay(0), maxSyncsPerSecond(0) { }
+
+    std::chrono::microseconds commitDelay;  // extra time the leader waits for company
+    unsigned maxSyncsPerSecond;             // 0 means no limit
+};
+
+struct WalHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t keyBytes;
+    uint32_t valueBytes;
+};
+
+class WriteAheadLog
+{
+public:
+    enum RecordType { insertRecord = 1, removeRecord = 2 };
+
+    WriteAheadLog(const std::string& path, std::size_t keyBytes, std::size_t valueBytes,
+                  const WalOptions& options = WalOptions());
+    ~WriteAheadLog();
+
+    template<typename Apply>
+    std::size_t replay(Apply apply);
+    uint64_t append(RecordType type, const void* key, const void* value);
+    void commit(uint64_t sequence);
+    void reset();
+    uint64_t syncCount() const;
+
+private:
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    std::size_t recordBytes(uint8_t type) const;
+    static uint32_t recordChecksum(const char* record, std::size_t bytes);
+    void writeAll(const char* data, std::size_t bytes);
+    bool syncData();
+    void lead(std::unique_lock<std::mutex>& lock);
+
+    int fd_;
+    std::string path_;
+    std::size_t keyBytes_;
+    std::size_t valueBytes_;
+    WalOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable synced_;
+    std::vector<char> pending_;     // appended records not written yet
+    uint64_t appended_;             // sequence number of the last append
+    uint64_t durable_;              // every append up to this one is on disk
+    bool syncing_;                  // a leader is writing and syncing
+    bool failed_;
+    uint64_t syncs_;
+    std::chrono::steady_clock::time_point lastSync_;
+};
+
+/**
+* Opens (or creates) the log at path for records with keys and values of
+* the given sizes. Throws std::runtime_error if it can't, or if the file
+* is a log for different types. Call replay() before appending.
+*/
+inline WriteAheadLog::WriteAheadLog(const std::string& path, std::size_t keyBytes,
+                                    std::size_t valueBytes, const WalOptions& options) :
+    fd_(-1),
+    path_(path),
+    keyBytes_(keyBytes),
+    valueBytes_(valueBytes),
+    options_(options),
+    appended_(0),
+    durable_(0),
+    syncing_(false),
+    failed_(false),
+    syncs_(0)
+{
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if(fd_ < 0 || fstat(fd_, &info) != 0){
+        if(fd_ >= 0){
+            close(fd_);
+        }
+        throw std::runtime_error("Could not open log " + path);
+    }
+    WalHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTWAL", 7);
+    header.version = WAL_VERSION;
+    header.byteOrder = 0x01020304u;
+    header.keyBytes = static_cast<uint32_t>(keyBytes);
+    header.valueBytes = static_cast<uint32_t>(valueBytes);
+    if(info.st_size == 0){
+        //the new file's directory entry must be durable before anything
+        //relies on the log, e.g. a checkpoint emptying it
+        if(pwrite(fd_, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+           !syncData() || !syncParentDirectory(path)){
+            close(fd_);
+            throw std::runtime_error("Could not write log " + path);
+        }
+        return;
+    }
+    WalHeader stored;
+    if(pread(fd_, &stored, sizeof(stored), 0) != static_cast<ssize_t>(sizeof(stored)) ||
+       std::memcmp(&stored, &header, sizeof(header)) != 0){
+        close(fd_);
+        throw std::runtime_error(path + " is not a log for this key/value type");
+    }
+}
+
+/**
+* Closes the log. Records that were appended but never committed are
+* written (without a sync) so that an orderly shutdown loses nothing.
+*/
+inline WriteAheadLog::~WriteAheadLog()
+{
+    if(!failed_ && !pending_.empty()){
+        ssize_t ignored = write(fd_, &pending_[0], pending_.size());
+        (void)ignored;
+    }
+    close(fd_);
+}
+
+/**
+* Calls apply(type, key, value) for every intact record, in order (value
+* is NULL for removals), cuts off a torn tail and leaves the file ready
+* for appending. Returns the number of records replayed.
+*/
+template<typename Apply>
+std::size_t WriteAheadLog::replay(Apply apply)
+{
+    std::vector<char> buffer(SNAPSHOT_CHUNK_BYTES);
+    std::size_t count = 0;
+    off_t offset = sizeof(WalHeader);   // start of the first unreplayed record
+    std::size_t start = 0;
+    std::size_t end = 0;
+    for(;;){
+        //keep at least one whole record of the largest kind in the buffer
+        if(end - start < recordBytes(insertRecord)){
+            std::memmove(&buffer[0], &buffer[start], end - start);
+            end -= start;
+            start = 0;
+            ssize_t got = pread(fd_, &buffer[end], buffer.size() - end,
+                                offset + static_cast<off_t>(end));
+            if(got > 0){
+                end += static_cast<std::size_t>(got);
+            }
+        }
+        if(start == end){
+            break;
+        }
+        uint8_t type = static_cast<uint8_t>(buffer[start]);
+        std::size_t bytes = recordBytes(type);
+        if(bytes == 0 || end - start < bytes){
+            break;
+        }
+        const char* record = &buffer[start];
+        uint32_t checksum;
+        std::memcpy(&checksum, record + bytes - sizeof(checksum), sizeof(checksum));
+        if(checksum != recordChecksum(record, bytes - sizeof(checksum))){
+            break;
+        }
+        apply(type, record + 1, (type == insertRecord) ? record + 1 + keyBytes_ : NULL);
+        count++;
+        start += bytes;
+        offset += static_cast<off_t>(bytes);
+    }
+    if(ftruncate(fd_, offset) != 0 || lseek(fd_, offset, SEEK_SET) < 0 || !syncData()){
+        throw std::runtime_error("Could not recover log " + path_);
+    }
+    return count;
+}
+
+/**
+* Buffers a record and returns its sequence number for commit(). Records
+* are written in the order they were appended.
+*/
+inline uint64_t WriteAheadLog::append(RecordType type, const void* key, const void* value)
+{
+    std::size_t bytes = recordBytes(type);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t at = pending_.size();
+    pending_.resize(at + bytes);
+    char* record = &pending_[at];
+    record[0] = static_cast<char>(type);
+    std::memcpy(record + 1, key, keyBytes_);
+    if(type == insertRecord){
+        std::memcpy(record + 1 + keyBytes_, value, valueBytes_);
+    }
+    uint32_t checksum = recordChecksum(record, bytes - sizeof(checksum));
+    std::memcpy(record + bytes - sizeof(checksum), &checksum, sizeof(checksum));
+    return ++appended_;
+}
+
+/**
+* Returns once the record with the given sequence number (and everything
+* before it) is on disk, syncing as the group's leader if no one else is.
+* Throws std::runtime_error if writing the log failed.
+*/
+inline void WriteAheadLog::commit(uint64_t sequence)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(durable_ < sequence && !failed_){
+        if(syncing_){
+            synced_.wait(lock);
+        }
+        else{
+            lead(lock);
+        }
+    }
+    if(durable_ < sequence){
+        throw std::runtime_error("Could not write log " + path_);
+    }
+}
+
+/**
+* Empties the log once everything in it is covered by a snapshot. No
+* appends may run concurrently; waiting commits are released.
+*/
+inline void WriteAheadLog::reset()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(syncing_){
+        synced_.wait(lock);
+    }
+    pending_.clear();
+    if(ftruncate(fd_, sizeof(WalHeader)) != 0 ||
+       lseek(fd_, sizeof(WalHeader), SEEK_SET) < 0 || !syncData()){
+        failed_ = true;
+        synced_.notify_all();
+        throw std::runtime_error("Could not reset log " + path_);
+    }
+    durable_ = appended_;
+    synced_.notify_all();
+}
+
+/**
+* Number of syncs so far, to see how well commits are being grouped.
+*/
+inline uint64_t WriteAheadLog::syncCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return syncs_;
+}
+
+/**
+* Size of a record of the given type, or 0 if there is no such type.
+*/
+inline std::size_t WriteAheadLog::recordBytes(uint8_t type) const
+{
+    if(type == insertRecord){
+        return 1 + keyBytes_ + valueBytes_ + sizeof(uint32_t);
+    }
+    if(type == removeRecord){
+        return 1 + keyBytes_ + sizeof(uint32_t);
+    }
+    return 0;
+}
+
+inline uint32_t WriteAheadLog::recordChecksum(const char* record, std::size_t bytes)
+{
+    uint64_t hash = snapshotChecksum(SNAPSHOT_CHECKSUM_SEED, record, bytes);
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+inline void WriteAheadLog::writeAll(const char* data, std::size_t bytes)
+{
+    while(bytes > 0){
+        ssize_t written = write(fd_, data, bytes);
+        if(written < 0){
+            //a signal before anything was written is no failure
+            if(errno == EINTR){
+                continue;
+            }
+            throw std::runtime_error("Could not write log " + path_);
+        }
+        data += written;
+        bytes -= static_cast<std::size_t>(written);
+    }
+}
+
+/**
+* fdatasync()s the log, retrying when a signal interrupts it.
+*/
+inline bool WriteAheadLog::syncData()
+{
+    while(fdatasync(fd_) != 0){
+        if(errno != EINTR){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* Syncs as the leader of a group: waits out commitDelay and the sync rate
+* limit (letting later records join), then writes and syncs everything
+* buffered, without holding the lock while doing so.
+*/
+inline void WriteAheadLog::lead(std::unique_lock<std::mutex>& lock)
+{
+    syncing_ = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now() +
+                                                  options_.commitDelay;
+    if(options_.maxSyncsPerSecond > 0 && syncs_ > 0){
+        std::chrono::steady_clock::time_point allowed = lastSync_ +
+            std::chrono::microseconds(1000000 / options_.maxSyncsPerSecond);
+        if(allowed > start){
+            start = allowed;
+        }
+    }
+    if(start > std::chrono::steady_clock::now()){
+        lock.unlock();
+        std::this_thread::sleep_until(start);
+        lock.lock();
+    }
+
+    std::vector<char> batch;
+    batch.swap(pending_);
+    uint64_t covered = appended_;
+    lock.unlock();
+    bool ok = true;
+    try{
+        if(!batch.empty()){
+            writeAll(&batch[0], batch.size());
+        }
+        ok = syncData();
+    }
+    catch(const std::runtime_error&){
+        ok = false;
+    }
+    lock.lock();
+    syncs_++;
+    lastSync_ = std::chrono::steady_clock::now();
+    if(ok){
+        durable_ = covered;
+    }
+    else{
+        failed_ = true;
+    }
+    syncing_ = false;
+    synced_.notify_all();
+}
+
+#endif